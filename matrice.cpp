@@ -4,6 +4,45 @@
 #include <stdexcept>
 #include <limits>
 #include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <future>
+#include <algorithm>
+#include <cctype>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <thread>
+#include <random>
+#include <set>
+#include <deque>
+#include <sstream>
+#include <type_traits>
+#include <utility>
+#include <memory_resource>
+#include <new>
+#include <cstdlib>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 // Node structure for matrix elements
 struct MatrixNode {
@@ -14,665 +53,7606 @@ struct MatrixNode {
     MatrixNode(int c, double v) : col(c), value(v), next(nullptr) {}
 };
 
-// Row structure for matrix rows
+// 64-bit mixing function (splitmix64 finalizer) used for matrix fingerprints
+inline uint64_t mixHash(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Element slots allocated together with a row node. Most rows are short, so
+// their elements live right after the row header instead of in separate
+// allocations; a row only allocates nodes for elements beyond its slots.
+const int ROW_INLINE_ELEMENTS = 4;
+
+// Row structure for matrix rows. The row's `capacity` element slots follow
+// it in the same allocation and are linked into `elements` like any other
+// node, so code walking a row does not see the difference.
 struct RowNode {
     int row;            // Row index
+    unsigned char capacity; // Element slots allocated after this node
+    unsigned char used;     // Bit i is set while slot i holds an element
     MatrixNode* elements; // Linked list of elements in this row
     RowNode* next;      // Next row in the matrix
     
-    RowNode(int r) : row(r), elements(nullptr), next(nullptr) {}
+    RowNode(int r, int slots) : row(r), capacity(static_cast<unsigned char>(slots)), used(0),
+                                elements(nullptr), next(nullptr) {}
     
-    // Destructor to clean up all column nodes
-    ~RowNode() {
-        MatrixNode* current = elements;
-        while (current != nullptr) {
-            MatrixNode* temp = current;
-            current = current->next;
-            delete temp;
-        }
+    // Bytes to allocate for a row with the given number of slots
+    static size_t allocationSize(int slots) {
+        return sizeof(RowNode) + static_cast<size_t>(slots) * sizeof(MatrixNode);
+    }
+    
+    MatrixNode* slots() { return reinterpret_cast<MatrixNode*>(this + 1); }
+    
+    bool isInline(const MatrixNode* node) const {
+        uintptr_t first = reinterpret_cast<uintptr_t>(this + 1);
+        uintptr_t at = reinterpret_cast<uintptr_t>(node);
+        return at >= first && at < first + capacity * sizeof(MatrixNode);
     }
 };
 
-// Sparse Matrix class using linked lists
-class SparseMatrix {
+// Header of the binary on-disk format. It is followed by the matrix in CSR
+// layout: int64 row pointers (rows + 1), double values (nnz), int32 columns (nnz)
+struct BinaryHeader {
+    char magic[4];      // Always "SPMX"
+    uint32_t version;   // Format version
+    int32_t rows;       // Number of rows
+    int32_t cols;       // Number of columns
+    int64_t nnz;        // Number of stored (non-zero) elements
+    uint64_t flags;     // Format variants (BINARY_FLAG_*), zero for plain CSR
+};
+
+static_assert(sizeof(BinaryHeader) == 32, "BinaryHeader must stay 32 bytes");
+
+const uint32_t BINARY_FORMAT_VERSION = 1;
+
+// The arrays are stored as independently compressed blocks of rows. The header
+// is followed by a uint64 block count, one CompressedBlock per block and the
+// block data.
+const uint64_t BINARY_FLAG_COMPRESSED = 1;
+
+// Index entry of one block in the compressed binary format
+struct CompressedBlock {
+    int32_t firstRow;       // First row in the block
+    int32_t rowCount;       // Rows in the block
+    int64_t firstElement;   // Position of the block's first element in the whole matrix
+    uint64_t offset;        // Start of the block data, from the start of the file
+    uint64_t length;        // Bytes of block data
+};
+
+static_assert(sizeof(CompressedBlock) == 32, "CompressedBlock must stay 32 bytes");
+
+// Codec for one block of the compressed binary format. Row lengths and
+// column gaps (the first column of a row is stored as is) are bit-packed at
+// the smallest width that fits the block. Values use whichever is smallest:
+// their bytes shuffled so that byte k of every value is stored together
+// (sign/exponent bytes then sit side by side), the same followed by
+// run-length coding, or a dictionary of distinct values with bit-packed codes.
+class BlockCodec {
 private:
-    int rows;           // Number of rows
-    int cols;           // Number of columns
-    RowNode* rowList;   // Linked list of rows
+    enum ValueCodec { Shuffled = 0, ShuffledRuns = 1, Dictionary = 2 };
     
-    // Helper function to get a row node (creates it if it doesn't exist)
-    RowNode* getRowNode(int r, bool create = false) {
-        if (r < 0 || r >= rows) {
-            throw std::out_of_range("Row index out of range");
+    struct Header {
+        uint8_t lengthWidth;    // Bits per row length
+        uint8_t columnWidth;    // Bits per column gap
+        uint8_t valueCodec;     // ValueCodec
+        uint8_t codeWidth;      // Bits per dictionary code
+        uint32_t valueBytes;    // Size of the value section
+    };
+    
+    static int bitWidth(uint64_t value) {
+        int width = 0;
+        while (value >> width) {
+            width++;
         }
+        return width;
+    }
+    
+    class BitWriter {
+    private:
+        std::string& out;
+        uint64_t pending;
+        int pendingBits;
         
-        // If rowList is empty, create first row node
-        if (rowList == nullptr && create) {
-            rowList = new RowNode(r);
-            return rowList;
+    public:
+        explicit BitWriter(std::string& target) : out(target), pending(0), pendingBits(0) {}
+        
+        void put(uint64_t value, int width) {
+            pending |= value << pendingBits;
+            pendingBits += width;
+            while (pendingBits >= 8) {
+                out.push_back(static_cast<char>(pending & 0xFF));
+                pending >>= 8;
+                pendingBits -= 8;
+            }
         }
         
-        // If the first row is greater than r and we need to create, insert at beginning
-        if (rowList != nullptr && rowList->row > r && create) {
-            RowNode* newRow = new RowNode(r);
-            newRow->next = rowList;
-            rowList = newRow;
-            return newRow;
+        void finish() {
+            if (pendingBits > 0) {
+                out.push_back(static_cast<char>(pending & 0xFF));
+            }
+            pending = 0;
+            pendingBits = 0;
         }
+    };
+    
+    class BitReader {
+    private:
+        const unsigned char* data;
+        const unsigned char* end;
+        uint64_t pending;
+        int pendingBits;
         
-        // Look for existing row or place to insert
-        RowNode* prev = nullptr;
-        RowNode* current = rowList;
+    public:
+        BitReader(const char* begin, size_t length)
+            : data(reinterpret_cast<const unsigned char*>(begin)), end(data + length), pending(0), pendingBits(0) {}
         
-        while (current != nullptr && current->row < r) {
-            prev = current;
-            current = current->next;
+        uint64_t get(int width) {
+            while (pendingBits < width) {
+                if (data == end) {
+                    throw std::runtime_error("Corrupt compressed block: data ends early");
+                }
+                pending |= static_cast<uint64_t>(*data++) << pendingBits;
+                pendingBits += 8;
+            }
+            uint64_t value = pending & ((1ULL << width) - 1);
+            pending >>= width;
+            pendingBits -= width;
+            return value;
         }
-        
-        // Found existing row
-        if (current != nullptr && current->row == r) {
-            return current;
+    };
+    
+    // Run-length coding: a control byte c < 128 is followed by c + 1 literal
+    // bytes, c >= 128 by one byte repeated c - 125 times
+    static std::string encodeRuns(const std::string& bytes) {
+        std::string out;
+        size_t i = 0;
+        while (i < bytes.size()) {
+            size_t run = 1;
+            while (i + run < bytes.size() && run < 130 && bytes[i + run] == bytes[i]) {
+                run++;
+            }
+            if (run >= 3) {
+                out.push_back(static_cast<char>(run + 125));
+                out.push_back(bytes[i]);
+                i += run;
+                continue;
+            }
+            size_t literal = i;
+            while (literal < bytes.size() && literal - i < 128 &&
+                   !(literal + 2 < bytes.size() && bytes[literal] == bytes[literal + 1] && bytes[literal] == bytes[literal + 2])) {
+                literal++;
+            }
+            out.push_back(static_cast<char>(literal - i - 1));
+            out.append(bytes, i, literal - i);
+            i = literal;
         }
-        
-        // Need to create a new row node
-        if (create) {
-            RowNode* newRow = new RowNode(r);
-            if (prev == nullptr) {
-                // Insert at start (should not happen due to checks above)
-                newRow->next = rowList;
-                rowList = newRow;
+        return out;
+    }
+    
+    static void decodeRuns(const char* data, size_t length, char* out, size_t expected) {
+        size_t i = 0;
+        size_t written = 0;
+        while (i < length) {
+            unsigned char control = static_cast<unsigned char>(data[i++]);
+            size_t count = control < 128 ? control + 1 : control - 125;
+            if (written + count > expected || (control < 128 ? i + count > length : i >= length)) {
+                throw std::runtime_error("Corrupt compressed block: bad run");
+            }
+            if (control < 128) {
+                std::memcpy(out + written, data + i, count);
+                i += count;
             } else {
-                // Insert between prev and current
-                newRow->next = current;
-                prev->next = newRow;
+                std::memset(out + written, data[i++], count);
             }
-            return newRow;
+            written += count;
+        }
+        if (written != expected) {
+            throw std::runtime_error("Corrupt compressed block: values are truncated");
         }
-        
-        return nullptr; // Row doesn't exist and we're not creating it
     }
     
-    // Helper function to insert an element into a row's linked list
-    void insertIntoRow(RowNode* rowNode, int c, double v) {
-        if (c < 0 || c >= cols) {
-            throw std::out_of_range("Column index out of range");
-        }
+public:
+    // Encode rowCount rows; rowPtr holds absolute positions into colIdx/values
+    static std::string encode(const int64_t* rowPtr, int rowCount, const int32_t* colIdx, const double* values) {
+        int64_t first = rowPtr[0];
+        int64_t count = rowPtr[rowCount] - first;
         
-        // If value is zero, we might need to remove existing element
-        if (std::abs(v) < 1e-10) {
-            removeFromRow(rowNode, c);
-            return;
+        uint64_t maxLength = 0;
+        uint64_t maxGap = 0;
+        for (int r = 0; r < rowCount; r++) {
+            maxLength = std::max<uint64_t>(maxLength, rowPtr[r + 1] - rowPtr[r]);
+            for (int64_t k = rowPtr[r]; k < rowPtr[r + 1]; k++) {
+                maxGap = std::max<uint64_t>(maxGap, k == rowPtr[r] ? colIdx[k] : colIdx[k] - colIdx[k - 1]);
+            }
         }
         
-        // If row has no elements, create first element
-        if (rowNode->elements == nullptr) {
-            rowNode->elements = new MatrixNode(c, v);
-            return;
-        }
+        Header header;
+        header.lengthWidth = static_cast<uint8_t>(bitWidth(maxLength));
+        header.columnWidth = static_cast<uint8_t>(bitWidth(maxGap));
+        header.codeWidth = 0;
         
-        // If first element's column is greater than c, insert at beginning
-        if (rowNode->elements->col > c) {
-            MatrixNode* newNode = new MatrixNode(c, v);
-            newNode->next = rowNode->elements;
-            rowNode->elements = newNode;
-            return;
+        std::string indices;
+        BitWriter writer(indices);
+        for (int r = 0; r < rowCount; r++) {
+            writer.put(static_cast<uint64_t>(rowPtr[r + 1] - rowPtr[r]), header.lengthWidth);
         }
+        writer.finish();
+        for (int r = 0; r < rowCount; r++) {
+            for (int64_t k = rowPtr[r]; k < rowPtr[r + 1]; k++) {
+                writer.put(static_cast<uint64_t>(k == rowPtr[r] ? colIdx[k] : colIdx[k] - colIdx[k - 1]), header.columnWidth);
+            }
+        }
+        writer.finish();
         
-        // Look for existing column or place to insert
-        MatrixNode* prev = nullptr;
-        MatrixNode* current = rowNode->elements;
-        
-        while (current != nullptr && current->col < c) {
-            prev = current;
-            current = current->next;
+        std::string shuffled(static_cast<size_t>(count) * sizeof(double), '\0');
+        for (int64_t k = 0; k < count; k++) {
+            unsigned char bytes[sizeof(double)];
+            std::memcpy(bytes, &values[first + k], sizeof(double));
+            for (size_t b = 0; b < sizeof(double); b++) {
+                shuffled[b * count + k] = static_cast<char>(bytes[b]);
+            }
         }
+        std::string best = shuffled;
+        header.valueCodec = Shuffled;
         
-        // Found existing column, update value
-        if (current != nullptr && current->col == c) {
-            current->value = v;
-            return;
+        std::string runs = encodeRuns(shuffled);
+        if (runs.size() < best.size()) {
+            best = runs;
+            header.valueCodec = ShuffledRuns;
         }
         
-        // Insert new node between prev and current
-        MatrixNode* newNode = new MatrixNode(c, v);
-        if (prev == nullptr) {
-            // Should not reach here due to checks above
-            newNode->next = rowNode->elements;
-            rowNode->elements = newNode;
-        } else {
-            newNode->next = current;
-            prev->next = newNode;
+        // Dictionary, tried only while the distinct values stay few
+        std::map<uint64_t, uint32_t> dictionary;
+        std::vector<uint64_t> distinct;
+        for (int64_t k = 0; k < count && distinct.size() <= static_cast<size_t>(count / 4); k++) {
+            uint64_t bits;
+            std::memcpy(&bits, &values[first + k], sizeof(bits));
+            if (dictionary.insert(std::make_pair(bits, static_cast<uint32_t>(distinct.size()))).second) {
+                distinct.push_back(bits);
+            }
+        }
+        if (count > 0 && distinct.size() <= static_cast<size_t>(count / 4)) {
+            int codeWidth = bitWidth(distinct.size() - 1);
+            std::string coded;
+            uint32_t distinctCount = static_cast<uint32_t>(distinct.size());
+            coded.append(reinterpret_cast<const char*>(&distinctCount), sizeof(distinctCount));
+            coded.append(reinterpret_cast<const char*>(distinct.data()), distinct.size() * sizeof(uint64_t));
+            BitWriter codes(coded);
+            for (int64_t k = 0; k < count; k++) {
+                uint64_t bits;
+                std::memcpy(&bits, &values[first + k], sizeof(bits));
+                codes.put(dictionary[bits], codeWidth);
+            }
+            codes.finish();
+            if (coded.size() < best.size()) {
+                best = coded;
+                header.valueCodec = Dictionary;
+                header.codeWidth = static_cast<uint8_t>(codeWidth);
+            }
         }
+        header.valueBytes = static_cast<uint32_t>(best.size());
+        
+        std::string block(reinterpret_cast<const char*>(&header), sizeof(header));
+        block += indices;
+        block += best;
+        return block;
     }
     
-    // Helper function to remove an element from a row
-    void removeFromRow(RowNode* rowNode, int c) {
-        if (rowNode == nullptr || rowNode->elements == nullptr) {
-            return;
+    // Decode a block of rowCount rows and `count` elements: row lengths into
+    // rowLength, elements into colIdx/values
+    static void decode(const char* data, size_t length, int rowCount, int64_t count, int cols,
+                       int64_t* rowLength, int32_t* colIdx, double* values) {
+        Header header;
+        if (length < sizeof(header)) {
+            throw std::runtime_error("Corrupt compressed block: too short");
         }
-        
-        // If first element is the one to remove
-        if (rowNode->elements->col == c) {
-            MatrixNode* temp = rowNode->elements;
-            rowNode->elements = rowNode->elements->next;
-            delete temp;
-            return;
+        std::memcpy(&header, data, sizeof(header));
+        if (header.lengthWidth > 32 || header.columnWidth > 32 || header.codeWidth > 32 ||
+            header.valueBytes > length - sizeof(header)) {
+            throw std::runtime_error("Corrupt compressed block: bad header");
         }
+        size_t valueStart = length - header.valueBytes;
         
-        // Look for the element to remove
-        MatrixNode* prev = rowNode->elements;
-        MatrixNode* current = prev->next;
-        
-        while (current != nullptr && current->col != c) {
-            prev = current;
-            current = current->next;
+        BitReader reader(data + sizeof(header), valueStart - sizeof(header));
+        int64_t total = 0;
+        for (int r = 0; r < rowCount; r++) {
+            rowLength[r] = static_cast<int64_t>(reader.get(header.lengthWidth));
+            total += rowLength[r];
+        }
+        if (total != count) {
+            throw std::runtime_error("Corrupt compressed block: row lengths do not match element count");
+        }
+        size_t lengthBytes = (static_cast<size_t>(rowCount) * header.lengthWidth + 7) / 8;
+        BitReader columns(data + sizeof(header) + lengthBytes, valueStart - sizeof(header) - lengthBytes);
+        int64_t k = 0;
+        for (int r = 0; r < rowCount; r++) {
+            int64_t column = 0;
+            for (int64_t e = 0; e < rowLength[r]; e++, k++) {
+                uint64_t gap = columns.get(header.columnWidth);
+                if (e > 0 && gap == 0) {
+                    throw std::runtime_error("Corrupt compressed block: columns are not increasing");
+                }
+                column = (e == 0 ? 0 : column) + static_cast<int64_t>(gap);
+                if (column >= cols) {
+                    throw std::runtime_error("Corrupt compressed block: bad column index");
+                }
+                colIdx[k] = static_cast<int32_t>(column);
+            }
         }
         
-        // If found, remove it
-        if (current != nullptr) {
-            prev->next = current->next;
-            delete current;
+        const char* valueData = data + valueStart;
+        size_t valueSize = static_cast<size_t>(count) * sizeof(double);
+        std::string shuffled;
+        if (header.valueCodec == Dictionary) {
+            uint32_t distinctCount;
+            if (header.valueBytes < sizeof(distinctCount)) {
+                throw std::runtime_error("Corrupt compressed block: bad dictionary");
+            }
+            std::memcpy(&distinctCount, valueData, sizeof(distinctCount));
+            if (distinctCount == 0 || (header.valueBytes - sizeof(distinctCount)) / sizeof(double) < distinctCount) {
+                throw std::runtime_error("Corrupt compressed block: bad dictionary");
+            }
+            const char* entries = valueData + sizeof(distinctCount);
+            size_t codeStart = sizeof(distinctCount) + distinctCount * sizeof(double);
+            BitReader codes(valueData + codeStart, header.valueBytes - codeStart);
+            for (int64_t e = 0; e < count; e++) {
+                uint64_t code = codes.get(header.codeWidth);
+                if (code >= distinctCount) {
+                    throw std::runtime_error("Corrupt compressed block: bad dictionary code");
+                }
+                std::memcpy(&values[e], entries + code * sizeof(double), sizeof(double));
+            }
+            return;
+        }
+        if (header.valueCodec == ShuffledRuns) {
+            shuffled.resize(valueSize);
+            decodeRuns(valueData, header.valueBytes, &shuffled[0], valueSize);
+            valueData = shuffled.data();
+        } else if (header.valueCodec != Shuffled || header.valueBytes != valueSize) {
+            throw std::runtime_error("Corrupt compressed block: bad value section");
+        }
+        for (int64_t e = 0; e < count; e++) {
+            unsigned char bytes[sizeof(double)];
+            for (size_t b = 0; b < sizeof(double); b++) {
+                bytes[b] = static_cast<unsigned char>(valueData[b * count + e]);
+            }
+            std::memcpy(&values[e], bytes, sizeof(double));
         }
     }
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows it
+class MappedFile {
+private:
+    const char* data;   // Start of the file contents
+    size_t length;      // Size of the file in bytes
+#ifdef _WIN32
+    std::vector<char> buffer; // Fallback copy of the file contents
+#endif
     
-    // Helper function to clean up empty rows
-    void cleanupEmptyRows() {
-        if (rowList == nullptr) {
-            return;
+public:
+    // Map a file, or with sharedMemory set a POSIX shared memory object
+    explicit MappedFile(const std::string& path, bool sharedMemory = false) : data(nullptr), length(0) {
+#ifdef _WIN32
+        if (sharedMemory) {
+            throw std::runtime_error("Shared memory is not supported on this platform");
         }
-        
-        // Check if first row is empty
-        while (rowList != nullptr && rowList->elements == nullptr) {
-            RowNode* temp = rowList;
-            rowList = rowList->next;
-            delete temp;
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Cannot open file " + path);
         }
-        
-        if (rowList == nullptr) {
-            return;
+        buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        length = buffer.size();
+#else
+        int fd = sharedMemory ? shm_open(path.c_str(), O_RDONLY, 0) : open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error((sharedMemory ? "Cannot open shared memory " : "Cannot open file ") + path);
         }
-        
-        // Check remaining rows
-        RowNode* prev = rowList;
-        RowNode* current = prev->next;
-        
-        while (current != nullptr) {
-            if (current->elements == nullptr) {
-                prev->next = current->next;
-                delete current;
-                current = prev->next;
-            } else {
-                prev = current;
-                current = current->next;
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat file " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("Cannot map file " + path);
             }
+            data = static_cast<const char*>(mapped);
         }
+        close(fd); // The mapping stays valid after the descriptor is closed
+#endif
     }
     
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), length);
+        }
+#endif
+    }
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* bytes() const { return data; }
+    size_t size() const { return length; }
+};
+
+// Positioned reads from one file; several threads may read at once
+class FileReader {
+private:
+    std::string path;
+    uint64_t length;
+#ifndef _WIN32
+    int fd;
+#endif
+    
 public:
-    // Constructor
-    SparseMatrix(int r, int c) : rows(r), cols(c), rowList(nullptr) {
-        if (r <= 0 || c <= 0) {
-            throw std::invalid_argument("Matrix dimensions must be positive");
+    explicit FileReader(const std::string& filePath) : path(filePath), length(0) {
+#ifdef _WIN32
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) {
+            throw std::runtime_error("Cannot open file " + path);
+        }
+        length = static_cast<uint64_t>(in.tellg());
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Cannot open file " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("Cannot stat file " + path);
         }
+        length = static_cast<uint64_t>(st.st_size);
+#endif
     }
     
-    // Copy constructor
-    SparseMatrix(const SparseMatrix& other) : rows(other.rows), cols(other.cols), rowList(nullptr) {
-        // Deep copy each row and its elements
-        RowNode* otherRow = other.rowList;
-        RowNode* lastRow = nullptr;
-        
-        while (otherRow != nullptr) {
-            // Create a new row
-            RowNode* newRow = new RowNode(otherRow->row);
-            
-            // Add to our row list
-            if (lastRow == nullptr) {
-                rowList = newRow;
-            } else {
-                lastRow->next = newRow;
+    ~FileReader() {
+#ifndef _WIN32
+        close(fd);
+#endif
+    }
+    
+    FileReader(const FileReader&) = delete;
+    FileReader& operator=(const FileReader&) = delete;
+    
+    uint64_t size() const { return length; }
+    
+    // Read count bytes starting at offset into out
+    void readAt(uint64_t offset, size_t count, char* out) const {
+#ifdef _WIN32
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(static_cast<std::streamoff>(offset));
+        if (!in.read(out, static_cast<std::streamsize>(count))) {
+            throw std::runtime_error("Failed reading file " + path);
+        }
+#else
+        while (count > 0) {
+            ssize_t got = pread(fd, out, count, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR) {
+                continue;
             }
-            lastRow = newRow;
-            
-            // Copy all elements in this row
-            MatrixNode* otherElement = otherRow->elements;
-            MatrixNode* lastElement = nullptr;
-            
-            while (otherElement != nullptr) {
-                MatrixNode* newElement = new MatrixNode(otherElement->col, otherElement->value);
-                
-                // Add to our element list
-                if (lastElement == nullptr) {
-                    newRow->elements = newElement;
-                } else {
-                    lastElement->next = newElement;
-                }
-                lastElement = newElement;
-                
-                otherElement = otherElement->next;
+            if (got <= 0) {
+                throw std::runtime_error("Failed reading file " + path);
             }
-            
-            otherRow = otherRow->next;
+            out += got;
+            offset += static_cast<uint64_t>(got);
+            count -= static_cast<size_t>(got);
         }
+#endif
     }
+};
+
+// Thrown when a long-running operation is cancelled or exceeds its limits
+class OperationAborted : public std::runtime_error {
+public:
+    explicit OperationAborted(const std::string& message) : std::runtime_error(message) {}
+};
+
+// Progress reporting, cancellation and limits for one long-running operation.
+// Kernels that accept a control call checkpoint() once per row they process;
+// another thread may call cancel() or read the progress at any time.
+class OperationControl {
+private:
+    std::atomic<bool> cancelled;
+    std::atomic<long long> done;     // Rows processed so far
+    std::atomic<long long> total;    // Rows to process in the current kernel
+    std::chrono::steady_clock::time_point deadline;
+    bool hasDeadline;
+    size_t memoryLimit;              // Bytes allowed for the result, 0 = unlimited
     
-    // Destructor
-    ~SparseMatrix() {
-        RowNode* current = rowList;
-        while (current != nullptr) {
-            RowNode* temp = current;
-            current = current->next;
-            delete temp;
+public:
+    // Optional callback, called from the working thread with (rows done, total rows)
+    std::function<void(long long, long long)> onProgress;
+    
+    OperationControl() : cancelled(false), done(0), total(0), hasDeadline(false), memoryLimit(0) {}
+    
+    OperationControl(double timeoutSeconds, size_t memoryLimitBytes)
+        : cancelled(false), done(0), total(0), hasDeadline(false), memoryLimit(memoryLimitBytes) {
+        setTimeout(timeoutSeconds);
+    }
+    
+    OperationControl(const OperationControl&) = delete;
+    OperationControl& operator=(const OperationControl&) = delete;
+    
+    // Give up after the given number of seconds (0 means no time limit)
+    void setTimeout(double seconds) {
+        hasDeadline = seconds > 0;
+        if (hasDeadline) {
+            deadline = std::chrono::steady_clock::now() +
+                       std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
         }
     }
     
-    // Assignment operator
-    SparseMatrix& operator=(const SparseMatrix& other) {
-        if (this != &other) {
-            // Clear existing data
-            RowNode* current = rowList;
-            while (current != nullptr) {
-                RowNode* temp = current;
-                current = current->next;
-                delete temp;
-            }
-            
-            // Copy from other
-            rows = other.rows;
-            cols = other.cols;
-            rowList = nullptr;
-            
-            // Deep copy rows and elements (same as copy constructor)
-            RowNode* otherRow = other.rowList;
-            RowNode* lastRow = nullptr;
-            
-            while (otherRow != nullptr) {
-                RowNode* newRow = new RowNode(otherRow->row);
+    // Limit the memory of the result being built (0 means unlimited)
+    void setMemoryLimit(size_t bytes) { memoryLimit = bytes; }
+    
+    // Ask the operation to stop at its next checkpoint
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled; }
+    
+    long long rowsDone() const { return done; }
+    long long rowsTotal() const { return total; }
+    
+    // Record progress and stop the operation if it was cancelled or is over
+    // its limits. resultElements is the number of elements built so far.
+    void checkpoint(long long rowsProcessed, long long rowsToProcess, size_t resultElements) {
+        done = rowsProcessed;
+        total = rowsToProcess;
+        if (onProgress) {
+            onProgress(rowsProcessed, rowsToProcess);
+        }
+        if (cancelled) {
+            throw OperationAborted("Operation cancelled");
+        }
+        if (hasDeadline && std::chrono::steady_clock::now() > deadline) {
+            throw OperationAborted("Operation timed out");
+        }
+        if (memoryLimit > 0 && resultElements * (sizeof(MatrixNode) + sizeof(RowNode)) > memoryLimit) {
+            throw OperationAborted("Operation exceeded its memory limit");
+        }
+    }
+};
+
+// A matrix flattened into CSR arrays owned by the caller
+struct CSRArrays {
+    int rows;
+    int cols;
+    std::vector<int64_t> rowPtr;    // Start of each row in colIdx/values (rows + 1 entries)
+    std::vector<int32_t> colIdx;    // Column of each element, increasing within a row
+    std::vector<double> values;     // Value of each element
+};
+
+// Split [0, count) into up to `threads` contiguous ranges and run body(begin, end)
+// on each, the first range on the calling thread. Exceptions reach the caller.
+inline void parallelRanges(long long count, int threads, const std::function<void(long long, long long)>& body) {
+    long long parts = std::max(1LL, std::min<long long>(threads, count));
+    std::vector<std::future<void> > workers;
+    for (long long p = 1; p < parts; p++) {
+        workers.push_back(std::async(std::launch::async, body, count * p / parts, count * (p + 1) / parts));
+    }
+    body(0, count / parts);
+    for (size_t w = 0; w < workers.size(); w++) {
+        workers[w].get();
+    }
+}
+
+// How parallel kernels add up floating-point terms
+enum class Summation {
+    Fast,           // Each thread sums its share in order; the last bits depend on the thread count
+    Reproducible    // Compensated sums over fixed blocks and a fixed tree; identical for any thread count
+};
+
+// Terms per leaf block of a reproducible sum. Part of the result's
+// definition: changing it changes the last bits of reproducible sums.
+const long long REDUCTION_BLOCK = 4096;
+
+// Running sum with Neumaier's compensation: the low-order bits each addition
+// loses are collected separately and added back at the end
+struct CompensatedSum {
+    double sum = 0.0;
+    double compensation = 0.0;
+    
+    void add(double v) {
+        double t = sum + v;
+        if (std::abs(sum) >= std::abs(v)) {
+            compensation += (sum - t) + v;
+        } else {
+            compensation += (v - t) + sum;
+        }
+        sum = t;
+    }
+    
+    void add(const CompensatedSum& other) {
+        add(other.sum);
+        compensation += other.compensation;
+    }
+    
+    double value() const { return sum + compensation; }
+};
+
+// Sum of term(i) for i in [0, count) on up to `threads` threads. A
+// reproducible sum adds the terms of each block of REDUCTION_BLOCK with
+// compensation and combines the block sums pairwise in a fixed tree, so
+// neither the number of threads nor their scheduling changes a bit.
+template <class Term>
+double parallelSum(long long count, int threads, Summation summation, Term term) {
+    if (summation == Summation::Fast) {
+        long long parts = std::max(1LL, std::min<long long>(threads, count));
+        std::vector<double> partial(parts, 0.0);
+        parallelRanges(parts, static_cast<int>(parts), [&](long long begin, long long end) {
+            for (long long p = begin; p < end; p++) {
+                double sum = 0.0;
+                for (long long i = count * p / parts; i < count * (p + 1) / parts; i++) {
+                    sum += term(i);
+                }
+                partial[p] = sum;
+            }
+        });
+        double total = 0.0;
+        for (long long p = 0; p < parts; p++) {
+            total += partial[p];
+        }
+        return total;
+    }
+    
+    long long blocks = (count + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+    std::vector<CompensatedSum> level(blocks);
+    parallelRanges(blocks, threads, [&](long long begin, long long end) {
+        for (long long b = begin; b < end; b++) {
+            for (long long i = b * REDUCTION_BLOCK; i < std::min(count, (b + 1) * REDUCTION_BLOCK); i++) {
+                level[b].add(term(i));
+            }
+        }
+    });
+    while (level.size() > 1) {
+        std::vector<CompensatedSum> next((level.size() + 1) / 2);
+        for (size_t i = 0; i < next.size(); i++) {
+            next[i] = level[2 * i];
+            if (2 * i + 1 < level.size()) {
+                next[i].add(level[2 * i + 1]);
+            }
+        }
+        level.swap(next);
+    }
+    return level.empty() ? 0.0 : level[0].value();
+}
+
+class SparseMatrix;
+class LinkedListStorage;
+template <class Storage>
+class BasicSparseMatrix;
+
+// Sparsity patterns of FixedSparseMatrix: bit r * cols + c is set when
+// element (r, c) may be non-zero
+constexpr uint64_t patternBit(int cols, int r, int c) {
+    return uint64_t(1) << (r * cols + c);
+}
+
+constexpr uint64_t densePattern(int rows, int cols) {
+    return rows * cols >= 64 ? ~uint64_t(0) : (uint64_t(1) << (rows * cols)) - 1;
+}
+
+constexpr uint64_t diagonalPattern(int n) {
+    uint64_t pattern = 0;
+    for (int i = 0; i < n; i++) {
+        pattern |= patternBit(n, i, i);
+    }
+    return pattern;
+}
+
+constexpr int patternCount(uint64_t pattern) {
+    int count = 0;
+    for (; pattern != 0; pattern &= pattern - 1) {
+        count++;
+    }
+    return count;
+}
+
+constexpr bool patternHas(uint64_t pattern, int cols, int r, int c) {
+    return (pattern & patternBit(cols, r, c)) != 0;
+}
+
+// Positions of A * B that can be non-zero, for A rows x inner and B inner x cols
+constexpr uint64_t productPattern(int rows, int inner, int cols, uint64_t a, uint64_t b) {
+    uint64_t pattern = 0;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            for (int k = 0; k < inner; k++) {
+                if (patternHas(a, inner, i, k) && patternHas(b, cols, k, j)) {
+                    pattern |= patternBit(cols, i, j);
+                }
+            }
+        }
+    }
+    return pattern;
+}
+
+constexpr uint64_t transposedPattern(int rows, int cols, uint64_t pattern) {
+    uint64_t result = 0;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) {
+            if (patternHas(pattern, cols, i, j)) {
+                result |= patternBit(rows, j, i);
+            }
+        }
+    }
+    return result;
+}
+
+// Positions of the inverse of an n x n matrix (n <= 3) that can be non-zero:
+// those whose cofactor has a term without structural zeros
+constexpr uint64_t inversePattern(int n, uint64_t pattern) {
+    if (n == 1) {
+        return pattern;
+    }
+    uint64_t result = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            // Entry (i, j) is the cofactor of (j, i)
+            bool nonZero = false;
+            if (n == 2) {
+                nonZero = patternHas(pattern, 2, 1 - j, 1 - i);
+            } else {
+                int r1 = j == 0 ? 1 : 0, r2 = j == 2 ? 1 : 2;
+                int c1 = i == 0 ? 1 : 0, c2 = i == 2 ? 1 : 2;
+                nonZero = (patternHas(pattern, 3, r1, c1) && patternHas(pattern, 3, r2, c2)) ||
+                          (patternHas(pattern, 3, r1, c2) && patternHas(pattern, 3, r2, c1));
+            }
+            if (nonZero) {
+                result |= patternBit(n, i, j);
+            }
+        }
+    }
+    return result;
+}
+
+// Call f(std::integral_constant<int, I>) for I = 0 .. Count - 1, unrolled
+template <class F, int... I>
+constexpr void unrollIndices(F& f, std::integer_sequence<int, I...>) {
+    (f(std::integral_constant<int, I>()), ...);
+}
+
+template <int Count, class F>
+constexpr void unrolled(F f) {
+    unrollIndices(f, std::make_integer_sequence<int, Count>());
+}
+
+// Small matrix whose sparsity pattern is fixed at compile time. Only the
+// pattern's positions are stored, inline, and every operation is unrolled
+// with structural zeros skipped at compile time, so it can run in constant
+// expressions:
+//   constexpr FixedSparseMatrix<2, 2, diagonalPattern(2)> d(2.0, 4.0);
+//   static_assert(d.determinant() == 8.0, "");
+// Results of products and sums have the combined pattern, so positions that
+// cancel numerically are kept as explicit zeros.
+template <int R, int C, uint64_t Pattern = densePattern(R, C)>
+class FixedSparseMatrix {
+    static_assert(R > 0 && C > 0 && R * C <= 64, "Fixed matrices hold at most 64 positions");
+    static_assert((Pattern & ~densePattern(R, C)) == 0, "Pattern has positions outside the matrix");
+    
+public:
+    static constexpr int storedCount = patternCount(Pattern);
+    
+    static constexpr bool has(int r, int c) { return patternHas(Pattern, C, r, c); }
+    
+    // Index of position (r, c) among the stored values
+    static constexpr int slot(int r, int c) { return patternCount(Pattern & (patternBit(C, r, c) - 1)); }
+    
+private:
+    double values[storedCount > 0 ? storedCount : 1] = {};
+    
+    // True when every (row, col) pair in Positions is in the pattern
+    template <int... Positions>
+    static constexpr bool present() {
+        constexpr int p[] = {Positions...};
+        for (size_t k = 0; k + 1 < sizeof(p) / sizeof(p[0]); k += 2) {
+            if (!has(p[k], p[k + 1])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Product of the elements at the (row, col) pairs, 0 without any
+    // multiplication when one of them is a structural zero
+    template <int Row, int Col, int... Rest>
+    constexpr double term() const {
+        if constexpr (!present<Row, Col, Rest...>()) {
+            return 0.0;
+        } else if constexpr (sizeof...(Rest) == 0) {
+            return values[slot(Row, Col)];
+        } else {
+            return values[slot(Row, Col)] * term<Rest...>();
+        }
+    }
+    
+    // Cofactor of (Row, Col) for square matrices up to 3x3
+    template <int Row, int Col>
+    constexpr double cofactor() const {
+        if constexpr (R == 1) {
+            return 1.0;
+        } else if constexpr (R == 2) {
+            return (Row + Col) % 2 == 0 ? term<1 - Row, 1 - Col>() : -term<1 - Row, 1 - Col>();
+        } else {
+            constexpr int r1 = Row == 0 ? 1 : 0, r2 = Row == 2 ? 1 : 2;
+            constexpr int c1 = Col == 0 ? 1 : 0, c2 = Col == 2 ? 1 : 2;
+            double minor = term<r1, c1, r2, c2>() - term<r1, c2, r2, c1>();
+            return (Row + Col) % 2 == 0 ? minor : -minor;
+        }
+    }
+    
+public:
+    constexpr FixedSparseMatrix() = default;
+    
+    // Values of the pattern's positions in row-major order
+    template <class... Values, class = std::enable_if_t<sizeof...(Values) == storedCount && (sizeof...(Values) > 0)> >
+    constexpr explicit FixedSparseMatrix(Values... entries) : values{static_cast<double>(entries)...} {}
+    
+    // Copy a matrix with the same shape and no elements outside the pattern
+    template <class Matrix>
+    static FixedSparseMatrix from(const Matrix& matrix) {
+        if (matrix.getRows() != R || matrix.getCols() != C) {
+            throw std::invalid_argument("Matrix dimensions do not match the fixed matrix");
+        }
+        FixedSparseMatrix result;
+        matrix.forEachElement([&](int r, int c, double v) {
+            if (!has(r, c)) {
+                throw std::invalid_argument("Matrix has elements outside the fixed sparsity pattern");
+            }
+            result.values[slot(r, c)] = v;
+        });
+        return result;
+    }
+    
+    // Copy into a SparseMatrix
+    template <class Matrix = SparseMatrix>
+    Matrix toSparseMatrix(std::pmr::memory_resource* memory = std::pmr::get_default_resource()) const {
+        Matrix result(R, C, memory);
+        forEachElement([&](int r, int c, double v) {
+            result.insert(r, c, v);
+        });
+        return result;
+    }
+    
+    static constexpr int getRows() { return R; }
+    static constexpr int getCols() { return C; }
+    
+    template <int Row, int Col>
+    constexpr double at() const {
+        if constexpr (has(Row, Col)) {
+            return values[slot(Row, Col)];
+        } else {
+            return 0.0;
+        }
+    }
+    
+    template <int Row, int Col>
+    constexpr void set(double v) {
+        static_assert(has(Row, Col), "Position is not in the sparsity pattern");
+        values[slot(Row, Col)] = v;
+    }
+    
+    constexpr double get(int r, int c) const {
+        if (r < 0 || r >= R || c < 0 || c >= C) {
+            throw std::out_of_range("Index out of bounds");
+        }
+        return has(r, c) ? values[slot(r, c)] : 0.0;
+    }
+    
+    constexpr void insert(int r, int c, double v) {
+        if (r < 0 || r >= R || c < 0 || c >= C) {
+            throw std::out_of_range("Index out of bounds");
+        }
+        if (!has(r, c)) {
+            throw std::invalid_argument("Position is not in the sparsity pattern");
+        }
+        values[slot(r, c)] = v;
+    }
+    
+    // Visit the non-zero elements in row-major order as visit(row, col, value)
+    template <class Visitor>
+    constexpr void forEachElement(Visitor visit) const {
+        for (int r = 0; r < R; r++) {
+            for (int c = 0; c < C; c++) {
+                if (has(r, c) && (values[slot(r, c)] >= 1e-10 || values[slot(r, c)] <= -1e-10)) {
+                    visit(r, c, values[slot(r, c)]);
+                }
+            }
+        }
+    }
+    
+    template <uint64_t OtherPattern>
+    constexpr FixedSparseMatrix<R, C, Pattern | OtherPattern> add(const FixedSparseMatrix<R, C, OtherPattern>& other) const {
+        FixedSparseMatrix<R, C, Pattern | OtherPattern> result;
+        unrolled<R * C>([&](auto position) {
+            constexpr int r = decltype(position)::value / C, c = decltype(position)::value % C;
+            if constexpr (has(r, c) && patternHas(OtherPattern, C, r, c)) {
+                result.template set<r, c>(at<r, c>() + other.template at<r, c>());
+            } else if constexpr (has(r, c)) {
+                result.template set<r, c>(at<r, c>());
+            } else if constexpr (patternHas(OtherPattern, C, r, c)) {
+                result.template set<r, c>(other.template at<r, c>());
+            }
+        });
+        return result;
+    }
+    
+    template <uint64_t OtherPattern>
+    constexpr FixedSparseMatrix<R, C, Pattern | OtherPattern> subtract(const FixedSparseMatrix<R, C, OtherPattern>& other) const {
+        return add(other.scalarMultiply(-1.0));
+    }
+    
+    constexpr FixedSparseMatrix scalarMultiply(double scalar) const {
+        FixedSparseMatrix result;
+        for (int k = 0; k < storedCount; k++) {
+            result.values[k] = values[k] * scalar;
+        }
+        return result;
+    }
+    
+    template <int K, uint64_t OtherPattern>
+    constexpr FixedSparseMatrix<R, K, productPattern(R, C, K, Pattern, OtherPattern)>
+    multiply(const FixedSparseMatrix<C, K, OtherPattern>& other) const {
+        FixedSparseMatrix<R, K, productPattern(R, C, K, Pattern, OtherPattern)> result;
+        unrolled<R * K>([&](auto position) {
+            constexpr int i = decltype(position)::value / K, j = decltype(position)::value % K;
+            if constexpr (patternHas(productPattern(R, C, K, Pattern, OtherPattern), K, i, j)) {
+                double sum = 0.0;
+                unrolled<C>([&](auto inner) {
+                    constexpr int k = decltype(inner)::value;
+                    if constexpr (has(i, k) && patternHas(OtherPattern, K, k, j)) {
+                        sum += at<i, k>() * other.template at<k, j>();
+                    }
+                });
+                result.template set<i, j>(sum);
+            }
+        });
+        return result;
+    }
+    
+    constexpr FixedSparseMatrix<C, R, transposedPattern(R, C, Pattern)> transpose() const {
+        FixedSparseMatrix<C, R, transposedPattern(R, C, Pattern)> result;
+        unrolled<R * C>([&](auto position) {
+            constexpr int r = decltype(position)::value / C, c = decltype(position)::value % C;
+            if constexpr (has(r, c)) {
+                result.template set<c, r>(at<r, c>());
+            }
+        });
+        return result;
+    }
+    
+    // Cofactor expansion along the first row, as SparseMatrix::determinant
+    constexpr double determinant() const {
+        static_assert(R == C && R <= 3, "Determinant is implemented for 1x1, 2x2 and 3x3 matrices");
+        if constexpr (R == 1) {
+            return at<0, 0>();
+        } else if constexpr (R == 2) {
+            return term<0, 0, 1, 1>() - term<0, 1, 1, 0>();
+        } else {
+            double det = 0.0;
+            unrolled<3>([&](auto column) {
+                constexpr int c = decltype(column)::value;
+                if constexpr (has(0, c)) {
+                    det += at<0, c>() * cofactor<0, c>();
+                }
+            });
+            return det;
+        }
+    }
+    
+    // Adjugate over the determinant
+    constexpr FixedSparseMatrix<R, R, inversePattern(R, Pattern)> inverse() const {
+        static_assert(R == C && R <= 3, "Inverse is implemented for 1x1, 2x2 and 3x3 matrices");
+        double det = determinant();
+        if (det < 1e-10 && det > -1e-10) {
+            throw std::invalid_argument("Matrix is singular, inverse does not exist");
+        }
+        FixedSparseMatrix<R, R, inversePattern(R, Pattern)> result;
+        unrolled<R * R>([&](auto position) {
+            constexpr int i = decltype(position)::value / R, j = decltype(position)::value % R;
+            if constexpr (patternHas(inversePattern(R, Pattern), R, i, j)) {
+                result.template set<i, j>(cofactor<j, i>() / det);
+            }
+        });
+        return result;
+    }
+};
+
+// Sparse Matrix class using linked lists
+class SparseMatrix {
+    friend class SparseMatrixView; // Views hash their elements the same way
+    friend class LinkedListStorage; // Walks and builds the row lists directly
+    template <class Storage> friend class BasicSparseMatrix;
+    friend class WindowedSparseMatrix; // Drops whole buckets without walking them
+    
+private:
+    std::pmr::memory_resource* resource; // Where nodes (and kernel workspaces) are allocated
+    int rows;           // Number of rows
+    int cols;           // Number of columns
+    RowNode* rowList;   // Linked list of rows
+    uint64_t valueHash;     // Sum of entryHash over all stored values, kept up to date on every change
+    uint64_t structureHash; // Sum of positionHash over all elements (sparsity pattern only)
+    double scale;           // Pending factor for every stored value (lazy scalarMultiply)
+    double smallest;        // Lower bound on the magnitude of the stored values
+    uint64_t version;       // Incremented on every change to the contents
+    
+    // Results derived from the contents, each valid while `version` still
+    // equals the version it was computed at
+    struct DerivedCache {
+        std::mutex lock;
+        uint64_t transposeVersion = ~uint64_t(0);   // All ones: not computed yet
+        uint64_t diagonalVersion = ~uint64_t(0);
+        uint64_t normsVersion = ~uint64_t(0);
+        std::shared_ptr<const SparseMatrix> transposed;
+        std::vector<double> diagonal;
+        std::vector<double> rowNorms;
+        double frobeniusNorm = 0.0;
+    };
+    std::unique_ptr<DerivedCache> derived;  // Only present when caching is enabled
+    
+    // Which rows changed at which version, so that every result kept up to
+    // date from this matrix can find the rows changed since it last looked
+    struct RowChangeLog {
+        uint64_t trackedFrom = 0;                     // Version when tracking started
+        uint64_t wholeMatrix = 0;                     // Last version at which every row changed
+        std::vector<uint64_t> rowVersion;             // Version of each row's last change
+        std::vector<std::pair<uint64_t, int> > log;   // (version, row) of each change, in version order
+    };
+    std::unique_ptr<RowChangeLog> changes;  // Only present while row changes are tracked
+    
+    // Hash of one stored element; summing these gives an order-independent
+    // fingerprint that insert and remove can update in O(1)
+    static uint64_t positionHash(int r, int c) {
+        return mixHash((static_cast<uint64_t>(static_cast<uint32_t>(r)) << 32) | static_cast<uint32_t>(c));
+    }
+    
+    static uint64_t entryHash(int r, int c, double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return mixHash(positionHash(r, c) ^ bits);
+    }
+    
+    // Node storage, all drawn from the matrix's memory resource. Rows whose
+    // length is known up front get exactly that many slots (up to the limit).
+    RowNode* allocateRow(int r, int slots = ROW_INLINE_ELEMENTS) {
+        slots = std::min(slots, ROW_INLINE_ELEMENTS);
+        return new (resource->allocate(RowNode::allocationSize(slots), alignof(RowNode))) RowNode(r, slots);
+    }
+    
+    // A free slot of the row if there is one, a separate node otherwise
+    MatrixNode* allocateElement(RowNode* rowNode, int c, double v) {
+        for (int slot = 0; slot < rowNode->capacity; slot++) {
+            if ((rowNode->used & (1u << slot)) == 0) {
+                rowNode->used |= static_cast<unsigned char>(1u << slot);
+                return new (rowNode->slots() + slot) MatrixNode(c, v);
+            }
+        }
+        return new (resource->allocate(sizeof(MatrixNode), alignof(MatrixNode))) MatrixNode(c, v);
+    }
+    
+    void releaseElement(RowNode* rowNode, MatrixNode* element) {
+        element->~MatrixNode();
+        if (rowNode->isInline(element)) {
+            rowNode->used &= static_cast<unsigned char>(~(1u << (element - rowNode->slots())));
+        } else {
+            resource->deallocate(element, sizeof(MatrixNode), alignof(MatrixNode));
+        }
+    }
+    
+    // Release a row together with its elements
+    void releaseRow(RowNode* rowNode) {
+        MatrixNode* current = rowNode->elements;
+        while (current != nullptr) {
+            MatrixNode* temp = current;
+            current = current->next;
+            releaseElement(rowNode, temp);
+        }
+        size_t bytes = RowNode::allocationSize(rowNode->capacity);
+        rowNode->~RowNode();
+        resource->deallocate(rowNode, bytes, alignof(RowNode));
+    }
+    
+    void releaseAll() {
+        RowNode* current = rowList;
+        while (current != nullptr) {
+            RowNode* temp = current;
+            current = current->next;
+            releaseRow(temp);
+        }
+        rowList = nullptr;
+    }
+    
+    // Forget every node without releasing it, for resources that free all
+    // their memory at once (the per-bucket arenas of WindowedSparseMatrix)
+    void abandonNodes() {
+        rowList = nullptr;
+    }
+    
+    // Deep copy the rows and elements of another matrix into this empty one,
+    // reporting each row to the control if there is one
+    void copyRowsFrom(const SparseMatrix& other, OperationControl* control = nullptr) {
+        RowNode* otherRow = other.rowList;
+        RowNode* lastRow = nullptr;
+        size_t copiedElements = 0;
+        
+        while (otherRow != nullptr) {
+            if (control != nullptr) {
+                control->checkpoint(otherRow->row + 1, other.rows, copiedElements);
+            }
+            
+            // Create a new row with slots for all its elements
+            int length = 0;
+            for (MatrixNode* node = otherRow->elements; node != nullptr && length < ROW_INLINE_ELEMENTS; node = node->next) {
+                length++;
+            }
+            RowNode* newRow = allocateRow(otherRow->row, length);
+            
+            // Add to our row list
+            if (lastRow == nullptr) {
+                rowList = newRow;
+            } else {
+                lastRow->next = newRow;
+            }
+            lastRow = newRow;
+            
+            // Copy all elements in this row
+            MatrixNode* otherElement = otherRow->elements;
+            MatrixNode* lastElement = nullptr;
+            
+            while (otherElement != nullptr) {
+                MatrixNode* newElement = allocateElement(newRow, otherElement->col, otherElement->value);
+                
+                // Add to our element list
+                if (lastElement == nullptr) {
+                    newRow->elements = newElement;
+                } else {
+                    lastElement->next = newElement;
+                }
+                lastElement = newElement;
+                copiedElements++;
+                
+                otherElement = otherElement->next;
+            }
+            
+            otherRow = otherRow->next;
+        }
+    }
+    
+    // Keep both hashes in step with an element being stored or removed
+    void hashAdded(int r, int c, double v) {
+        valueHash += entryHash(r, c, v);
+        structureHash += positionHash(r, c);
+        smallest = std::min(smallest, std::abs(v));
+        version++;
+        rowChanged(r);
+    }
+    
+    void hashRemoved(int r, int c, double v) {
+        valueHash -= entryHash(r, c, v);
+        structureHash -= positionHash(r, c);
+        version++;
+        rowChanged(r);
+    }
+    
+    // Record that row r changed at the current version
+    void rowChanged(int r) {
+        if (!changes) {
+            return;
+        }
+        changes->rowVersion[r] = version;
+        changes->log.push_back(std::make_pair(version, r));
+        if (changes->log.size() > 2 * static_cast<size_t>(rows) + 1024) {
+            // Keep only each row's latest change; answers stay exact
+            changes->log.clear();
+            for (int i = 0; i < rows; i++) {
+                if (changes->rowVersion[i] > changes->trackedFrom) {
+                    changes->log.push_back(std::make_pair(changes->rowVersion[i], i));
+                }
+            }
+            std::sort(changes->log.begin(), changes->log.end());
+        }
+    }
+    
+    // Record that every row changed (scaling, assignment)
+    void wholeMatrixChanged() {
+        if (changes) {
+            changes->wholeMatrix = version;
+            changes->rowVersion.assign(rows, version);
+            changes->log.clear();
+        }
+    }
+    
+    // Multiply every stored value by factor, dropping values that become zero
+    void applyScale(double factor) {
+        valueHash = 0;
+        structureHash = 0;
+        smallest = std::numeric_limits<double>::infinity();
+        for (RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            MatrixNode* prev = nullptr;
+            MatrixNode* current = rowNode->elements;
+            while (current != nullptr) {
+                MatrixNode* next = current->next;
+                current->value *= factor;
+                if (std::abs(current->value) < 1e-10) {
+                    if (prev == nullptr) {
+                        rowNode->elements = next;
+                    } else {
+                        prev->next = next;
+                    }
+                    releaseElement(rowNode, current);
+                } else {
+                    hashAdded(rowNode->row, current->col, current->value);
+                    prev = current;
+                }
+                current = next;
+            }
+        }
+        cleanupEmptyRows();
+    }
+    
+    // Sum of term(element) over one row, compensated for reproducible sums
+    template <class Term>
+    static double rowSum(const RowNode* rowNode, Summation summation, Term term) {
+        if (summation == Summation::Fast) {
+            double sum = 0.0;
+            for (const MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                sum += term(colNode);
+            }
+            return sum;
+        }
+        CompensatedSum sum;
+        for (const MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+            sum.add(term(colNode));
+        }
+        return sum.value();
+    }
+    
+    // Row norms and Frobenius norm in one pass, summed the way
+    // frobeniusNorm(threads, summation) sums them
+    std::pair<std::vector<double>, double> normsOf(Summation summation = Summation::Fast) const {
+        std::pair<std::vector<double>, double> norms(std::vector<double>(rows, 0.0), 0.0);
+        std::vector<double> squares;
+        for (const RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            double sum = rowSum(rowNode, summation, [](const MatrixNode* colNode) {
+                return colNode->value * colNode->value;
+            });
+            norms.first[rowNode->row] = std::sqrt(sum) * std::abs(scale);
+            squares.push_back(sum);
+        }
+        norms.second = std::sqrt(parallelSum(static_cast<long long>(squares.size()), 1, summation, [&](long long i) {
+            return squares[i];
+        })) * std::abs(scale);
+        return norms;
+    }
+    
+    // Bring the cached norms up to date, returning the held cache lock
+    std::unique_lock<std::mutex> computeNorms() const {
+        if (!derived) {
+            return std::unique_lock<std::mutex>();
+        }
+        std::unique_lock<std::mutex> guard(derived->lock);
+        if (derived->normsVersion != version) {
+            std::pair<std::vector<double>, double> norms = normsOf();
+            derived->rowNorms = std::move(norms.first);
+            derived->frobeniusNorm = norms.second;
+            derived->normsVersion = version;
+        }
+        return guard;
+    }
+    
+    // Transpose without the cache
+    SparseMatrix computeTranspose(OperationControl* control) const;
+    
+    // These rows read in place as a storage backend, for the shared kernels
+    BasicSparseMatrix<LinkedListStorage> inPlace() const;
+    
+    // Write the pending scale factor into the stored values
+    void foldScale() {
+        if (scale != 1.0) {
+            double factor = scale;
+            scale = 1.0;
+            applyScale(factor);
+        }
+    }
+    
+    // Helper function to get a row node (creates it if it doesn't exist)
+    RowNode* getRowNode(int r, bool create = false) {
+        if (r < 0 || r >= rows) {
+            throw std::out_of_range("Row index out of range");
+        }
+        
+        // If rowList is empty, create first row node
+        if (rowList == nullptr && create) {
+            rowList = allocateRow(r);
+            return rowList;
+        }
+        
+        // If the first row is greater than r and we need to create, insert at beginning
+        if (rowList != nullptr && rowList->row > r && create) {
+            RowNode* newRow = allocateRow(r);
+            newRow->next = rowList;
+            rowList = newRow;
+            return newRow;
+        }
+        
+        // Look for existing row or place to insert
+        RowNode* prev = nullptr;
+        RowNode* current = rowList;
+        
+        while (current != nullptr && current->row < r) {
+            prev = current;
+            current = current->next;
+        }
+        
+        // Found existing row
+        if (current != nullptr && current->row == r) {
+            return current;
+        }
+        
+        // Need to create a new row node
+        if (create) {
+            RowNode* newRow = allocateRow(r);
+            if (prev == nullptr) {
+                // Insert at start (should not happen due to checks above)
+                newRow->next = rowList;
+                rowList = newRow;
+            } else {
+                // Insert between prev and current
+                newRow->next = current;
+                prev->next = newRow;
+            }
+            return newRow;
+        }
+        
+        return nullptr; // Row doesn't exist and we're not creating it
+    }
+    
+    // Helper function to insert an element into a row's linked list
+    void insertIntoRow(RowNode* rowNode, int c, double v) {
+        if (c < 0 || c >= cols) {
+            throw std::out_of_range("Column index out of range");
+        }
+        
+        // If value is zero, we might need to remove existing element
+        if (std::abs(v) < 1e-10) {
+            removeFromRow(rowNode, c);
+            return;
+        }
+        
+        // If row has no elements, create first element
+        if (rowNode->elements == nullptr) {
+            rowNode->elements = allocateElement(rowNode, c, v);
+            hashAdded(rowNode->row, c, v);
+            return;
+        }
+        
+        // If first element's column is greater than c, insert at beginning
+        if (rowNode->elements->col > c) {
+            MatrixNode* newNode = allocateElement(rowNode, c, v);
+            newNode->next = rowNode->elements;
+            rowNode->elements = newNode;
+            hashAdded(rowNode->row, c, v);
+            return;
+        }
+        
+        // Look for existing column or place to insert
+        MatrixNode* prev = nullptr;
+        MatrixNode* current = rowNode->elements;
+        
+        while (current != nullptr && current->col < c) {
+            prev = current;
+            current = current->next;
+        }
+        
+        // Found existing column, update value
+        if (current != nullptr && current->col == c) {
+            valueHash += entryHash(rowNode->row, c, v) - entryHash(rowNode->row, c, current->value);
+            smallest = std::min(smallest, std::abs(v));
+            version++;
+            rowChanged(rowNode->row);
+            current->value = v;
+            return;
+        }
+        
+        // Insert new node between prev and current
+        MatrixNode* newNode = allocateElement(rowNode, c, v);
+        hashAdded(rowNode->row, c, v);
+        if (prev == nullptr) {
+            // Should not reach here due to checks above
+            newNode->next = rowNode->elements;
+            rowNode->elements = newNode;
+        } else {
+            newNode->next = current;
+            prev->next = newNode;
+        }
+    }
+    
+    // Helper function to remove an element from a row
+    void removeFromRow(RowNode* rowNode, int c) {
+        if (rowNode == nullptr || rowNode->elements == nullptr) {
+            return;
+        }
+        
+        // If first element is the one to remove
+        if (rowNode->elements->col == c) {
+            MatrixNode* temp = rowNode->elements;
+            rowNode->elements = rowNode->elements->next;
+            hashRemoved(rowNode->row, c, temp->value);
+            releaseElement(rowNode, temp);
+            return;
+        }
+        
+        // Look for the element to remove
+        MatrixNode* prev = rowNode->elements;
+        MatrixNode* current = prev->next;
+        
+        while (current != nullptr && current->col != c) {
+            prev = current;
+            current = current->next;
+        }
+        
+        // If found, remove it
+        if (current != nullptr) {
+            prev->next = current->next;
+            hashRemoved(rowNode->row, c, current->value);
+            releaseElement(rowNode, current);
+        }
+    }
+    
+    // Helper function to clean up empty rows
+    void cleanupEmptyRows() {
+        if (rowList == nullptr) {
+            return;
+        }
+        
+        // Check if first row is empty
+        while (rowList != nullptr && rowList->elements == nullptr) {
+            RowNode* temp = rowList;
+            rowList = rowList->next;
+            releaseRow(temp);
+        }
+        
+        if (rowList == nullptr) {
+            return;
+        }
+        
+        // Check remaining rows
+        RowNode* prev = rowList;
+        RowNode* current = prev->next;
+        
+        while (current != nullptr) {
+            if (current->elements == nullptr) {
+                prev->next = current->next;
+                releaseRow(current);
+                current = prev->next;
+            } else {
+                prev = current;
+                current = current->next;
+            }
+        }
+    }
+    
+public:
+    // Constructor. Nodes come from `memory` (the default resource unless
+    // given), and results of operations on this matrix use the same resource.
+    SparseMatrix(int r, int c, std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : resource(memory), rows(r), cols(c), rowList(nullptr), valueHash(0), structureHash(0), scale(1.0),
+          smallest(std::numeric_limits<double>::infinity()), version(0) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+    }
+    
+    // Copy constructor (the copy shares the original's memory resource)
+    SparseMatrix(const SparseMatrix& other) : SparseMatrix(other, other.resource) {}
+    
+    // Copy into another memory resource, reporting each copied row to an
+    // optional control so that a long copy can be cancelled or limited
+    SparseMatrix(const SparseMatrix& other, std::pmr::memory_resource* memory, OperationControl* control = nullptr)
+        : resource(memory), rows(other.rows), cols(other.cols), rowList(nullptr),
+          valueHash(other.valueHash), structureHash(other.structureHash), scale(other.scale), smallest(other.smallest),
+          version(0), derived(other.derived ? new DerivedCache() : nullptr) {
+        try {
+            copyRowsFrom(other, control);
+        } catch (...) {
+            releaseAll();
+            throw;
+        }
+    }
+    
+    // Move constructor (takes over the other matrix's rows and resource)
+    SparseMatrix(SparseMatrix&& other) noexcept
+        : resource(other.resource), rows(other.rows), cols(other.cols), rowList(other.rowList),
+          valueHash(other.valueHash), structureHash(other.structureHash), scale(other.scale), smallest(other.smallest),
+          version(other.version), derived(std::move(other.derived)), changes(std::move(other.changes)) {
+        other.rowList = nullptr;
+        other.valueHash = 0;
+        other.structureHash = 0;
+        other.scale = 1.0;
+        other.smallest = std::numeric_limits<double>::infinity();
+    }
+    
+    // Destructor
+    ~SparseMatrix() {
+        releaseAll();
+    }
+    
+    // Assignment operator (keeps this matrix's memory resource). The rows
+    // are copied first and then swapped in, so a failed copy leaves this
+    // matrix unchanged.
+    SparseMatrix& operator=(const SparseMatrix& other) {
+        if (this != &other) {
+            SparseMatrix copy(other, resource);
+            std::swap(rows, copy.rows);
+            std::swap(cols, copy.cols);
+            std::swap(rowList, copy.rowList);
+            std::swap(valueHash, copy.valueHash);
+            std::swap(structureHash, copy.structureHash);
+            std::swap(scale, copy.scale);
+            std::swap(smallest, copy.smallest);
+            version++;
+            wholeMatrixChanged();
+        }
+        return *this;
+    }
+    
+    // Move assignment operator. Nodes can only be taken over when both
+    // matrices use the same resource; otherwise they are copied.
+    SparseMatrix& operator=(SparseMatrix&& other) {
+        if (this == &other) {
+            return *this;
+        }
+        if (!resource->is_equal(*other.resource)) {
+            return *this = static_cast<const SparseMatrix&>(other);
+        }
+        releaseAll();
+        rows = other.rows;
+        cols = other.cols;
+        rowList = other.rowList;
+        valueHash = other.valueHash;
+        structureHash = other.structureHash;
+        scale = other.scale;
+        smallest = other.smallest;
+        version = std::max(version, other.version) + 1;   // Entries cached for either matrix are stale
+        other.version++;
+        wholeMatrixChanged();
+        other.wholeMatrixChanged();
+        other.rowList = nullptr;
+        other.valueHash = 0;
+        other.structureHash = 0;
+        other.scale = 1.0;
+        other.smallest = std::numeric_limits<double>::infinity();
+        return *this;
+    }
+    
+    std::pmr::memory_resource* getResource() const { return resource; }
+    
+    // Get dimensions
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    
+    // Fingerprint of dimensions and contents, maintained incrementally (O(1)).
+    // A pending scale factor is mixed in rather than applied, so a scaled
+    // matrix may not share the fingerprint of an equal unscaled one; caches
+    // keyed on it then miss instead of walking the elements.
+    uint64_t fingerprint() const {
+        uint64_t hash = valueHash;
+        if (scale != 1.0) {
+            uint64_t bits;
+            std::memcpy(&bits, &scale, sizeof(bits));
+            hash = mixHash(hash ^ mixHash(bits));
+        }
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(rows)) << 32) | static_cast<uint32_t>(cols);
+        return mixHash(hash ^ mixHash(shape));
+    }
+    
+    // Fingerprint of dimensions and sparsity pattern only, ignoring values (O(1))
+    uint64_t structuralFingerprint() const {
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(rows)) << 32) | static_cast<uint32_t>(cols);
+        return mixHash(structureHash ^ mixHash(~shape));
+    }
+    
+    // Exact equality. Matrices with differing shapes, patterns or (when
+    // neither has a pending scale) values are rejected in O(1); otherwise the
+    // elements are compared in one O(nnz) pass.
+    bool operator==(const SparseMatrix& other) const {
+        if (rows != other.rows || cols != other.cols || structureHash != other.structureHash ||
+            (scale == 1.0 && other.scale == 1.0 && valueHash != other.valueHash)) {
+            return false;
+        }
+        
+        RowNode* rowA = rowList;
+        RowNode* rowB = other.rowList;
+        while (rowA != nullptr && rowB != nullptr) {
+            if (rowA->row != rowB->row) {
+                return false;
+            }
+            MatrixNode* colA = rowA->elements;
+            MatrixNode* colB = rowB->elements;
+            while (colA != nullptr && colB != nullptr) {
+                if (colA->col != colB->col || colA->value * scale != colB->value * other.scale) {
+                    return false;
+                }
+                colA = colA->next;
+                colB = colB->next;
+            }
+            if (colA != nullptr || colB != nullptr) {
+                return false;
+            }
+            rowA = rowA->next;
+            rowB = rowB->next;
+        }
+        return rowA == nullptr && rowB == nullptr;
+    }
+    
+    bool operator!=(const SparseMatrix& other) const {
+        return !(*this == other);
+    }
+    
+    // Equality within an absolute tolerance; an element missing on one side
+    // counts as zero. Identical fingerprints short-cut to true.
+    bool approxEquals(const SparseMatrix& other, double tolerance) const {
+        if (rows != other.rows || cols != other.cols) {
+            return false;
+        }
+        if (structureHash == other.structureHash && valueHash == other.valueHash && *this == other) {
+            return true;
+        }
+        
+        RowNode* rowA = rowList;
+        RowNode* rowB = other.rowList;
+        while (rowA != nullptr || rowB != nullptr) {
+            // Walk the union of both row lists
+            int row;
+            if (rowB == nullptr || (rowA != nullptr && rowA->row < rowB->row)) {
+                row = rowA->row;
+            } else {
+                row = rowB->row;
+            }
+            MatrixNode* colA = (rowA != nullptr && rowA->row == row) ? rowA->elements : nullptr;
+            MatrixNode* colB = (rowB != nullptr && rowB->row == row) ? rowB->elements : nullptr;
+            
+            while (colA != nullptr || colB != nullptr) {
+                double a = 0.0;
+                double b = 0.0;
+                if (colB == nullptr || (colA != nullptr && colA->col < colB->col)) {
+                    a = colA->value * scale;
+                    colA = colA->next;
+                } else if (colA == nullptr || colB->col < colA->col) {
+                    b = colB->value * other.scale;
+                    colB = colB->next;
+                } else {
+                    a = colA->value * scale;
+                    b = colB->value * other.scale;
+                    colA = colA->next;
+                    colB = colB->next;
+                }
+                if (!(std::abs(a - b) <= tolerance)) {
+                    return false;
+                }
+            }
+            
+            if (rowA != nullptr && rowA->row == row) rowA = rowA->next;
+            if (rowB != nullptr && rowB->row == row) rowB = rowB->next;
+        }
+        return true;
+    }
+    
+    // Insert an element (r, c) with value v
+    void insert(int r, int c, double v) {
+        // If value is 0, we might need to remove an existing element
+        if (std::abs(v) < 1e-10) {
+            RowNode* rowNode = getRowNode(r);
+            if (rowNode != nullptr) {
+                removeFromRow(rowNode, c);
+                if (rowNode->elements == nullptr) {
+                    cleanupEmptyRows();
+                }
+            }
+            return;
+        }
+        
+        // Stored values must not carry a pending scale factor once this one is added
+        foldScale();
+        
+        // Get or create the row node
+        RowNode* rowNode = getRowNode(r, true);
+        insertIntoRow(rowNode, c, v);
+    }
+    
+    // Get value at position (r, c)
+    double get(int r, int c) const {
+        if (r < 0 || r >= rows || c < 0 || c >= cols) {
+            throw std::out_of_range("Index out of range");
+        }
+        
+        // Find the row
+        RowNode* rowNode = rowList;
+        while (rowNode != nullptr && rowNode->row < r) {
+            rowNode = rowNode->next;
+        }
+        
+        // Row not found, return 0
+        if (rowNode == nullptr || rowNode->row != r) {
+            return 0.0;
+        }
+        
+        // Find the column in this row
+        MatrixNode* colNode = rowNode->elements;
+        while (colNode != nullptr && colNode->col < c) {
+            colNode = colNode->next;
+        }
+        
+        // Column not found, return 0
+        if (colNode == nullptr || colNode->col != c) {
+            return 0.0;
+        }
+        
+        return colNode->value * scale;
+    }
+    
+    // Display the matrix
+    void display() const {
+        std::cout << "Matrix " << rows << "x" << cols << ":" << std::endl;
+        
+        // Check if matrix is entirely zero
+        if (rowList == nullptr) {
+            std::cout << "Empty matrix (all zeros)" << std::endl;
+            return;
+        }
+        
+        // Display full matrix
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                std::cout << std::setw(8) << std::fixed << std::setprecision(2) << get(i, j) << " ";
+            }
+            std::cout << std::endl;
+        }
+    }
+    
+    // Display sparse representation
+    void displaySparse() const {
+        std::cout << "Sparse representation of " << rows << "x" << cols << " matrix:" << std::endl;
+        std::cout << "Row\tColumn\tValue" << std::endl;
+        
+        int nonZeroCount = 0;
+        RowNode* rowNode = rowList;
+        
+        while (rowNode != nullptr) {
+            MatrixNode* colNode = rowNode->elements;
+            while (colNode != nullptr) {
+                std::cout << rowNode->row << "\t" << colNode->col << "\t" 
+                          << std::fixed << std::setprecision(2) << colNode->value * scale << std::endl;
+                nonZeroCount++;
+                colNode = colNode->next;
+            }
+            rowNode = rowNode->next;
+        }
+        
+        std::cout << "Total non-zero elements: " << nonZeroCount << std::endl;
+    }
+    
+    // Weighted sum of equally sized matrices, computed in one merged pass over
+    // all operands (element-wise steps like A + B - 2*C fuse into one call).
+    // The result uses the given memory resource, or the first operand's.
+    static SparseMatrix linearCombination(const std::vector<double>& weights,
+                                          const std::vector<const SparseMatrix*>& terms,
+                                          int r, int c, OperationControl* control = nullptr,
+                                          std::pmr::memory_resource* memory = nullptr) {
+        if (weights.size() != terms.size()) {
+            throw std::invalid_argument("Each matrix needs exactly one weight");
+        }
+        for (size_t k = 0; k < terms.size(); k++) {
+            if (terms[k]->rows != r || terms[k]->cols != c) {
+                throw std::invalid_argument("Matrix dimensions do not match for addition");
+            }
+        }
+        
+        // The result and workspace use the first operand's memory resource by default
+        if (memory == nullptr) {
+            memory = terms.empty() ? std::pmr::get_default_resource() : terms[0]->resource;
+        }
+        SparseMatrix result(r, c, memory);
+        std::pmr::vector<RowNode*> rowCursors(terms.size(), result.resource);
+        std::pmr::vector<MatrixNode*> colCursors(terms.size(), result.resource);
+        std::pmr::vector<double> factors(terms.size(), result.resource);   // Weights with pending scales folded in
+        for (size_t k = 0; k < terms.size(); k++) {
+            rowCursors[k] = terms[k]->rowList;
+            factors[k] = weights[k] * terms[k]->scale;
+        }
+        RowNode* lastRow = nullptr;
+        size_t resultElements = 0;
+        
+        while (true) {
+            // Next row present in any operand
+            int row = -1;
+            for (size_t k = 0; k < terms.size(); k++) {
+                if (rowCursors[k] != nullptr && (row < 0 || rowCursors[k]->row < row)) {
+                    row = rowCursors[k]->row;
+                }
+            }
+            if (row < 0) {
+                break;
+            }
+            if (control != nullptr) {
+                control->checkpoint(row + 1, r, resultElements);
+            }
+            
+            for (size_t k = 0; k < terms.size(); k++) {
+                colCursors[k] = nullptr;
+                if (rowCursors[k] != nullptr && rowCursors[k]->row == row) {
+                    colCursors[k] = rowCursors[k]->elements;
+                    rowCursors[k] = rowCursors[k]->next;
+                }
+            }
+            
+            // Merge the sorted columns of this row across operands
+            RowNode* newRow = nullptr;
+            MatrixNode* lastElement = nullptr;
+            while (true) {
+                int col = -1;
+                for (size_t k = 0; k < terms.size(); k++) {
+                    if (colCursors[k] != nullptr && (col < 0 || colCursors[k]->col < col)) {
+                        col = colCursors[k]->col;
+                    }
+                }
+                if (col < 0) {
+                    break;
+                }
+                
+                double sum = 0.0;
+                for (size_t k = 0; k < terms.size(); k++) {
+                    if (colCursors[k] != nullptr && colCursors[k]->col == col) {
+                        sum += factors[k] * colCursors[k]->value;
+                        colCursors[k] = colCursors[k]->next;
+                    }
+                }
+                if (std::abs(sum) < 1e-10) {
+                    continue;
+                }
+                
+                if (newRow == nullptr) {
+                    newRow = result.allocateRow(row);
+                    if (lastRow == nullptr) {
+                        result.rowList = newRow;
+                    } else {
+                        lastRow->next = newRow;
+                    }
+                    lastRow = newRow;
+                }
+                MatrixNode* newElement = result.allocateElement(newRow, col, sum);
+                result.hashAdded(row, col, sum);
+                resultElements++;
+                if (lastElement == nullptr) {
+                    newRow->elements = newElement;
+                } else {
+                    lastElement->next = newElement;
+                }
+                lastElement = newElement;
+            }
+        }
+        
+        return result;
+    }
+    
+    // Addition and subtraction with another matrix. These and the other
+    // kernels are the BasicSparseMatrix ones run over the rows in place, so
+    // they are defined after it.
+    SparseMatrix add(const SparseMatrix& other, OperationControl* control = nullptr) const;
+    SparseMatrix subtract(const SparseMatrix& other, OperationControl* control = nullptr) const;
+    
+    // Multiply every value by factor in O(1), by updating the pending scale
+    // factor. The values are only rewritten when the factor is zero or could
+    // push a stored value below the zero threshold.
+    void scaleBy(double factor) {
+        version++;
+        wholeMatrixChanged();
+        if (std::abs(factor) < 1e-10) {
+            releaseAll();
+            valueHash = 0;
+            structureHash = 0;
+            scale = 1.0;
+            smallest = std::numeric_limits<double>::infinity();
+            return;
+        }
+        double combined = scale * factor;
+        if (std::abs(combined) * smallest >= 1e-10) {
+            scale = combined;
+            return;
+        }
+        scale = 1.0;
+        applyScale(combined);
+    }
+    
+    // Scalar multiplication: a copy of the nodes with the scale factor
+    // updated, or no copy at all when called on a temporary. The copy
+    // checkpoints every row; a zero scalar needs no copy.
+    SparseMatrix scalarMultiply(double scalar, OperationControl* control = nullptr) const & {
+        if (std::abs(scalar) < 1e-10) {
+            if (control != nullptr) {
+                control->checkpoint(rows, rows, 0);
+            }
+            SparseMatrix result(rows, cols, resource);
+            result.setDerivedCaching(derived != nullptr);
+            return result;
+        }
+        SparseMatrix result(*this, resource, control);
+        result.scaleBy(scalar);
+        return result;
+    }
+    
+    SparseMatrix scalarMultiply(double scalar, OperationControl* control = nullptr) && {
+        if (control != nullptr) {
+            control->checkpoint(rows, rows, 0);
+        }
+        scaleBy(scalar);
+        return std::move(*this);
+    }
+    
+    // Matrix multiplication, one output row at a time with a dense accumulator
+    SparseMatrix multiply(const SparseMatrix& other, OperationControl* control = nullptr,
+                          Summation summation = Summation::Fast) const;
+    
+    // Scalar division
+    SparseMatrix scalarDivide(double scalar, OperationControl* control = nullptr) const & {
+        if (std::abs(scalar) < 1e-10) {
+            throw std::invalid_argument("Division by zero");
+        }
+        
+        return scalarMultiply(1.0 / scalar, control);
+    }
+    
+    SparseMatrix scalarDivide(double scalar, OperationControl* control = nullptr) && {
+        if (std::abs(scalar) < 1e-10) {
+            throw std::invalid_argument("Division by zero");
+        }
+        
+        return std::move(*this).scalarMultiply(1.0 / scalar, control);
+    }
+    
+    // Transpose of matrix. With caching enabled, a copy of the transpose
+    // computed at the current version is returned instead.
+    SparseMatrix transpose(OperationControl* control = nullptr) const {
+        if (derived) {
+            return SparseMatrix(*cachedTranspose(control));
+        }
+        return computeTranspose(control);
+    }
+    
+    // The transpose shared with the cache (computed now if it is missing or stale)
+    std::shared_ptr<const SparseMatrix> cachedTranspose(OperationControl* control = nullptr) const {
+        if (!derived) {
+            return std::make_shared<const SparseMatrix>(computeTranspose(control));
+        }
+        std::lock_guard<std::mutex> guard(derived->lock);
+        if (derived->transposeVersion != version) {
+            derived->transposed = std::make_shared<const SparseMatrix>(computeTranspose(control));
+            derived->transposeVersion = version;
+        }
+        return derived->transposed;
+    }
+    
+    // Diagonal elements (min(rows, cols) of them), cached like the transpose
+    std::vector<double> diagonal() const {
+        std::unique_lock<std::mutex> guard;
+        if (derived) {
+            guard = std::unique_lock<std::mutex>(derived->lock);
+            if (derived->diagonalVersion == version) {
+                return derived->diagonal;
+            }
+        }
+        std::vector<double> result(std::min(rows, cols), 0.0);
+        for (RowNode* rowNode = rowList; rowNode != nullptr && rowNode->row < cols; rowNode = rowNode->next) {
+            MatrixNode* colNode = rowNode->elements;
+            while (colNode != nullptr && colNode->col < rowNode->row) {
+                colNode = colNode->next;
+            }
+            if (colNode != nullptr && colNode->col == rowNode->row) {
+                result[rowNode->row] = colNode->value * scale;
+            }
+        }
+        if (derived) {
+            derived->diagonal = result;
+            derived->diagonalVersion = version;
+        }
+        return result;
+    }
+    
+    // Euclidean norm of every row, and the Frobenius norm of the matrix
+    std::vector<double> rowNorms() const {
+        std::unique_lock<std::mutex> guard = computeNorms();
+        return derived ? derived->rowNorms : normsOf().first;
+    }
+    
+    // Row norms with compensated sums in reproducible mode. Only the fast
+    // ones are cached.
+    std::vector<double> rowNorms(Summation summation) const {
+        return summation == Summation::Fast ? rowNorms() : normsOf(summation).first;
+    }
+    
+    // Frobenius norm on `threads` threads without the cache. A reproducible
+    // norm has the same bits for any thread count; a fast one may differ in
+    // the last bits from one thread count to another.
+    double frobeniusNorm(int threads, Summation summation) const {
+        std::vector<const RowNode*> rowNodes;
+        for (const RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            rowNodes.push_back(rowNode);
+        }
+        double squares = parallelSum(static_cast<long long>(rowNodes.size()), threads, summation, [&](long long i) {
+            return rowSum(rowNodes[i], summation, [](const MatrixNode* colNode) {
+                return colNode->value * colNode->value;
+            });
+        });
+        return std::sqrt(squares) * std::abs(scale);
+    }
+    
+    double frobeniusNorm() const {
+        std::unique_lock<std::mutex> guard = computeNorms();
+        return derived ? derived->frobeniusNorm : normsOf().second;
+    }
+    
+    // Cache the transpose, diagonal and norms until the next change. Off by default; copies inherit it.
+    void setDerivedCaching(bool enabled) {
+        if (!enabled) {
+            derived.reset();
+        } else if (!derived) {
+            derived.reset(new DerivedCache());
+        }
+    }
+    
+    bool getDerivedCaching() const { return derived != nullptr; }
+    
+    // Changes with every insert, removal, scaling or assignment
+    uint64_t getVersion() const { return version; }
+    
+    // Remember which rows change at which version. Any number of consumers
+    // can then each keep their own checkpoint (a getVersion() value) and
+    // ask for the rows changed since it. Off by default; copies don't inherit it.
+    void trackRowChanges(bool enabled) {
+        if (!enabled) {
+            changes.reset();
+        } else if (!changes) {
+            changes.reset(new RowChangeLog());
+            changes->trackedFrom = version;
+            changes->rowVersion.assign(rows, version);
+        }
+    }
+    
+    bool getRowChangeTracking() const { return changes != nullptr; }
+    
+    // Rows (ascending) changed after the given version. Every row counts as
+    // changed after a scaling or assignment, or if the checkpoint predates tracking.
+    std::vector<int> rowsChangedSince(uint64_t checkpoint) const {
+        if (!changes) {
+            throw std::runtime_error("Row changes are not being tracked");
+        }
+        std::vector<int> changed;
+        if (checkpoint < changes->trackedFrom || checkpoint < changes->wholeMatrix) {
+            changed.resize(rows);
+            for (int i = 0; i < rows; i++) {
+                changed[i] = i;
+            }
+            return changed;
+        }
+        auto first = std::upper_bound(changes->log.begin(), changes->log.end(),
+                                      std::make_pair(checkpoint, std::numeric_limits<int>::max()));
+        for (auto entry = first; entry != changes->log.end(); ++entry) {
+            changed.push_back(entry->second);
+        }
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        return changed;
+    }
+    
+    // CSR arrays of the listed rows (ascending), gathered in one walk of the
+    // row list: row k of the result is row rowIds[k] of this matrix
+    CSRArrays rowsToCSR(const std::vector<int>& rowIds) const {
+        CSRArrays arrays;
+        arrays.rows = static_cast<int>(rowIds.size());
+        arrays.cols = cols;
+        arrays.rowPtr.assign(rowIds.size() + 1, 0);
+        RowNode* rowNode = rowList;
+        for (size_t k = 0; k < rowIds.size(); k++) {
+            while (rowNode != nullptr && rowNode->row < rowIds[k]) {
+                rowNode = rowNode->next;
+            }
+            if (rowNode != nullptr && rowNode->row == rowIds[k]) {
+                for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                    arrays.colIdx.push_back(colNode->col);
+                    arrays.values.push_back(colNode->value * scale);
+                }
+            }
+            arrays.rowPtr[k + 1] = static_cast<int64_t>(arrays.colIdx.size());
+        }
+        return arrays;
+    }
+    
+    // Replace row rowIds[k] (ascending) by the elements [rowPtr[k], rowPtr[k + 1])
+    // of colIdx/values, whose columns must be increasing, in one walk of the
+    // row list. Every row is checked before any is changed, and each new row
+    // is built before the old one is released, so a failure leaves every row
+    // whole.
+    void replaceRows(const std::vector<int>& rowIds, const int64_t* rowPtr,
+                     const int32_t* colIdx, const double* values) {
+        int previous = -1;
+        for (size_t k = 0; k < rowIds.size(); k++) {
+            int r = rowIds[k];
+            if (r < 0 || r >= rows) {
+                throw std::out_of_range("Row index out of range");
+            }
+            if (r <= previous) {
+                throw std::invalid_argument("Rows to replace must be increasing");
+            }
+            previous = r;
+            int lastCol = -1;
+            for (int64_t e = rowPtr[k]; e < rowPtr[k + 1]; e++) {
+                if (colIdx[e] <= lastCol || colIdx[e] >= cols) {
+                    throw std::invalid_argument("Row elements must have increasing columns within the matrix");
+                }
+                lastCol = colIdx[e];
+            }
+        }
+        
+        foldScale();
+        RowNode** link = &rowList;
+        for (size_t k = 0; k < rowIds.size(); k++) {
+            int r = rowIds[k];
+            while (*link != nullptr && (*link)->row < r) {
+                link = &(*link)->next;
+            }
+            
+            RowNode* newRow = nullptr;
+            MatrixNode* last = nullptr;
+            try {
+                for (int64_t e = rowPtr[k]; e < rowPtr[k + 1]; e++) {
+                    if (std::abs(values[e]) < 1e-10) {
+                        continue;
+                    }
+                    if (newRow == nullptr) {
+                        newRow = allocateRow(r, static_cast<int>(rowPtr[k + 1] - e));
+                    }
+                    MatrixNode* newNode = allocateElement(newRow, colIdx[e], values[e]);
+                    if (last == nullptr) {
+                        newRow->elements = newNode;
+                    } else {
+                        last->next = newNode;
+                    }
+                    last = newNode;
+                }
+            } catch (...) {
+                if (newRow != nullptr) {
+                    releaseRow(newRow);
+                }
+                throw;
+            }
+            
+            if (*link != nullptr && (*link)->row == r) {
+                RowNode* old = *link;
+                for (MatrixNode* colNode = old->elements; colNode != nullptr; colNode = colNode->next) {
+                    hashRemoved(r, colNode->col, colNode->value);
+                }
+                *link = old->next;
+                releaseRow(old);
+            }
+            if (newRow != nullptr) {
+                newRow->next = *link;
+                *link = newRow;
+                for (MatrixNode* colNode = newRow->elements; colNode != nullptr; colNode = colNode->next) {
+                    hashAdded(r, colNode->col, colNode->value);
+                }
+                link = &newRow->next;
+            }
+        }
+    }
+    
+    // Calculate determinant (only for 2x2 and 3x3 matrices)
+    double determinant() const {
+        if (rows != cols) {
+            throw std::invalid_argument("Matrix must be square to calculate determinant");
+        }
+        
+        // One pass over the elements into an inline fixed-size matrix
+        if (rows == 1) {
+            return FixedSparseMatrix<1, 1>::from(*this).determinant();
+        } else if (rows == 2) {
+            return FixedSparseMatrix<2, 2>::from(*this).determinant();
+        } else if (rows == 3) {
+            return FixedSparseMatrix<3, 3>::from(*this).determinant();
+        } else {
+            throw std::invalid_argument("Determinant calculation for matrices larger than 3x3 not implemented");
+        }
+    }
+    
+    // Calculate inverse (only for 2x2 and 3x3 matrices)
+    SparseMatrix inverse() const {
+        if (rows != cols) {
+            throw std::invalid_argument("Matrix must be square to calculate inverse");
+        }
+        
+        if (rows == 1) {
+            return FixedSparseMatrix<1, 1>::from(*this).inverse().toSparseMatrix(resource);
+        } else if (rows == 2) {
+            return FixedSparseMatrix<2, 2>::from(*this).inverse().toSparseMatrix(resource);
+        } else if (rows == 3) {
+            return FixedSparseMatrix<3, 3>::from(*this).inverse().toSparseMatrix(resource);
+        } else {
+            throw std::invalid_argument("Inverse calculation for matrices larger than 3x3 not implemented");
+        }
+    }
+    
+    // Visit every stored element in row-major order as visit(row, col, value)
+    template <class Visitor>
+    void forEachElement(Visitor visit) const {
+        for (RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                visit(rowNode->row, colNode->col, colNode->value * scale);
+            }
+        }
+    }
+    
+    // Matrix-vector product y = A * x
+    std::vector<double> multiplyVector(const std::vector<double>& x) const;
+    
+    // y = A * x with the rows spread over `threads` threads. Each row is
+    // summed by one thread, so both modes give the same bits for any thread
+    // count; the reproducible one also compensates each row's sum.
+    std::vector<double> multiplyVector(const std::vector<double>& x, int threads,
+                                       Summation summation = Summation::Fast) const;
+    
+    // Count non-zero elements
+    int countNonZero() const {
+        int count = 0;
+        RowNode* rowNode = rowList;
+        while (rowNode != nullptr) {
+            MatrixNode* colNode = rowNode->elements;
+            while (colNode != nullptr) {
+                count++;
+                colNode = colNode->next;
+            }
+            rowNode = rowNode->next;
+        }
+        return count;
+    }
+    
+    // Approximate heap memory used by the matrix in bytes
+    size_t memoryUsage() const {
+        size_t bytes = sizeof(SparseMatrix);
+        for (RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            bytes += RowNode::allocationSize(rowNode->capacity);
+            for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                if (!rowNode->isInline(colNode)) {
+                    bytes += sizeof(MatrixNode);
+                }
+            }
+        }
+        return bytes;
+    }
+    
+    // Append rows [begin, end) of CSR arrays to a matrix that has no rows yet
+    static void appendCSRRows(SparseMatrix& result, int begin, int end, const int64_t* rowPtr,
+                              const int32_t* colIdx, const double* values) {
+        RowNode* lastRow = nullptr;
+        
+        for (int i = begin; i < end; i++) {
+            if (rowPtr[i] > rowPtr[i + 1]) {
+                throw std::runtime_error("Corrupt CSR data: row pointers are not increasing");
+            }
+            
+            MatrixNode* lastElement = nullptr;
+            RowNode* newRow = nullptr;
+            for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                if (colIdx[k] < 0 || colIdx[k] >= result.cols ||
+                    (lastElement != nullptr && colIdx[k] <= lastElement->col)) {
+                    throw std::runtime_error("Corrupt CSR data: bad column index");
+                }
+                if (std::abs(values[k]) < 1e-10) {
+                    continue; // Keep the no-stored-zeros invariant
+                }
+                
+                if (newRow == nullptr) {
+                    newRow = result.allocateRow(i, static_cast<int>(std::min<int64_t>(rowPtr[i + 1] - k, ROW_INLINE_ELEMENTS)));
+                    if (lastRow == nullptr) {
+                        result.rowList = newRow;
+                    } else {
+                        lastRow->next = newRow;
+                    }
+                    lastRow = newRow;
+                }
+                
+                MatrixNode* newElement = result.allocateElement(newRow, colIdx[k], values[k]);
+                result.hashAdded(i, colIdx[k], values[k]);
+                if (lastElement == nullptr) {
+                    newRow->elements = newElement;
+                } else {
+                    lastElement->next = newElement;
+                }
+                lastElement = newElement;
+            }
+        }
+    }
+    
+    // Build a matrix from CSR arrays in a single pass (columns sorted within
+    // each row). With threads > 1, row ranges are built concurrently and the
+    // resulting row lists joined; other resources than the global heap are
+    // not assumed to be thread safe, so they are always filled by one thread.
+    static SparseMatrix fromCSR(int r, int c, const int64_t* rowPtr, const int32_t* colIdx, const double* values,
+                                int threads = 1, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) {
+        SparseMatrix result(r, c, memory);
+        if (threads <= 1 || memory != std::pmr::new_delete_resource()) {
+            appendCSRRows(result, 0, r, rowPtr, colIdx, values);
+            return result;
+        }
+        
+        int count = std::min(threads, r);
+        std::vector<SparseMatrix> parts(count, SparseMatrix(r, c, memory));
+        std::vector<std::future<void> > workers;
+        for (int p = 0; p < count; p++) {
+            int begin = static_cast<int>(static_cast<long long>(r) * p / count);
+            int end = static_cast<int>(static_cast<long long>(r) * (p + 1) / count);
+            workers.push_back(std::async(std::launch::async, [&parts, p, begin, end, rowPtr, colIdx, values]() {
+                appendCSRRows(parts[p], begin, end, rowPtr, colIdx, values);
+            }));
+        }
+        for (int p = 0; p < count; p++) {
+            workers[p].get();
+        }
+        
+        RowNode** tail = &result.rowList;
+        for (size_t p = 0; p < parts.size(); p++) {
+            *tail = parts[p].rowList;
+            parts[p].rowList = nullptr;
+            while (*tail != nullptr) {
+                tail = &(*tail)->next;
+            }
+            result.valueHash += parts[p].valueHash;
+            result.structureHash += parts[p].structureHash;
+            result.smallest = std::min(result.smallest, parts[p].smallest);
+        }
+        return result;
+    }
+    
+    // Flatten the matrix into CSR arrays in one pass. The arrays belong to the
+    // caller, who can move them on or wrap them in a SparseMatrixView.
+    CSRArrays toCSR() const {
+        CSRArrays csr;
+        csr.rows = rows;
+        csr.cols = cols;
+        csr.rowPtr.assign(rows + 1, 0);
+        size_t count = static_cast<size_t>(countNonZero());
+        csr.colIdx.reserve(count);
+        csr.values.reserve(count);
+        for (RowNode* rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                csr.colIdx.push_back(colNode->col);
+                csr.values.push_back(colNode->value * scale);
+                csr.rowPtr[rowNode->row + 1]++;
+            }
+        }
+        for (int i = 0; i < rows; i++) {
+            csr.rowPtr[i + 1] += csr.rowPtr[i];
+        }
+        return csr;
+    }
+    
+    // Header describing this matrix in the binary on-disk format
+    BinaryHeader binaryHeader() const {
+        BinaryHeader header;
+        std::memcpy(header.magic, "SPMX", 4);
+        header.version = BINARY_FORMAT_VERSION;
+        header.rows = rows;
+        header.cols = cols;
+        header.nnz = countNonZero();
+        header.flags = 0;
+        return header;
+    }
+    
+    // Total size in bytes of a matrix image in the binary format
+    static uint64_t binarySize(const BinaryHeader& header) {
+        return sizeof(BinaryHeader)
+             + (static_cast<uint64_t>(header.rows) + 1) * sizeof(int64_t)
+             + static_cast<uint64_t>(header.nnz) * (sizeof(double) + sizeof(int32_t));
+    }
+    
+    // Write the matrix in the binary on-disk format
+    void writeBinary(std::ostream& out) const {
+        BinaryHeader header = binaryHeader();
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        writeBinaryArrays(out);
+    }
+    
+    // Write the CSR arrays that follow the header in the binary format
+    void writeBinaryArrays(std::ostream& out) const {
+        // Row pointers, streamed without building the full array
+        int64_t offset = 0;
+        RowNode* rowNode = rowList;
+        for (int i = 0; i <= rows; i++) {
+            out.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+            if (rowNode != nullptr && rowNode->row == i) {
+                for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                    offset++;
+                }
+                rowNode = rowNode->next;
+            }
+        }
+        
+        // Values, then column indices (keeps every array naturally aligned)
+        for (rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                double value = colNode->value * scale;
+                out.write(reinterpret_cast<const char*>(&value), sizeof(double));
+            }
+        }
+        for (rowNode = rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            for (MatrixNode* colNode = rowNode->elements; colNode != nullptr; colNode = colNode->next) {
+                int32_t col = colNode->col;
+                out.write(reinterpret_cast<const char*>(&col), sizeof(col));
+            }
+        }
+    }
+    
+    // Save the matrix to a file in the binary on-disk format
+    void saveBinary(const std::string& path) const {
+        // Write to a temporary file first so a crash never leaves a half-written matrix
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot create file " + tmpPath);
+            }
+            writeBinary(out);
+            if (!out) {
+                throw std::runtime_error("Failed writing file " + tmpPath);
+            }
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Cannot replace file " + path);
+        }
+    }
+    
+    // Write the matrix in the compressed binary format, blockRows rows per block
+    void writeCompressed(std::ostream& out, int blockRows = 4096) const {
+        if (blockRows <= 0) {
+            throw std::invalid_argument("Rows per block must be positive");
+        }
+        CSRArrays csr = toCSR();
+        const std::vector<int64_t>& rowPtr = csr.rowPtr;
+        const std::vector<int32_t>& colIdx = csr.colIdx;
+        const std::vector<double>& values = csr.values;
+        
+        // Blocks are independent, so they are encoded in parallel
+        uint64_t blockCount = (static_cast<uint64_t>(rows) + blockRows - 1) / blockRows;
+        std::vector<std::string> blocks(blockCount);
+        parallelRanges(static_cast<long long>(blockCount), std::max(1u, std::thread::hardware_concurrency()),
+                       [&](long long begin, long long end) {
+            for (long long b = begin; b < end; b++) {
+                int firstRow = static_cast<int>(b * blockRows);
+                int rowCount = std::min(blockRows, rows - firstRow);
+                blocks[b] = BlockCodec::encode(rowPtr.data() + firstRow, rowCount, colIdx.data(), values.data());
+            }
+        });
+        
+        BinaryHeader header = binaryHeader();
+        header.flags = BINARY_FLAG_COMPRESSED;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(&blockCount), sizeof(blockCount));
+        uint64_t offset = sizeof(header) + sizeof(blockCount) + blockCount * sizeof(CompressedBlock);
+        for (uint64_t b = 0; b < blockCount; b++) {
+            CompressedBlock entry;
+            entry.firstRow = static_cast<int32_t>(b * blockRows);
+            entry.rowCount = std::min(blockRows, rows - entry.firstRow);
+            entry.firstElement = rowPtr[entry.firstRow];
+            entry.offset = offset;
+            entry.length = blocks[b].size();
+            out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            offset += entry.length;
+        }
+        for (uint64_t b = 0; b < blockCount; b++) {
+            out.write(blocks[b].data(), static_cast<std::streamsize>(blocks[b].size()));
+        }
+    }
+    
+    // Save the matrix to a file in the compressed binary format
+    void saveCompressed(const std::string& path, int blockRows = 4096) const {
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot create file " + tmpPath);
+            }
+            writeCompressed(out, blockRows);
+            if (!out) {
+                throw std::runtime_error("Failed writing file " + tmpPath);
+            }
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Cannot replace file " + path);
+        }
+    }
+    
+    // Validate the block index of a compressed image; returns the first entry
+    static const CompressedBlock* checkCompressed(const char* data, size_t size, const BinaryHeader& header) {
+        uint64_t blockCount;
+        if (size < sizeof(BinaryHeader) + sizeof(blockCount)) {
+            throw std::runtime_error("Sparse matrix file is truncated");
+        }
+        std::memcpy(&blockCount, data + sizeof(BinaryHeader), sizeof(blockCount));
+        if (blockCount > static_cast<uint64_t>(header.rows) ||
+            size < sizeof(BinaryHeader) + sizeof(blockCount) + blockCount * sizeof(CompressedBlock)) {
+            throw std::runtime_error("Corrupt compressed block index");
+        }
+        
+        const CompressedBlock* blocks = reinterpret_cast<const CompressedBlock*>(data + sizeof(BinaryHeader) + sizeof(blockCount));
+        int32_t nextRow = 0;
+        int64_t nextElement = 0;
+        for (uint64_t b = 0; b < blockCount; b++) {
+            if (blocks[b].firstRow != nextRow || blocks[b].rowCount <= 0 || blocks[b].rowCount > header.rows - nextRow ||
+                blocks[b].firstElement < nextElement || blocks[b].firstElement > header.nnz ||
+                blocks[b].offset > size || blocks[b].length > size - blocks[b].offset) {
+                throw std::runtime_error("Corrupt compressed block index");
+            }
+            nextRow += blocks[b].rowCount;
+            nextElement = blocks[b].firstElement;
+        }
+        if (nextRow != header.rows) {
+            throw std::runtime_error("Corrupt compressed block index");
+        }
+        
+        // Past the first of each row, every element takes at least one bit of
+        // column gap, which bounds what a block can hold before it is decoded
+        for (uint64_t b = 0; b < blockCount; b++) {
+            int64_t elements = (b + 1 < blockCount ? blocks[b + 1].firstElement : header.nnz) - blocks[b].firstElement;
+            if (static_cast<uint64_t>(elements) > static_cast<uint64_t>(blocks[b].rowCount) + 8 * blocks[b].length) {
+                throw std::runtime_error("Corrupt compressed block index");
+            }
+        }
+        return blocks;
+    }
+    
+    // Decompress rows [beginRow, endRow) of a compressed image into a
+    // (endRow - beginRow) x cols matrix. Only the blocks holding those rows
+    // are decoded, in parallel, straight into one set of CSR arrays.
+    static SparseMatrix fromCompressed(const char* data, size_t size, int beginRow, int endRow, int threads) {
+        BinaryHeader header = checkBinary(data, size);
+        if (beginRow < 0 || endRow > header.rows || beginRow >= endRow) {
+            throw std::out_of_range("Row range out of range");
+        }
+        const CompressedBlock* blocks = checkCompressed(data, size, header);
+        uint64_t blockCount = 0;
+        std::memcpy(&blockCount, data + sizeof(BinaryHeader), sizeof(blockCount));
+        
+        uint64_t firstBlock = 0;
+        while (blocks[firstBlock].firstRow + blocks[firstBlock].rowCount <= beginRow) {
+            firstBlock++;
+        }
+        uint64_t lastBlock = firstBlock;
+        while (lastBlock + 1 < blockCount && blocks[lastBlock + 1].firstRow < endRow) {
+            lastBlock++;
+        }
+        auto elementsEnd = [&](uint64_t b) {
+            return b + 1 < blockCount ? blocks[b + 1].firstElement : header.nnz;
+        };
+        
+        int firstRow = blocks[firstBlock].firstRow;
+        int rowSpan = blocks[lastBlock].firstRow + blocks[lastBlock].rowCount - firstRow;
+        int64_t base = blocks[firstBlock].firstElement;
+        std::vector<int64_t> rowLength(rowSpan);
+        std::vector<int32_t> colIdx(elementsEnd(lastBlock) - base);
+        std::vector<double> values(colIdx.size());
+        parallelRanges(static_cast<long long>(lastBlock - firstBlock + 1), threads, [&](long long begin, long long end) {
+            for (long long i = begin; i < end; i++) {
+                const CompressedBlock& block = blocks[firstBlock + i];
+                int64_t at = block.firstElement - base;
+                BlockCodec::decode(data + block.offset, block.length, block.rowCount, elementsEnd(firstBlock + i) - block.firstElement,
+                                   header.cols, &rowLength[block.firstRow - firstRow], &colIdx[at], &values[at]);
+            }
+        });
+        
+        // Row pointers are absolute positions into colIdx/values
+        std::vector<int64_t> rowPtr(rowSpan + 1, 0);
+        for (int r = 0; r < rowSpan; r++) {
+            rowPtr[r + 1] = rowPtr[r] + rowLength[r];
+        }
+        int offset = beginRow - firstRow;
+        return fromCSR(endRow - beginRow, header.cols, rowPtr.data() + offset, colIdx.data(), values.data(), threads);
+    }
+    
+    // Validate an in-memory image of the binary format and return its header
+    static BinaryHeader checkBinary(const char* data, size_t size) {
+        if (size < sizeof(BinaryHeader)) {
+            throw std::runtime_error("Not a sparse matrix file (too short)");
+        }
+        
+        BinaryHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, "SPMX", 4) != 0) {
+            throw std::runtime_error("Not a sparse matrix file (bad magic)");
+        }
+        if (header.version != BINARY_FORMAT_VERSION || (header.flags & ~BINARY_FLAG_COMPRESSED) != 0) {
+            throw std::runtime_error("Unsupported sparse matrix file version");
+        }
+        if (header.rows <= 0 || header.cols <= 0 || header.nnz < 0) {
+            throw std::runtime_error("Corrupt sparse matrix file header");
+        }
+        if (header.flags & BINARY_FLAG_COMPRESSED) {
+            checkCompressed(data, size, header);
+            return header;
+        }
+        
+        // Compare against the space left instead of computing binarySize,
+        // which a huge nnz would overflow
+        uint64_t available = size - sizeof(BinaryHeader);
+        uint64_t pointerBytes = (static_cast<uint64_t>(header.rows) + 1) * sizeof(int64_t);
+        if (pointerBytes > available ||
+            static_cast<uint64_t>(header.nnz) > (available - pointerBytes) / (sizeof(double) + sizeof(int32_t))) {
+            throw std::runtime_error("Sparse matrix file is truncated");
+        }
+        
+        // Every row must lie inside the element arrays before anything walks them
+        const int64_t* rowPtr = reinterpret_cast<const int64_t*>(data + sizeof(BinaryHeader));
+        if (rowPtr[0] != 0 || rowPtr[header.rows] != header.nnz) {
+            throw std::runtime_error("Corrupt CSR data: row pointers do not match element count");
+        }
+        for (int i = 0; i < header.rows; i++) {
+            if (rowPtr[i] > rowPtr[i + 1] || rowPtr[i + 1] > header.nnz) {
+                throw std::runtime_error("Corrupt CSR data: row pointers are not increasing");
+            }
+        }
+        return header;
+    }
+    
+    // Build a matrix from an in-memory image of the binary format
+    static SparseMatrix fromBinary(const char* data, size_t size) {
+        BinaryHeader header = checkBinary(data, size);
+        if (header.flags & BINARY_FLAG_COMPRESSED) {
+            return fromCompressed(data, size, 0, header.rows, std::max(1u, std::thread::hardware_concurrency()));
+        }
+        const int64_t* rowPtr = reinterpret_cast<const int64_t*>(data + sizeof(BinaryHeader));
+        const double* values = reinterpret_cast<const double*>(rowPtr + header.rows + 1);
+        const int32_t* colIdx = reinterpret_cast<const int32_t*>(values + header.nnz);
+        return fromCSR(header.rows, header.cols, rowPtr, colIdx, values);
+    }
+    
+    // Load a matrix saved with saveBinary (the file is memory mapped, not parsed)
+    static SparseMatrix loadBinary(const std::string& path) {
+        MappedFile file(path);
+        return fromBinary(file.bytes(), file.size());
+    }
+    
+    // Load only rows [beginRow, endRow) of a binary file (plain or compressed)
+    // as a (endRow - beginRow) x cols matrix
+    static SparseMatrix loadBinaryRows(const std::string& path, int beginRow, int endRow) {
+        MappedFile file(path);
+        BinaryHeader header = checkBinary(file.bytes(), file.size());
+        if (header.flags & BINARY_FLAG_COMPRESSED) {
+            return fromCompressed(file.bytes(), file.size(), beginRow, endRow, std::max(1u, std::thread::hardware_concurrency()));
+        }
+        if (beginRow < 0 || endRow > header.rows || beginRow >= endRow) {
+            throw std::out_of_range("Row range out of range");
+        }
+        const int64_t* rowPtr = reinterpret_cast<const int64_t*>(file.bytes() + sizeof(BinaryHeader));
+        const double* values = reinterpret_cast<const double*>(rowPtr + header.rows + 1);
+        const int32_t* colIdx = reinterpret_cast<const int32_t*>(values + header.nnz);
+        return fromCSR(endRow - beginRow, header.cols, rowPtr + beginRow, colIdx, values);
+    }
+};
+
+// Storage backends for BasicSparseMatrix. A backend keeps the elements along
+// lines (rows for row-major layouts, columns otherwise) and provides:
+//   rowMajor                 true when lines are rows
+//   getRows, getCols, countNonZero, memoryUsage, getResource
+//   Line                     a cheap handle on one line; line.forEach(visit)
+//                            calls visit(index, value) with increasing index,
+//                            and Line{} is an empty line
+//   line(l)                  the handle for line l
+//   forEachLine(visit)       visit(l, line) in increasing l, for every line
+//                            that can hold elements
+//   Builder                  Builder(rows, cols, memory), reserve(nnz),
+//                            append(line, index, value) in line then index
+//                            order, finish() returning the backend
+// Kernels are written once against this interface and instantiated for each
+// backend, so the layout is chosen at compile time with no virtual calls.
+template <class Storage, class = void>
+struct IsStorageBackend : std::false_type {};
+
+template <class Storage>
+struct IsStorageBackend<Storage, std::void_t<
+    decltype(Storage::rowMajor),
+    decltype(std::declval<const Storage&>().getRows() + std::declval<const Storage&>().getCols()),
+    decltype(std::declval<const Storage&>().countNonZero()),
+    decltype(std::declval<const Storage&>().memoryUsage()),
+    decltype(std::declval<const Storage&>().getResource()),
+    decltype(std::declval<const Storage&>().line(0).forEach(std::declval<void (*)(int, double)>())),
+    decltype(typename Storage::Line{}),
+    decltype(std::declval<typename Storage::Builder&>().reserve(size_t(0))),
+    decltype(std::declval<typename Storage::Builder&>().append(0, 0, 0.0)),
+    decltype(Storage(std::declval<typename Storage::Builder&>().finish()))> > : std::true_type {};
+
+// One line kept as parallel index and value arrays
+struct ArrayLine {
+    const int32_t* index = nullptr;
+    const double* value = nullptr;
+    int64_t count = 0;
+    
+    template <class Visitor>
+    void forEach(Visitor visit) const {
+        for (int64_t k = 0; k < count; k++) {
+            visit(static_cast<int>(index[k]), value[k]);
+        }
+    }
+};
+
+template <bool RowMajor>
+class CompressedStorage;
+
+// Read-only matrix over CSR arrays owned elsewhere (a memory-mapped file, a
+// shared memory segment, another component's buffers, ...). Nothing is
+// copied; operations read the arrays in place and return ordinary
+// SparseMatrix results. Row pointers need not start at 0, so a slice of
+// larger arrays can be viewed, and explicit zeros are allowed. The view is
+// itself a CSR storage backend, so its operations are the BasicSparseMatrix
+// kernels run over the arrays in place.
+class SparseMatrixView {
+private:
+    int rows;               // Number of rows
+    int cols;               // Number of columns
+    const int64_t* rowPtr;  // Start of each row in colIdx/values (rows + 1 entries)
+    const int32_t* colIdx;  // Column of each element, increasing within a row
+    const double* values;   // Value of each element
+    std::shared_ptr<const void> owner;  // Keeps arrays built for the view alive (COO row pointers, kernel results)
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource(); // For results and workspaces
+    
+    // Compare with another matrix element by element, skipping explicit zeros
+    template <class Matrix>
+    bool sameElements(const Matrix& other) const {
+        int i = 0;
+        int64_t k = rowPtr[0];
+        bool same = true;
+        auto skipZeros = [&]() {
+            while (i < rows && (k == rowPtr[i + 1] || std::abs(values[k]) < 1e-10)) {
+                if (k == rowPtr[i + 1]) {
+                    i++;
+                } else {
+                    k++;
+                }
+            }
+        };
+        other.forEachElement([&](int r, int c, double v) {
+            if (std::abs(v) < 1e-10) {
+                return;
+            }
+            skipZeros();
+            if (i == rows || r != i || c != colIdx[k] || v != values[k]) {
+                same = false;
+            } else {
+                k++;
+            }
+        });
+        skipZeros();
+        return same && i == rows;
+    }
+    
+public:
+    // Storage backend interface (see IsStorageBackend): the rows are the lines
+    static constexpr bool rowMajor = true;
+    using Line = ArrayLine;
+    class Builder;
+    
+    // Wrap external CSR arrays. Validation (an O(nnz) pass) is optional for
+    // arrays already known to be well formed.
+    SparseMatrixView(int r, int c, const int64_t* ptr, const int32_t* idx, const double* val, bool validateArrays = false)
+        : rows(r), cols(c), rowPtr(ptr), colIdx(idx), values(val) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+        if (validateArrays) {
+            validate();
+        }
+    }
+    
+    // View arrays produced by SparseMatrix::toCSR (they must outlive the view)
+    explicit SparseMatrixView(const CSRArrays& csr)
+        : SparseMatrixView(csr.rows, csr.cols, csr.rowPtr.data(), csr.colIdx.data(), csr.values.data()) {}
+    
+    // Wrap external COO arrays sorted by row, then column. The element arrays
+    // are used in place; only the row pointers (rows + 1 entries) are built.
+    static SparseMatrixView fromCOO(int r, int c, int64_t nnz, const int32_t* rowIdx, const int32_t* idx,
+                                    const double* val, bool validateArrays = false) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+        std::shared_ptr<std::vector<int64_t> > ptr = std::make_shared<std::vector<int64_t> >(r + 1, 0);
+        for (int64_t k = 0; k < nnz; k++) {
+            if (rowIdx[k] < 0 || rowIdx[k] >= r || (k > 0 && rowIdx[k] < rowIdx[k - 1])) {
+                throw std::runtime_error("Corrupt COO data: rows are not sorted or out of range");
+            }
+            (*ptr)[rowIdx[k] + 1]++;
+        }
+        for (int i = 0; i < r; i++) {
+            (*ptr)[i + 1] += (*ptr)[i];
+        }
+        SparseMatrixView view(r, c, ptr->data(), idx, val, validateArrays);
+        view.owner = ptr;
+        return view;
+    }
+    
+    // Check that row pointers never decrease and columns are in range and
+    // strictly increasing within each row
+    void validate() const {
+        for (int i = 0; i < rows; i++) {
+            if (rowPtr[i] > rowPtr[i + 1]) {
+                throw std::runtime_error("Corrupt CSR data: row pointers are not increasing");
+            }
+            for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                if (colIdx[k] < 0 || colIdx[k] >= cols || (k > rowPtr[i] && colIdx[k] <= colIdx[k - 1])) {
+                    throw std::runtime_error("Corrupt CSR data: bad column index");
+                }
+            }
+        }
+    }
+    
+    // View an in-memory image of the binary format without copying it. The
+    // image may come from another process or a file, so its arrays are validated.
+    static SparseMatrixView fromBinary(const char* data, size_t size) {
+        BinaryHeader header = SparseMatrix::checkBinary(data, size);
+        if (header.flags & BINARY_FLAG_COMPRESSED) {
+            throw std::runtime_error("A compressed matrix cannot be read in place; load it instead");
+        }
+        const int64_t* ptr = reinterpret_cast<const int64_t*>(data + sizeof(BinaryHeader));
+        const double* val = reinterpret_cast<const double*>(ptr + header.rows + 1);
+        const int32_t* idx = reinterpret_cast<const int32_t*>(val + header.nnz);
+        return SparseMatrixView(header.rows, header.cols, ptr, idx, val, true);
+    }
+    
+    // Get dimensions
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    
+    // Stored elements, explicit zeros included
+    int countNonZero() const { return static_cast<int>(rowPtr[rows] - rowPtr[0]); }
+    
+    // Size of the view and of the arrays it reads
+    size_t memoryUsage() const {
+        return sizeof(*this) + static_cast<size_t>(rows + 1) * sizeof(int64_t) +
+               static_cast<size_t>(countNonZero()) * (sizeof(int32_t) + sizeof(double));
+    }
+    
+    Line line(int r) const {
+        return Line{colIdx + rowPtr[r], values + rowPtr[r], rowPtr[r + 1] - rowPtr[r]};
+    }
+    
+    template <class Visitor>
+    void forEachLine(Visitor visit) const {
+        for (int i = 0; i < rows; i++) {
+            if (rowPtr[i + 1] > rowPtr[i]) {
+                visit(i, line(i));
+            }
+        }
+    }
+    
+    // Same values as SparseMatrix::fingerprint (with no scale pending) and
+    // structuralFingerprint for equal matrices, computed in one O(nnz) pass
+    uint64_t fingerprint() const {
+        uint64_t hash = 0;
+        forEachElement([&](int r, int c, double v) {
+            if (std::abs(v) >= 1e-10) {
+                hash += SparseMatrix::entryHash(r, c, v);
+            }
+        });
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(rows)) << 32) | static_cast<uint32_t>(cols);
+        return mixHash(hash ^ mixHash(shape));
+    }
+    
+    uint64_t structuralFingerprint() const {
+        uint64_t hash = 0;
+        forEachElement([&](int r, int c, double v) {
+            if (std::abs(v) >= 1e-10) {
+                hash += SparseMatrix::positionHash(r, c);
+            }
+        });
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(rows)) << 32) | static_cast<uint32_t>(cols);
+        return mixHash(hash ^ mixHash(~shape));
+    }
+    
+    // Exact equality with another view or an owning matrix
+    bool operator==(const SparseMatrixView& other) const {
+        return rows == other.rows && cols == other.cols && sameElements(other);
+    }
+    
+    bool operator==(const SparseMatrix& other) const {
+        return rows == other.getRows() && cols == other.getCols() && sameElements(other);
+    }
+    
+    template <class Matrix>
+    bool operator!=(const Matrix& other) const {
+        return !(*this == other);
+    }
+    
+    // Visit every stored element in row-major order as visit(row, col, value)
+    template <class Visitor>
+    void forEachElement(Visitor visit) const {
+        for (int i = 0; i < rows; i++) {
+            for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                visit(i, static_cast<int>(colIdx[k]), values[k]);
+            }
+        }
+    }
+    
+    // Get value at position (r, c) by binary search within the row
+    double get(int r, int c) const {
+        if (r < 0 || r >= rows || c < 0 || c >= cols) {
+            throw std::out_of_range("Index out of range");
+        }
+        const int32_t* begin = colIdx + rowPtr[r];
+        const int32_t* end = colIdx + rowPtr[r + 1];
+        const int32_t* found = std::lower_bound(begin, end, c);
+        if (found == end || *found != c) {
+            return 0.0;
+        }
+        return values[found - colIdx];
+    }
+    
+    // Display the matrix
+    void display() const {
+        std::cout << "Matrix " << rows << "x" << cols << ":" << std::endl;
+        
+        if (countNonZero() == 0) {
+            std::cout << "Empty matrix (all zeros)" << std::endl;
+            return;
+        }
+        
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                std::cout << std::setw(8) << std::fixed << std::setprecision(2) << get(i, j) << " ";
+            }
+            std::cout << std::endl;
+        }
+    }
+    
+    // Display sparse representation
+    void displaySparse() const {
+        std::cout << "Sparse representation of " << rows << "x" << cols << " matrix:" << std::endl;
+        std::cout << "Row\tColumn\tValue" << std::endl;
+        for (int i = 0; i < rows; i++) {
+            for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                std::cout << i << "\t" << colIdx[k] << "\t"
+                          << std::fixed << std::setprecision(2) << values[k] << std::endl;
+            }
+        }
+        std::cout << "Total non-zero elements: " << countNonZero() << std::endl;
+    }
+    
+    // Matrix-vector product y = A * x. This and the other kernels are the
+    // BasicSparseMatrix ones run over the view, so they are defined after it.
+    std::vector<double> multiplyVector(const std::vector<double>& x) const;
+    
+    // y = A * x with the rows spread over `threads` threads; as for SparseMatrix,
+    // each row is summed by one thread and compensated in reproducible mode
+    std::vector<double> multiplyVector(const std::vector<double>& x, int threads,
+                                       Summation summation = Summation::Fast) const;
+    
+    // Frobenius norm on `threads` threads, reproducible as for SparseMatrix
+    double frobeniusNorm(int threads, Summation summation) const {
+        return std::sqrt(parallelSum(rowPtr[rows] - rowPtr[0], threads, summation, [&](long long k) {
+            double v = values[rowPtr[0] + k];
+            return v * v;
+        }));
+    }
+    
+    // Addition and subtraction, merging the sorted columns of each row
+    SparseMatrix add(const SparseMatrixView& other) const;
+    SparseMatrix subtract(const SparseMatrixView& other) const;
+    
+    // Scalar multiplication
+    SparseMatrix scalarMultiply(double scalar) const;
+    
+    // Scalar division
+    SparseMatrix scalarDivide(double scalar) const {
+        if (std::abs(scalar) < 1e-10) {
+            throw std::invalid_argument("Division by zero");
+        }
+        return scalarMultiply(1.0 / scalar);
+    }
+    
+    // Matrix multiplication, one output row at a time with a dense accumulator
+    SparseMatrix multiply(const SparseMatrixView& other) const;
+    
+    // Transpose of matrix (counting sort by column)
+    SparseMatrix transpose() const;
+    
+    // Determinant and inverse are only defined up to 3x3, so copying is cheap
+    double determinant() const {
+        return toSparseMatrix().determinant();
+    }
+    
+    SparseMatrix inverse() const {
+        return toSparseMatrix().inverse();
+    }
+    
+    // Copy the viewed matrix into an owning SparseMatrix
+    SparseMatrix toSparseMatrix() const {
+        return SparseMatrix::fromCSR(rows, cols, rowPtr, colIdx, values, 1, resource);
+    }
+    
+    // Memory resource used for results and temporary workspaces
+    void setResource(std::pmr::memory_resource* memory) { resource = memory; }
+    std::pmr::memory_resource* getResource() const { return resource; }
+};
+
+// SparseMatrix's own linked rows as a backend. The rows are either owned or
+// borrowed from a matrix that outlives the storage, which is how SparseMatrix
+// runs the shared kernels over itself without copying.
+class LinkedListStorage {
+private:
+    std::unique_ptr<SparseMatrix> owned;    // Null when the rows are borrowed
+    const SparseMatrix* matrix;             // The matrix whose rows are read
+    
+    explicit LinkedListStorage(const SparseMatrix* borrowed) : matrix(borrowed) {}
+    
+public:
+    static constexpr bool rowMajor = true;
+    
+    struct Line {
+        const MatrixNode* first = nullptr;
+        double scale = 1.0;   // The matrix's pending scale factor
+        
+        template <class Visitor>
+        void forEach(Visitor visit) const {
+            for (const MatrixNode* node = first; node != nullptr; node = node->next) {
+                visit(node->col, node->value * scale);
+            }
+        }
+    };
+    
+    explicit LinkedListStorage(SparseMatrix m) : owned(new SparseMatrix(std::move(m))), matrix(owned.get()) {}
+    
+    // Read the rows of m in place; m must outlive the storage
+    static LinkedListStorage borrow(const SparseMatrix& m) { return LinkedListStorage(&m); }
+    
+    // Copies own their rows, even when the original borrows them
+    LinkedListStorage(const LinkedListStorage& other) : LinkedListStorage(SparseMatrix(*other.matrix)) {}
+    LinkedListStorage(LinkedListStorage&& other) noexcept = default;
+    
+    LinkedListStorage& operator=(LinkedListStorage other) noexcept {
+        std::swap(owned, other.owned);
+        std::swap(matrix, other.matrix);
+        return *this;
+    }
+    
+    int getRows() const { return matrix->getRows(); }
+    int getCols() const { return matrix->getCols(); }
+    int countNonZero() const { return matrix->countNonZero(); }
+    size_t memoryUsage() const { return matrix->memoryUsage(); }
+    std::pmr::memory_resource* getResource() const { return matrix->getResource(); }
+    
+    // Rows are found by walking the row list
+    Line line(int l) const {
+        for (const RowNode* rowNode = matrix->rowList; rowNode != nullptr && rowNode->row <= l; rowNode = rowNode->next) {
+            if (rowNode->row == l) {
+                return Line{rowNode->elements, matrix->scale};
+            }
+        }
+        return Line{};
+    }
+    
+    template <class Visitor>
+    void forEachLine(Visitor visit) const {
+        for (const RowNode* rowNode = matrix->rowList; rowNode != nullptr; rowNode = rowNode->next) {
+            visit(rowNode->row, Line{rowNode->elements, matrix->scale});
+        }
+    }
+    
+    const SparseMatrix& getMatrix() const { return *matrix; }
+    
+    // The matrix, moved out when owned and copied when borrowed
+    SparseMatrix release() {
+        if (owned) {
+            return std::move(*owned);
+        }
+        return SparseMatrix(*matrix);
+    }
+    
+    // Appends rows and elements at the tail, so building is O(nnz)
+    class Builder {
+    private:
+        SparseMatrix result;
+        RowNode* lastRow;
+        MatrixNode* lastElement;
+        
+    public:
+        Builder(int r, int c, std::pmr::memory_resource* memory)
+            : result(r, c, memory), lastRow(nullptr), lastElement(nullptr) {}
+        
+        void reserve(size_t) {}
+        
+        void append(int line, int index, double value) {
+            if (lastRow == nullptr || lastRow->row != line) {
+                RowNode* newRow = result.allocateRow(line);
+                if (lastRow == nullptr) {
+                    result.rowList = newRow;
+                } else {
+                    lastRow->next = newRow;
+                }
+                lastRow = newRow;
+                lastElement = nullptr;
+            }
+            MatrixNode* newElement = result.allocateElement(lastRow, index, value);
+            if (lastElement == nullptr) {
+                lastRow->elements = newElement;
+            } else {
+                lastElement->next = newElement;
+            }
+            lastElement = newElement;
+            result.hashAdded(line, index, value);
+        }
+        
+        LinkedListStorage finish() { return LinkedListStorage(std::move(result)); }
+    };
+};
+
+// Compressed rows (CSR) or, with RowMajor = false, compressed columns (CSC)
+template <bool RowMajor>
+class CompressedStorage {
+private:
+    int rows;
+    int cols;
+    std::pmr::vector<int64_t> start;   // Start of each line in index/value (lines + 1 entries)
+    std::pmr::vector<int32_t> index;   // Column (CSR) or row (CSC) of each element
+    std::pmr::vector<double> value;
+    
+public:
+    static constexpr bool rowMajor = RowMajor;
+    using Line = ArrayLine;
+    
+    CompressedStorage(int r, int c, std::pmr::memory_resource* memory)
+        : rows(r), cols(c), start(static_cast<size_t>(RowMajor ? r : c) + 1, 0, memory), index(memory), value(memory) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+    }
+    
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    int countNonZero() const { return static_cast<int>(index.size()); }
+    std::pmr::memory_resource* getResource() const { return start.get_allocator().resource(); }
+    
+    size_t memoryUsage() const {
+        return sizeof(*this) + start.capacity() * sizeof(int64_t) + index.capacity() * sizeof(int32_t) +
+               value.capacity() * sizeof(double);
+    }
+    
+    Line line(int l) const {
+        return Line{index.data() + start[l], value.data() + start[l], start[l + 1] - start[l]};
+    }
+    
+    template <class Visitor>
+    void forEachLine(Visitor visit) const {
+        for (int l = 0; l + 1 < static_cast<int>(start.size()); l++) {
+            if (start[l + 1] > start[l]) {
+                visit(l, line(l));
+            }
+        }
+    }
+    
+    // Zero-copy view of CSR storage for the SparseMatrixView kernels
+    SparseMatrixView view() const {
+        static_assert(RowMajor, "Only row-major storage can be viewed as CSR");
+        return SparseMatrixView(rows, cols, start.data(), index.data(), value.data());
+    }
+    
+    class Builder {
+    private:
+        CompressedStorage result;
+        int current;   // Line being filled
+        
+    public:
+        Builder(int r, int c, std::pmr::memory_resource* memory) : result(r, c, memory), current(0) {}
+        
+        void reserve(size_t nnz) {
+            result.index.reserve(nnz);
+            result.value.reserve(nnz);
+        }
+        
+        void append(int line, int i, double v) {
+            while (current < line) {
+                result.start[++current] = static_cast<int64_t>(result.index.size());
+            }
+            result.index.push_back(i);
+            result.value.push_back(v);
+        }
+        
+        CompressedStorage finish() {
+            while (current + 1 < static_cast<int>(result.start.size())) {
+                result.start[++current] = static_cast<int64_t>(result.index.size());
+            }
+            return std::move(result);
+        }
+    };
+};
+
+using CSRStorage = CompressedStorage<true>;
+using CSCStorage = CompressedStorage<false>;
+
+// Builds the results of view kernels as CSR storage owned by the view
+class SparseMatrixView::Builder {
+private:
+    CSRStorage::Builder arrays;
+    std::pmr::memory_resource* memory;
+    
+public:
+    Builder(int r, int c, std::pmr::memory_resource* m) : arrays(r, c, m), memory(m) {}
+    
+    void reserve(size_t nnz) { arrays.reserve(nnz); }
+    void append(int line, int index, double value) { arrays.append(line, index, value); }
+    
+    SparseMatrixView finish() {
+        std::shared_ptr<const CSRStorage> storage = std::make_shared<const CSRStorage>(arrays.finish());
+        SparseMatrixView view = storage->view();
+        view.owner = storage;
+        view.resource = memory;
+        return view;
+    }
+};
+
+// Doubly compressed rows: only non-empty rows are stored, so memory depends
+// on nnz alone, however many rows the matrix has
+class HypersparseStorage {
+private:
+    int rows;
+    int cols;
+    std::pmr::vector<int32_t> lineIds;   // Non-empty rows, increasing
+    std::pmr::vector<int64_t> start;     // Start of each stored row (stored rows + 1 entries)
+    std::pmr::vector<int32_t> index;
+    std::pmr::vector<double> value;
+    
+    ArrayLine storedLine(size_t k) const {
+        return ArrayLine{index.data() + start[k], value.data() + start[k], start[k + 1] - start[k]};
+    }
+    
+public:
+    static constexpr bool rowMajor = true;
+    using Line = ArrayLine;
+    
+    HypersparseStorage(int r, int c, std::pmr::memory_resource* memory)
+        : rows(r), cols(c), lineIds(memory), start(1, 0, memory), index(memory), value(memory) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+    }
+    
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    int countNonZero() const { return static_cast<int>(index.size()); }
+    std::pmr::memory_resource* getResource() const { return start.get_allocator().resource(); }
+    
+    size_t memoryUsage() const {
+        return sizeof(*this) + lineIds.capacity() * sizeof(int32_t) + start.capacity() * sizeof(int64_t) +
+               index.capacity() * sizeof(int32_t) + value.capacity() * sizeof(double);
+    }
+    
+    // Binary search among the stored rows
+    Line line(int l) const {
+        auto found = std::lower_bound(lineIds.begin(), lineIds.end(), l);
+        if (found == lineIds.end() || *found != l) {
+            return Line{};
+        }
+        return storedLine(static_cast<size_t>(found - lineIds.begin()));
+    }
+    
+    template <class Visitor>
+    void forEachLine(Visitor visit) const {
+        for (size_t k = 0; k < lineIds.size(); k++) {
+            visit(static_cast<int>(lineIds[k]), storedLine(k));
+        }
+    }
+    
+    class Builder;   // Defined below, once the storage type is complete
+};
+
+class HypersparseStorage::Builder {
+private:
+    HypersparseStorage result;
+    
+public:
+    Builder(int r, int c, std::pmr::memory_resource* memory) : result(r, c, memory) {}
+    
+    void reserve(size_t nnz) {
+        result.index.reserve(nnz);
+        result.value.reserve(nnz);
+    }
+    
+    void append(int line, int i, double v) {
+        if (result.lineIds.empty() || result.lineIds.back() != line) {
+            if (!result.lineIds.empty()) {
+                result.start.push_back(static_cast<int64_t>(result.index.size()));
+            }
+            result.lineIds.push_back(line);
+        }
+        result.index.push_back(i);
+        result.value.push_back(v);
+    }
+    
+    HypersparseStorage finish() {
+        if (!result.lineIds.empty()) {
+            result.start.push_back(static_cast<int64_t>(result.index.size()));
+        }
+        return std::move(result);
+    }
+};
+
+// Block compressed rows: dense BlockSize x BlockSize blocks, stored for each
+// block row in increasing block column. Suits matrices whose elements come
+// in small dense clusters (several unknowns per mesh node).
+template <int BlockSize>
+class BSRStorage {
+    static_assert(BlockSize > 0, "Block size must be positive");
+    
+private:
+    int rows;
+    int cols;
+    int elements;                          // Non-zero elements inside the blocks
+    std::pmr::vector<int64_t> blockStart;  // First block of each block row (block rows + 1 entries)
+    std::pmr::vector<int32_t> blockCol;    // Block column of each block
+    std::pmr::vector<double> blocks;       // Block values, row-major within each block
+    
+public:
+    static constexpr bool rowMajor = true;
+    
+    // One row of a block row; zeros inside the blocks are skipped
+    struct Line {
+        const int32_t* blockCol = nullptr;
+        const double* blocks = nullptr;
+        int64_t count = 0;
+        int offset = 0;   // Row within the block row
+        
+        template <class Visitor>
+        void forEach(Visitor visit) const {
+            for (int64_t b = 0; b < count; b++) {
+                const double* row = blocks + (b * BlockSize + offset) * BlockSize;
+                for (int j = 0; j < BlockSize; j++) {
+                    if (row[j] != 0.0) {
+                        visit(blockCol[b] * BlockSize + j, row[j]);
+                    }
+                }
+            }
+        }
+    };
+    
+    BSRStorage(int r, int c, std::pmr::memory_resource* memory)
+        : rows(r), cols(c), elements(0), blockStart(static_cast<size_t>((r + BlockSize - 1) / BlockSize) + 1, 0, memory),
+          blockCol(memory), blocks(memory) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+    }
+    
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    int countNonZero() const { return elements; }
+    std::pmr::memory_resource* getResource() const { return blocks.get_allocator().resource(); }
+    
+    size_t memoryUsage() const {
+        return sizeof(*this) + blockStart.capacity() * sizeof(int64_t) + blockCol.capacity() * sizeof(int32_t) +
+               blocks.capacity() * sizeof(double);
+    }
+    
+    // Number of stored blocks (for judging how well the blocking fits)
+    size_t blockCount() const { return blockCol.size(); }
+    
+    Line line(int l) const {
+        int blockRow = l / BlockSize;
+        int64_t first = blockStart[blockRow];
+        return Line{blockCol.data() + first, blocks.data() + first * BlockSize * BlockSize,
+                    blockStart[blockRow + 1] - first, l % BlockSize};
+    }
+    
+    template <class Visitor>
+    void forEachLine(Visitor visit) const {
+        for (int blockRow = 0; blockRow + 1 < static_cast<int>(blockStart.size()); blockRow++) {
+            if (blockStart[blockRow + 1] == blockStart[blockRow]) {
+                continue;
+            }
+            for (int l = blockRow * BlockSize; l < std::min(rows, (blockRow + 1) * BlockSize); l++) {
+                visit(l, line(l));
+            }
+        }
+    }
+    
+    // Collects the elements of one block row, then lays out its blocks
+    class Builder {
+    private:
+        BSRStorage result;
+        int current;   // Block row being filled
+        std::pmr::vector<std::pair<int, int> > pending;   // (row offset, column) of its elements
+        std::pmr::vector<double> pendingValues;
+        std::pmr::vector<int32_t> pendingBlocks;
+        
+        void flush() {
+            pendingBlocks.clear();
+            for (size_t e = 0; e < pending.size(); e++) {
+                pendingBlocks.push_back(pending[e].second / BlockSize);
+            }
+            std::sort(pendingBlocks.begin(), pendingBlocks.end());
+            pendingBlocks.erase(std::unique(pendingBlocks.begin(), pendingBlocks.end()), pendingBlocks.end());
+            
+            size_t first = result.blockCol.size();
+            result.blockCol.insert(result.blockCol.end(), pendingBlocks.begin(), pendingBlocks.end());
+            result.blocks.resize(result.blockCol.size() * BlockSize * BlockSize, 0.0);
+            for (size_t e = 0; e < pending.size(); e++) {
+                size_t b = first + static_cast<size_t>(std::lower_bound(pendingBlocks.begin(), pendingBlocks.end(),
+                                                                        pending[e].second / BlockSize) - pendingBlocks.begin());
+                result.blocks[(b * BlockSize + pending[e].first) * BlockSize + pending[e].second % BlockSize] = pendingValues[e];
+            }
+            result.elements += static_cast<int>(pending.size());
+            pending.clear();
+            pendingValues.clear();
+        }
+        
+    public:
+        Builder(int r, int c, std::pmr::memory_resource* memory)
+            : result(r, c, memory), current(0), pending(memory), pendingValues(memory), pendingBlocks(memory) {}
+        
+        void reserve(size_t nnz) {
+            result.blockCol.reserve(nnz / BlockSize + 1);
+        }
+        
+        void append(int line, int i, double v) {
+            while (current < line / BlockSize) {
+                flush();
+                result.blockStart[++current] = static_cast<int64_t>(result.blockCol.size());
+            }
+            pending.push_back(std::make_pair(line % BlockSize, i));
+            pendingValues.push_back(v);
+        }
+        
+        BSRStorage finish() {
+            flush();
+            while (current + 1 < static_cast<int>(result.blockStart.size())) {
+                result.blockStart[++current] = static_cast<int64_t>(result.blockCol.size());
+            }
+            return std::move(result);
+        }
+    };
+};
+
+// Sparse matrix front-end over a storage backend chosen at compile time. The
+// kernels only walk the backend's lines, so CSR, CSC, blocked, hypersparse
+// and linked storage all share one implementation:
+//   BasicSparseMatrix<CSCStorage> a = BasicSparseMatrix<CSCStorage>::from(m);
+template <class Storage>
+class BasicSparseMatrix {
+    static_assert(IsStorageBackend<Storage>::value, "Storage does not provide the storage backend interface");
+    
+private:
+    using Line = typename Storage::Line;
+    using Builder = typename Storage::Builder;
+    
+    Storage storage;
+    
+    // Line and index of an element in this layout, and the element's row and column
+    static int lineOf(int r, int c) { return Storage::rowMajor ? r : c; }
+    static int indexOf(int r, int c) { return Storage::rowMajor ? c : r; }
+    static int rowOf(int line, int index) { return Storage::rowMajor ? line : index; }
+    static int colOf(int line, int index) { return Storage::rowMajor ? index : line; }
+    
+    int lineCount() const { return Storage::rowMajor ? getRows() : getCols(); }
+    int indexCount() const { return Storage::rowMajor ? getCols() : getRows(); }
+    
+    // Append a value unless it is zero, returning whether it was appended
+    static bool appendIfNonZero(Builder& builder, int line, int index, double value) {
+        if (std::abs(value) < 1e-10) {
+            return false;
+        }
+        builder.append(line, index, value);
+        return true;
+    }
+    
+    // Kernels with a control report each output line they start on
+    static void checkpoint(OperationControl* control, int line, int lines, size_t resultElements) {
+        if (control != nullptr) {
+            control->checkpoint(line + 1, lines, resultElements);
+        }
+    }
+    
+    // this + sign * other, merging matching lines
+    BasicSparseMatrix combine(const BasicSparseMatrix& other, double sign, const char* what, OperationControl* control) const {
+        if (getRows() != other.getRows() || getCols() != other.getCols()) {
+            throw std::invalid_argument(std::string("Matrix dimensions do not match for ") + what);
+        }
+        
+        std::pmr::memory_resource* memory = getResource();
+        std::pmr::vector<std::pair<int, Line> > otherLines(memory);
+        other.storage.forEachLine([&](int l, const Line& line) {
+            otherLines.push_back(std::make_pair(l, line));
+        });
+        
+        Builder builder(getRows(), getCols(), memory);
+        builder.reserve(static_cast<size_t>(countNonZero()) + static_cast<size_t>(other.countNonZero()));
+        std::pmr::vector<std::pair<int, double> > buffer(memory);
+        size_t next = 0;
+        size_t resultElements = 0;
+        auto appendOther = [&](int l, const Line& line) {
+            checkpoint(control, l, lineCount(), resultElements);
+            line.forEach([&](int index, double value) {
+                resultElements += appendIfNonZero(builder, l, index, sign * value);
+            });
+        };
+        
+        storage.forEachLine([&](int l, const Line& line) {
+            for (; next < otherLines.size() && otherLines[next].first < l; next++) {
+                appendOther(otherLines[next].first, otherLines[next].second);
+            }
+            checkpoint(control, l, lineCount(), resultElements);
+            buffer.clear();
+            if (next < otherLines.size() && otherLines[next].first == l) {
+                otherLines[next++].second.forEach([&](int index, double value) {
+                    buffer.push_back(std::make_pair(index, sign * value));
+                });
+            }
+            size_t p = 0;
+            line.forEach([&](int index, double value) {
+                for (; p < buffer.size() && buffer[p].first < index; p++) {
+                    resultElements += appendIfNonZero(builder, l, buffer[p].first, buffer[p].second);
+                }
+                if (p < buffer.size() && buffer[p].first == index) {
+                    value += buffer[p++].second;
+                }
+                resultElements += appendIfNonZero(builder, l, index, value);
+            });
+            for (; p < buffer.size(); p++) {
+                resultElements += appendIfNonZero(builder, l, buffer[p].first, buffer[p].second);
+            }
+        });
+        for (; next < otherLines.size(); next++) {
+            appendOther(otherLines[next].first, otherLines[next].second);
+        }
+        return BasicSparseMatrix(builder.finish());
+    }
+    
+public:
+    explicit BasicSparseMatrix(Storage s) : storage(std::move(s)) {}
+    
+    // Empty matrix
+    BasicSparseMatrix(int r, int c, std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : storage(Builder(r, c, memory).finish()) {}
+    
+    // Copy any matrix with getRows, getCols and forEachElement into this layout
+    template <class Matrix>
+    static BasicSparseMatrix from(const Matrix& matrix, std::pmr::memory_resource* memory = std::pmr::get_default_resource()) {
+        struct Entry {
+            int line;
+            int index;
+            double value;
+        };
+        std::pmr::vector<Entry> entries(memory);
+        matrix.forEachElement([&](int r, int c, double v) {
+            if (std::abs(v) >= 1e-10) {
+                entries.push_back(Entry{lineOf(r, c), indexOf(r, c), v});
+            }
+        });
+        auto before = [](const Entry& a, const Entry& b) {
+            return a.line != b.line ? a.line < b.line : a.index < b.index;
+        };
+        if (!std::is_sorted(entries.begin(), entries.end(), before)) {
+            std::sort(entries.begin(), entries.end(), before);
+        }
+        
+        Builder builder(matrix.getRows(), matrix.getCols(), memory);
+        builder.reserve(entries.size());
+        for (size_t e = 0; e < entries.size(); e++) {
+            builder.append(entries[e].line, entries[e].index, entries[e].value);
+        }
+        return BasicSparseMatrix(builder.finish());
+    }
+    
+    int getRows() const { return storage.getRows(); }
+    int getCols() const { return storage.getCols(); }
+    int countNonZero() const { return storage.countNonZero(); }
+    size_t memoryUsage() const { return storage.memoryUsage(); }
+    std::pmr::memory_resource* getResource() const { return storage.getResource(); }
+    const Storage& getStorage() const { return storage; }
+    Storage& getStorage() { return storage; }
+    
+    double get(int r, int c) const {
+        if (r < 0 || r >= getRows() || c < 0 || c >= getCols()) {
+            throw std::out_of_range("Index out of bounds");
+        }
+        double found = 0.0;
+        int wanted = indexOf(r, c);
+        storage.line(lineOf(r, c)).forEach([&](int index, double value) {
+            if (index == wanted) {
+                found = value;
+            }
+        });
+        return found;
+    }
+    
+    // Visit every stored element as visit(row, col, value), line by line
+    template <class Visitor>
+    void forEachElement(Visitor visit) const {
+        storage.forEachLine([&](int l, const Line& line) {
+            line.forEach([&](int index, double value) {
+                visit(rowOf(l, index), colOf(l, index), value);
+            });
+        });
+    }
+    
+    // Same values as SparseMatrix::fingerprint (with no scale pending) and
+    // structuralFingerprint for equal matrices
+    uint64_t fingerprint() const {
+        uint64_t hash = 0;
+        forEachElement([&](int r, int c, double v) {
+            hash += SparseMatrix::entryHash(r, c, v);
+        });
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(getRows())) << 32) | static_cast<uint32_t>(getCols());
+        return mixHash(hash ^ mixHash(shape));
+    }
+    
+    uint64_t structuralFingerprint() const {
+        uint64_t hash = 0;
+        forEachElement([&](int r, int c, double) {
+            hash += SparseMatrix::positionHash(r, c);
+        });
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(getRows())) << 32) | static_cast<uint32_t>(getCols());
+        return mixHash(hash ^ mixHash(~shape));
+    }
+    
+    // Exact equality with a SparseMatrix, rejected early on differing fingerprints
+    bool operator==(const SparseMatrix& other) const {
+        return fingerprint() == other.fingerprint() && toSparseMatrix() == other;
+    }
+    
+    bool operator!=(const SparseMatrix& other) const {
+        return !(*this == other);
+    }
+    
+    // Matrix-vector product y = A * x
+    std::vector<double> multiplyVector(const std::vector<double>& x) const {
+        if (static_cast<int>(x.size()) != getCols()) {
+            throw std::invalid_argument("Vector size does not match matrix columns");
+        }
+        
+        std::vector<double> y(getRows(), 0.0);
+        storage.forEachLine([&](int l, const Line& line) {
+            if (Storage::rowMajor) {
+                double sum = 0.0;
+                line.forEach([&](int index, double value) {
+                    sum += value * x[index];
+                });
+                y[l] = sum;
+            } else {
+                double xl = x[l];
+                line.forEach([&](int index, double value) {
+                    y[index] += value * xl;
+                });
+            }
+        });
+        return y;
+    }
+    
+    // y = A * x on up to `threads` threads. Row-major layouts give each
+    // thread whole rows; column-major ones add into every element of y from
+    // each column, so they stay on one thread. Either way every element of y
+    // is summed in the same order for any thread count, and reproducible
+    // mode also compensates the sums.
+    std::vector<double> multiplyVector(const std::vector<double>& x, int threads,
+                                       Summation summation = Summation::Fast) const {
+        if (static_cast<int>(x.size()) != getCols()) {
+            throw std::invalid_argument("Vector size does not match matrix columns");
+        }
+        if (!Storage::rowMajor && summation == Summation::Fast) {
+            return multiplyVector(x);
+        }
+        
+        std::vector<double> y(getRows(), 0.0);
+        if (!Storage::rowMajor) {
+            std::vector<CompensatedSum> sums(getRows());
+            storage.forEachLine([&](int l, const Line& line) {
+                double xl = x[l];
+                line.forEach([&](int index, double value) {
+                    sums[index].add(value * xl);
+                });
+            });
+            for (int i = 0; i < getRows(); i++) {
+                y[i] = sums[i].value();
+            }
+            return y;
+        }
+        
+        std::vector<std::pair<int, Line> > lines;
+        storage.forEachLine([&](int l, const Line& line) {
+            lines.push_back(std::make_pair(l, line));
+        });
+        parallelRanges(static_cast<long long>(lines.size()), threads, [&](long long begin, long long end) {
+            for (long long i = begin; i < end; i++) {
+                if (summation == Summation::Fast) {
+                    double sum = 0.0;
+                    lines[i].second.forEach([&](int index, double value) {
+                        sum += value * x[index];
+                    });
+                    y[lines[i].first] = sum;
+                } else {
+                    CompensatedSum sum;
+                    lines[i].second.forEach([&](int index, double value) {
+                        sum.add(value * x[index]);
+                    });
+                    y[lines[i].first] = sum.value();
+                }
+            }
+        });
+        return y;
+    }
+    
+    // The kernels below report progress to an optional control once per
+    // output line, and stop when it is cancelled or over its limits
+    BasicSparseMatrix add(const BasicSparseMatrix& other, OperationControl* control = nullptr) const {
+        return combine(other, 1.0, "addition", control);
+    }
+    
+    BasicSparseMatrix subtract(const BasicSparseMatrix& other, OperationControl* control = nullptr) const {
+        return combine(other, -1.0, "subtraction", control);
+    }
+    
+    BasicSparseMatrix scalarMultiply(double scalar, OperationControl* control = nullptr) const {
+        Builder builder(getRows(), getCols(), getResource());
+        builder.reserve(static_cast<size_t>(countNonZero()));
+        size_t resultElements = 0;
+        storage.forEachLine([&](int l, const Line& line) {
+            checkpoint(control, l, lineCount(), resultElements);
+            line.forEach([&](int index, double value) {
+                resultElements += appendIfNonZero(builder, l, index, value * scalar);
+            });
+        });
+        return BasicSparseMatrix(builder.finish());
+    }
+    
+    BasicSparseMatrix scalarDivide(double scalar, OperationControl* control = nullptr) const {
+        if (std::abs(scalar) < 1e-10) {
+            throw std::invalid_argument("Division by zero");
+        }
+        return scalarMultiply(1.0 / scalar, control);
+    }
+    
+    // Matrix multiplication, one output line at a time with a dense
+    // accumulator. Row-major layouts combine rows of `other` for each row
+    // here; column-major ones combine columns here for each column of `other`.
+    // Each element is summed in the same order every time; reproducible mode
+    // also compensates the sums.
+    BasicSparseMatrix multiply(const BasicSparseMatrix& other, OperationControl* control = nullptr,
+                               Summation summation = Summation::Fast) const {
+        if (getCols() != other.getRows()) {
+            throw std::invalid_argument("Matrix dimensions do not match for multiplication");
+        }
+        
+        const Storage& outer = Storage::rowMajor ? storage : other.storage;
+        const Storage& inner = Storage::rowMajor ? other.storage : storage;
+        int width = Storage::rowMajor ? other.getCols() : getRows();
+        std::pmr::memory_resource* memory = getResource();
+        
+        std::pmr::vector<Line> innerLines(static_cast<size_t>(Storage::rowMajor ? inner.getRows() : inner.getCols()), Line{}, memory);
+        inner.forEachLine([&](int l, const Line& line) {
+            innerLines[l] = line;
+        });
+        
+        std::pmr::vector<double> accumulator(width, 0.0, memory);
+        std::pmr::vector<double> compensation(summation == Summation::Reproducible ? width : 0, 0.0, memory);
+        std::pmr::vector<int> lastLine(width, -1, memory);   // Output line that last touched each index
+        std::pmr::vector<int32_t> touched(memory);
+        Builder builder(getRows(), other.getCols(), memory);
+        int outerLines = Storage::rowMajor ? outer.getRows() : outer.getCols();
+        size_t resultElements = 0;
+        
+        outer.forEachLine([&](int l, const Line& line) {
+            checkpoint(control, l, outerLines, resultElements);
+            touched.clear();
+            line.forEach([&](int k, double a) {
+                innerLines[k].forEach([&](int j, double b) {
+                    if (lastLine[j] != l) {
+                        lastLine[j] = l;
+                        accumulator[j] = 0.0;
+                        if (!compensation.empty()) {
+                            compensation[j] = 0.0;
+                        }
+                        touched.push_back(j);
+                    }
+                    if (compensation.empty()) {
+                        accumulator[j] += a * b;
+                    } else {
+                        CompensatedSum sum{accumulator[j], compensation[j]};
+                        sum.add(a * b);
+                        accumulator[j] = sum.sum;
+                        compensation[j] = sum.compensation;
+                    }
+                });
+            });
+            std::sort(touched.begin(), touched.end());
+            for (size_t t = 0; t < touched.size(); t++) {
+                int j = touched[t];
+                resultElements += appendIfNonZero(builder, l, j, accumulator[j] + (compensation.empty() ? 0.0 : compensation[j]));
+            }
+        });
+        return BasicSparseMatrix(builder.finish());
+    }
+    
+    // Transpose of matrix (counting sort by index)
+    BasicSparseMatrix transpose(OperationControl* control = nullptr) const {
+        std::pmr::memory_resource* memory = getResource();
+        std::pmr::vector<int64_t> ptr(static_cast<size_t>(indexCount()) + 1, 0, memory);
+        forEachElement([&](int r, int c, double) {
+            ptr[indexOf(r, c) + 1]++;
+        });
+        for (int j = 0; j < indexCount(); j++) {
+            ptr[j + 1] += ptr[j];
+        }
+        
+        std::pmr::vector<int32_t> idx(static_cast<size_t>(ptr.back()), memory);
+        std::pmr::vector<double> val(static_cast<size_t>(ptr.back()), memory);
+        std::pmr::vector<int64_t> next(ptr.begin(), ptr.end() - 1, memory);
+        size_t resultElements = 0;
+        storage.forEachLine([&](int l, const Line& line) {
+            checkpoint(control, l, lineCount(), resultElements);
+            line.forEach([&](int index, double value) {
+                resultElements++;
+                int64_t slot = next[index]++;
+                idx[slot] = l;
+                val[slot] = value;
+            });
+        });
+        
+        Builder builder(getCols(), getRows(), memory);
+        builder.reserve(idx.size());
+        for (int j = 0; j < indexCount(); j++) {
+            for (int64_t k = ptr[j]; k < ptr[j + 1]; k++) {
+                builder.append(j, idx[k], val[k]);
+            }
+        }
+        return BasicSparseMatrix(builder.finish());
+    }
+    
+    // Copy into the linked-list SparseMatrix
+    SparseMatrix toSparseMatrix() const {
+        return BasicSparseMatrix<LinkedListStorage>::from(*this, getResource()).getStorage().release();
+    }
+};
+
+// SparseMatrix and SparseMatrixView run the shared kernels over their own
+// storage in place: the linked rows borrowed by LinkedListStorage, or the
+// viewed CSR arrays
+BasicSparseMatrix<LinkedListStorage> SparseMatrix::inPlace() const {
+    return BasicSparseMatrix<LinkedListStorage>(LinkedListStorage::borrow(*this));
+}
+
+SparseMatrix SparseMatrix::add(const SparseMatrix& other, OperationControl* control) const {
+    return inPlace().add(other.inPlace(), control).getStorage().release();
+}
+
+SparseMatrix SparseMatrix::subtract(const SparseMatrix& other, OperationControl* control) const {
+    return inPlace().subtract(other.inPlace(), control).getStorage().release();
+}
+
+SparseMatrix SparseMatrix::multiply(const SparseMatrix& other, OperationControl* control, Summation summation) const {
+    return inPlace().multiply(other.inPlace(), control, summation).getStorage().release();
+}
+
+SparseMatrix SparseMatrix::computeTranspose(OperationControl* control) const {
+    return inPlace().transpose(control).getStorage().release();
+}
+
+std::vector<double> SparseMatrix::multiplyVector(const std::vector<double>& x) const {
+    return inPlace().multiplyVector(x);
+}
+
+std::vector<double> SparseMatrix::multiplyVector(const std::vector<double>& x, int threads, Summation summation) const {
+    return inPlace().multiplyVector(x, threads, summation);
+}
+
+std::vector<double> SparseMatrixView::multiplyVector(const std::vector<double>& x) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).multiplyVector(x);
+}
+
+std::vector<double> SparseMatrixView::multiplyVector(const std::vector<double>& x, int threads, Summation summation) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).multiplyVector(x, threads, summation);
+}
+
+SparseMatrix SparseMatrixView::add(const SparseMatrixView& other) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).add(BasicSparseMatrix<SparseMatrixView>(other)).getStorage().toSparseMatrix();
+}
+
+SparseMatrix SparseMatrixView::subtract(const SparseMatrixView& other) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).subtract(BasicSparseMatrix<SparseMatrixView>(other)).getStorage().toSparseMatrix();
+}
+
+SparseMatrix SparseMatrixView::scalarMultiply(double scalar) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).scalarMultiply(scalar).getStorage().toSparseMatrix();
+}
+
+SparseMatrix SparseMatrixView::multiply(const SparseMatrixView& other) const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).multiply(BasicSparseMatrix<SparseMatrixView>(other)).getStorage().toSparseMatrix();
+}
+
+SparseMatrix SparseMatrixView::transpose() const {
+    return BasicSparseMatrix<SparseMatrixView>(*this).transpose().getStorage().toSparseMatrix();
+}
+
+// Keeps C = A * B up to date as rows of A change. update() recomputes only
+// the rows of C whose row of A changed since the previous update, which is
+// C += dA * B without the rounding drift of adding deltas; everything is
+// recomputed when B changes. A and B must outlive it, and A tracks its row
+// changes from construction on.
+class MaintainedProduct {
+private:
+    const SparseMatrix& left;
+    const SparseMatrix& right;
+    SparseMatrix product;
+    uint64_t leftVersion;               // Checkpoint of A at the last update
+    uint64_t rightVersion;              // Version of B held in rightRows
+    CSRArrays rightRows;                // B as CSR, for direct access to its rows
+    std::vector<double> accumulator;    // Dense workspace for one row of C
+    std::vector<char> occupied;         // Columns present in the current row of C
+    
+    static std::vector<int> allRows(int count) {
+        std::vector<int> rowIds(count);
+        for (int i = 0; i < count; i++) {
+            rowIds[i] = i;
+        }
+        return rowIds;
+    }
+    
+    // Recompute the listed rows (ascending) of C, row by row over A's rows
+    void recompute(const std::vector<int>& rowIds) {
+        CSRArrays leftRows = left.rowsToCSR(rowIds);
+        std::vector<int64_t> ptr(1, 0);
+        std::vector<int32_t> idx;
+        std::vector<double> val;
+        std::vector<int32_t> pattern;
+        for (size_t k = 0; k < rowIds.size(); k++) {
+            pattern.clear();
+            for (int64_t e = leftRows.rowPtr[k]; e < leftRows.rowPtr[k + 1]; e++) {
+                int inner = leftRows.colIdx[e];
+                double a = leftRows.values[e];
+                for (int64_t t = rightRows.rowPtr[inner]; t < rightRows.rowPtr[inner + 1]; t++) {
+                    int32_t j = rightRows.colIdx[t];
+                    if (!occupied[j]) {
+                        occupied[j] = 1;
+                        accumulator[j] = 0.0;
+                        pattern.push_back(j);
+                    }
+                    accumulator[j] += a * rightRows.values[t];
+                }
+            }
+            std::sort(pattern.begin(), pattern.end());
+            for (int32_t j : pattern) {
+                idx.push_back(j);
+                val.push_back(accumulator[j]);
+                occupied[j] = 0;
+            }
+            ptr.push_back(static_cast<int64_t>(idx.size()));
+        }
+        product.replaceRows(rowIds, ptr.data(), idx.data(), val.data());
+    }
+    
+public:
+    MaintainedProduct(SparseMatrix& a, const SparseMatrix& b)
+        : left(a), right(b), product(a.getRows(), b.getCols(), a.getResource()), leftVersion(0), rightVersion(0) {
+        if (a.getCols() != b.getRows()) {
+            throw std::invalid_argument("Matrix dimensions do not match for multiplication");
+        }
+        a.trackRowChanges(true);
+        rightRows = right.toCSR();
+        rightVersion = right.getVersion();
+        accumulator.assign(right.getCols(), 0.0);
+        occupied.assign(right.getCols(), 0);
+        leftVersion = left.getVersion();
+        recompute(allRows(left.getRows()));
+    }
+    
+    // Bring C up to date; returns the number of rows recomputed
+    size_t update() {
+        if (left.getCols() != right.getRows()) {
+            throw std::invalid_argument("Matrix dimensions do not match for multiplication");
+        }
+        std::vector<int> rowIds;
+        if (right.getVersion() != rightVersion || right.getCols() != product.getCols()
+            || left.getRows() != product.getRows()) {
+            rightRows = right.toCSR();
+            rightVersion = right.getVersion();
+            accumulator.assign(right.getCols(), 0.0);
+            occupied.assign(right.getCols(), 0);
+            if (left.getRows() != product.getRows() || right.getCols() != product.getCols()) {
+                product = SparseMatrix(left.getRows(), right.getCols(), left.getResource());
+            }
+            rowIds = allRows(left.getRows());
+        } else {
+            rowIds = left.rowsChangedSince(leftVersion);
+        }
+        leftVersion = left.getVersion();
+        recompute(rowIds);
+        return rowIds.size();
+    }
+    
+    const SparseMatrix& result() const { return product; }
+};
+
+// Keeps C = alpha * A + beta * B up to date as rows of A and B change.
+// update() recomputes only the rows of C changed in either operand since
+// the previous update. A and B must outlive it, and both track their row
+// changes from construction on.
+class MaintainedSum {
+private:
+    const SparseMatrix& first;
+    const SparseMatrix& second;
+    double alpha, beta;
+    SparseMatrix sum;
+    uint64_t firstVersion;      // Checkpoint of A at the last update
+    uint64_t secondVersion;     // Checkpoint of B at the last update
+    
+    // Recompute the listed rows (ascending) of C by merging the rows of A and B
+    void recompute(const std::vector<int>& rowIds) {
+        CSRArrays a = first.rowsToCSR(rowIds);
+        CSRArrays b = second.rowsToCSR(rowIds);
+        std::vector<int64_t> ptr(1, 0);
+        std::vector<int32_t> idx;
+        std::vector<double> val;
+        for (size_t k = 0; k < rowIds.size(); k++) {
+            int64_t i = a.rowPtr[k], j = b.rowPtr[k];
+            while (i < a.rowPtr[k + 1] || j < b.rowPtr[k + 1]) {
+                if (j == b.rowPtr[k + 1] || (i < a.rowPtr[k + 1] && a.colIdx[i] < b.colIdx[j])) {
+                    idx.push_back(a.colIdx[i]);
+                    val.push_back(alpha * a.values[i++]);
+                } else if (i == a.rowPtr[k + 1] || b.colIdx[j] < a.colIdx[i]) {
+                    idx.push_back(b.colIdx[j]);
+                    val.push_back(beta * b.values[j++]);
+                } else {
+                    idx.push_back(a.colIdx[i]);
+                    val.push_back(alpha * a.values[i++] + beta * b.values[j++]);
+                }
+            }
+            ptr.push_back(static_cast<int64_t>(idx.size()));
+        }
+        sum.replaceRows(rowIds, ptr.data(), idx.data(), val.data());
+    }
+    
+    std::vector<int> changedRows() const {
+        std::vector<int> fromFirst = first.rowsChangedSince(firstVersion);
+        std::vector<int> fromSecond = second.rowsChangedSince(secondVersion);
+        std::vector<int> rowIds;
+        std::set_union(fromFirst.begin(), fromFirst.end(), fromSecond.begin(), fromSecond.end(),
+                       std::back_inserter(rowIds));
+        return rowIds;
+    }
+    
+public:
+    MaintainedSum(SparseMatrix& a, SparseMatrix& b, double alphaFactor = 1.0, double betaFactor = 1.0)
+        : first(a), second(b), alpha(alphaFactor), beta(betaFactor),
+          sum(a.getRows(), a.getCols(), a.getResource()), firstVersion(0), secondVersion(0) {
+        if (a.getRows() != b.getRows() || a.getCols() != b.getCols()) {
+            throw std::invalid_argument("Matrix dimensions do not match for addition");
+        }
+        a.trackRowChanges(true);
+        b.trackRowChanges(true);
+        firstVersion = first.getVersion();
+        secondVersion = second.getVersion();
+        std::vector<int> rowIds(first.getRows());
+        for (int i = 0; i < first.getRows(); i++) {
+            rowIds[i] = i;
+        }
+        recompute(rowIds);
+    }
+    
+    // Bring C up to date; returns the number of rows recomputed
+    size_t update() {
+        if (first.getRows() != second.getRows() || first.getCols() != second.getCols()) {
+            throw std::invalid_argument("Matrix dimensions do not match for addition");
+        }
+        if (first.getRows() != sum.getRows() || first.getCols() != sum.getCols()) {
+            sum = SparseMatrix(first.getRows(), first.getCols(), first.getResource());
+        }
+        std::vector<int> rowIds = changedRows();
+        firstVersion = first.getVersion();
+        secondVersion = second.getVersion();
+        recompute(rowIds);
+        return rowIds.size();
+    }
+    
+    const SparseMatrix& result() const { return sum; }
+};
+
+// Matrix over a sliding time window, for counts that expire. Values are
+// added with a timestamp into the bucket covering bucketWidth time units
+// around it, and moving the window forward drops the expired buckets
+// whole. Each bucket allocates from its own arena, so dropping one frees
+// its memory at once without visiting its entries. Reads see the sum of
+// the buckets in the window. Const members may run on several threads at
+// once, but not alongside add or advanceTo.
+class WindowedSparseMatrix {
+private:
+    struct Bucket {
+        int64_t index;                                                // Timestamp / bucketWidth
+        std::unique_ptr<std::pmr::monotonic_buffer_resource> arena;
+        std::unique_ptr<SparseMatrix> matrix;                         // Allocates from arena
+    };
+    
+    int rows;
+    int cols;
+    int64_t bucketWidth;            // Time units per bucket
+    int bucketCount;                // Buckets in the window
+    bool started;                   // Whether newest has been set
+    int64_t newest;                 // Index of the newest bucket in the window
+    std::deque<Bucket> buckets;     // Buckets holding values, oldest first
+    std::pmr::memory_resource* resource;   // Upstream of the arenas, used for merged results
+    mutable std::unique_ptr<SparseMatrix> mergedCache;   // Sum of the buckets, until the next change
+    mutable std::mutex mergedLock;                       // Guards mergedCache between concurrent readers
+    
+    int64_t bucketOf(int64_t time) const {
+        int64_t index = time / bucketWidth;
+        return (time % bucketWidth != 0 && time < 0) ? index - 1 : index;
+    }
+    
+    static void drop(Bucket& bucket) {
+        bucket.matrix->abandonNodes();
+        bucket.matrix.reset();
+        bucket.arena.reset();
+    }
+    
+public:
+    WindowedSparseMatrix(int r, int c, int64_t width, int count,
+                         std::pmr::memory_resource* memory = std::pmr::get_default_resource())
+        : rows(r), cols(c), bucketWidth(width), bucketCount(count), started(false), newest(0), resource(memory) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+        if (width <= 0 || count <= 0) {
+            throw std::invalid_argument("Bucket width and count must be positive");
+        }
+    }
+    
+    WindowedSparseMatrix(const WindowedSparseMatrix&) = delete;
+    WindowedSparseMatrix& operator=(const WindowedSparseMatrix&) = delete;
+    
+    ~WindowedSparseMatrix() {
+        for (Bucket& bucket : buckets) {
+            drop(bucket);
+        }
+    }
+    
+    // Move the window forward so that it ends with the bucket holding time;
+    // returns the number of buckets dropped
+    size_t advanceTo(int64_t time) {
+        int64_t index = bucketOf(time);
+        if (started && index <= newest) {
+            return 0;
+        }
+        started = true;
+        newest = index;
+        size_t dropped = 0;
+        while (!buckets.empty() && buckets.front().index <= newest - bucketCount) {
+            drop(buckets.front());
+            buckets.pop_front();
+            dropped++;
+        }
+        if (dropped > 0) {
+            mergedCache.reset();
+        }
+        return dropped;
+    }
+    
+    // Add v to element (r, c) at the given time, moving the window forward
+    // when the time is past its end
+    void add(int64_t time, int r, int c, double v) {
+        advanceTo(time);
+        int64_t index = bucketOf(time);
+        if (index <= newest - bucketCount) {
+            throw std::out_of_range("Timestamp is before the window");
+        }
+        
+        // Usually the newest bucket, so search from the back
+        auto position = buckets.end();
+        while (position != buckets.begin() && std::prev(position)->index >= index) {
+            --position;
+        }
+        if (position == buckets.end() || position->index != index) {
+            Bucket bucket;
+            bucket.index = index;
+            bucket.arena.reset(new std::pmr::monotonic_buffer_resource(resource));
+            bucket.matrix.reset(new SparseMatrix(rows, cols, bucket.arena.get()));
+            position = buckets.insert(position, std::move(bucket));
+        }
+        SparseMatrix& matrix = *position->matrix;
+        matrix.insert(r, c, matrix.get(r, c) + v);
+        mergedCache.reset();
+    }
+    
+    // Sum of element (r, c) over the window
+    double get(int r, int c) const {
+        double sum = 0.0;
+        for (const Bucket& bucket : buckets) {
+            sum += bucket.matrix->get(r, c);
+        }
+        return std::abs(sum) < 1e-10 ? 0.0 : sum;
+    }
+    
+    // The window as one matrix, for any SparseMatrix kernel. Built in one
+    // merged pass over the buckets and kept until the window changes.
+    const SparseMatrix& merged() const {
+        std::lock_guard<std::mutex> guard(mergedLock);
+        if (!mergedCache) {
+            std::vector<double> weights(buckets.size(), 1.0);
+            std::vector<const SparseMatrix*> terms;
+            for (const Bucket& bucket : buckets) {
+                terms.push_back(bucket.matrix.get());
+            }
+            mergedCache.reset(new SparseMatrix(
+                SparseMatrix::linearCombination(weights, terms, rows, cols, nullptr, resource)));
+        }
+        return *mergedCache;
+    }
+    
+    // Matrix-vector product over the window, summed bucket by bucket without merging
+    std::vector<double> multiplyVector(const std::vector<double>& x) const {
+        if (static_cast<int>(x.size()) != cols) {
+            throw std::invalid_argument("Vector size does not match matrix columns");
+        }
+        std::vector<double> y(rows, 0.0);
+        for (const Bucket& bucket : buckets) {
+            std::vector<double> part = bucket.matrix->multiplyVector(x);
+            for (int i = 0; i < rows; i++) {
+                y[i] += part[i];
+            }
+        }
+        return y;
+    }
+    
+    template <class Visitor>
+    void forEachElement(Visitor visit) const {
+        merged().forEachElement(visit);
+    }
+    
+    int getRows() const { return rows; }
+    int getCols() const { return cols; }
+    int countNonZero() const { return merged().countNonZero(); }
+    size_t getBucketCount() const { return buckets.size(); }
+    int64_t getBucketWidth() const { return bucketWidth; }
+    
+    // Bytes used by the buckets' elements
+    size_t memoryUsage() const {
+        size_t total = 0;
+        for (const Bucket& bucket : buckets) {
+            total += bucket.matrix->memoryUsage();
+        }
+        return total;
+    }
+};
+
+// Staging area that many threads can insert into at once, for parallel
+// ingest into one matrix. Rows are spread over shards that each have their
+// own lock, so threads rarely wait for one another. compactInto() then sorts
+// the shards in parallel and merges them into a matrix's usual layout. As
+// with insert, the last value written to an element wins and zero removes
+// it. Inserts must not overlap with compaction.
+class ConcurrentInserter {
+private:
+    struct Entry {
+        int32_t row;
+        int32_t col;
+        double value;
+    };
+    
+    // Padded so that neighbouring shards' locks don't share a cache line
+    struct alignas(64) Shard {
+        std::mutex lock;
+        std::vector<Entry> entries;     // In insertion order
+    };
+    
+    int rows;
+    int cols;
+    int shardCount;
+    std::unique_ptr<Shard[]> shards;
+    
+public:
+    ConcurrentInserter(int r, int c, int shardsWanted = 0) : rows(r), cols(c) {
+        if (r <= 0 || c <= 0) {
+            throw std::invalid_argument("Matrix dimensions must be positive");
+        }
+        // Many more shards than threads keeps the odds of two threads meeting low
+        if (shardsWanted <= 0) {
+            shardsWanted = 64 * static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        }
+        shardCount = std::min(shardsWanted, r);
+        shards.reset(new Shard[shardCount]);
+    }
+    
+    // Safe to call from any number of threads at once
+    void insert(int r, int c, double v) {
+        if (r < 0 || r >= rows || c < 0 || c >= cols) {
+            throw std::out_of_range("Index out of range");
+        }
+        Shard& shard = shards[r % shardCount];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.entries.push_back(Entry{r, c, v});
+    }
+    
+    // Elements staged so far, counting every write
+    size_t pending() const {
+        size_t total = 0;
+        for (int s = 0; s < shardCount; s++) {
+            total += shards[s].entries.size();
+        }
+        return total;
+    }
+    
+    // Merge everything staged into target (which must have the same size)
+    // and empty the staging area
+    void compactInto(SparseMatrix& target, int threads = std::max(1u, std::thread::hardware_concurrency())) {
+        if (target.getRows() != rows || target.getCols() != cols) {
+            throw std::invalid_argument("Matrix dimensions do not match the staged elements");
+        }
+        
+        // Sort each shard by position, keeping only the last write to each element
+        parallelRanges(shardCount, threads, [&](long long begin, long long end) {
+            for (long long s = begin; s < end; s++) {
+                std::vector<Entry>& entries = shards[s].entries;
+                std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+                    return a.row != b.row ? a.row < b.row : a.col < b.col;
+                });
+                size_t kept = 0;
+                for (size_t e = 0; e < entries.size(); e++) {
+                    if (kept > 0 && entries[kept - 1].row == entries[e].row && entries[kept - 1].col == entries[e].col) {
+                        entries[kept - 1] = entries[e];
+                    } else {
+                        entries[kept++] = entries[e];
+                    }
+                }
+                entries.resize(kept);
+            }
+        });
+        
+        // Each row lives in one shard; list the touched rows with their entries
+        std::vector<std::pair<const Entry*, const Entry*> > staged(rows, std::make_pair(nullptr, nullptr));
+        std::vector<int> touched;
+        for (int s = 0; s < shardCount; s++) {
+            const std::vector<Entry>& entries = shards[s].entries;
+            for (size_t e = 0; e < entries.size(); ) {
+                size_t next = e;
+                while (next < entries.size() && entries[next].row == entries[e].row) {
+                    next++;
+                }
+                staged[entries[e].row] = std::make_pair(entries.data() + e, entries.data() + next);
+                touched.push_back(entries[e].row);
+                e = next;
+            }
+        }
+        std::sort(touched.begin(), touched.end());
+        
+        // New contents of the touched rows: staged values over the existing ones
+        CSRArrays existing = target.rowsToCSR(touched);
+        std::vector<int64_t> ptr(1, 0);
+        std::vector<int32_t> idx;
+        std::vector<double> val;
+        for (size_t k = 0; k < touched.size(); k++) {
+            const Entry* entry = staged[touched[k]].first;
+            const Entry* last = staged[touched[k]].second;
+            int64_t i = existing.rowPtr[k];
+            while (i < existing.rowPtr[k + 1] || entry != last) {
+                if (entry == last || (i < existing.rowPtr[k + 1] && existing.colIdx[i] < entry->col)) {
+                    idx.push_back(existing.colIdx[i]);
+                    val.push_back(existing.values[i++]);
+                    continue;
+                }
+                if (i < existing.rowPtr[k + 1] && existing.colIdx[i] == entry->col) {
+                    i++;
+                }
+                if (std::abs(entry->value) >= 1e-10) {
+                    idx.push_back(entry->col);
+                    val.push_back(entry->value);
+                }
+                entry++;
+            }
+            ptr.push_back(static_cast<int64_t>(idx.size()));
+        }
+        
+        if (target.countNonZero() == 0) {
+            // Nothing to keep: build the whole matrix in parallel
+            std::vector<int64_t> rowPtr(rows + 1, 0);
+            for (size_t k = 0; k < touched.size(); k++) {
+                rowPtr[touched[k] + 1] = ptr[k + 1] - ptr[k];
+            }
+            for (int r = 0; r < rows; r++) {
+                rowPtr[r + 1] += rowPtr[r];
+            }
+            target = SparseMatrix::fromCSR(rows, cols, rowPtr.data(), idx.data(), val.data(),
+                                           threads, target.getResource());
+        } else {
+            target.replaceRows(touched, ptr.data(), idx.data(), val.data());
+        }
+        
+        for (int s = 0; s < shardCount; s++) {
+            std::vector<Entry>().swap(shards[s].entries);
+        }
+    }
+    
+    // Everything staged as a new matrix
+    SparseMatrix compact(int threads = std::max(1u, std::thread::hardware_concurrency())) {
+        SparseMatrix result(rows, cols);
+        compactInto(result, threads);
+        return result;
+    }
+};
+
+// Output stream buffer writing into a fixed block of memory
+class MemoryStreamBuffer : public std::streambuf {
+public:
+    MemoryStreamBuffer(char* begin, size_t size) {
+        setp(begin, begin + size);
+    }
+};
+
+// A matrix published once into POSIX shared memory (or a file written with
+// saveBinary) and attached read-only by any number of processes. Attached
+// matrices read the shared pages in place, so N readers cost one copy.
+class SharedSparseMatrix {
+private:
+    MappedFile mapping;       // Keeps the shared pages mapped
+    SparseMatrixView matrix;  // View over the mapped pages
+    
+    SharedSparseMatrix(const std::string& name, bool sharedMemory)
+        : mapping(name, sharedMemory), matrix(viewMapping(mapping)) {}
+    
+    static SparseMatrixView viewMapping(const MappedFile& file) {
+        if (file.size() >= 4 && std::memcmp(file.bytes(), "\0\0\0\0", 4) == 0) {
+            throw std::runtime_error("Shared matrix is still being published");
+        }
+        return SparseMatrixView::fromBinary(file.bytes(), file.size());
+    }
+    
+    static std::string segmentName(const std::string& name) {
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+    
+public:
+    // Copy a matrix into a new shared memory segment
+    static void publish(const SparseMatrix& m, const std::string& name) {
+#ifdef _WIN32
+        (void)m;
+        (void)name;
+        throw std::runtime_error("Shared memory is not supported on this platform");
+#else
+        std::string segment = segmentName(name);
+        BinaryHeader header = m.binaryHeader();
+        size_t size = static_cast<size_t>(SparseMatrix::binarySize(header));
+        
+        int fd = shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            throw std::runtime_error(errno == EEXIST ? "A shared matrix named " + name + " already exists"
+                                                    : "Cannot create shared memory " + name);
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            shm_unlink(segment.c_str());
+            throw std::runtime_error("Cannot size shared memory " + name);
+        }
+        void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            shm_unlink(segment.c_str());
+            throw std::runtime_error("Cannot map shared memory " + name);
+        }
+        
+        // The magic is written last so readers never attach to a partial matrix
+        char* bytes = static_cast<char*>(mapped);
+        BinaryHeader pending = header;
+        std::memset(pending.magic, 0, sizeof(pending.magic));
+        std::memcpy(bytes, &pending, sizeof(pending));
+        MemoryStreamBuffer buffer(bytes + sizeof(BinaryHeader), size - sizeof(BinaryHeader));
+        std::ostream out(&buffer);
+        m.writeBinaryArrays(out);
+        if (!out) {
+            munmap(mapped, size);
+            shm_unlink(segment.c_str());
+            throw std::runtime_error("Failed writing shared memory " + name);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(bytes, header.magic, sizeof(header.magic));
+        munmap(mapped, size);
+#endif
+    }
+    
+    // Remove a published segment; processes already attached keep their mapping
+    static void unpublish(const std::string& name) {
+#ifndef _WIN32
+        if (shm_unlink(segmentName(name).c_str()) != 0) {
+            throw std::runtime_error("No shared matrix named " + name);
+        }
+#else
+        (void)name;
+#endif
+    }
+    
+    // Attach to a matrix published with publish()
+    static std::unique_ptr<SharedSparseMatrix> attach(const std::string& name) {
+        return std::unique_ptr<SharedSparseMatrix>(new SharedSparseMatrix(segmentName(name), true));
+    }
+    
+    // Attach to a matrix file written with saveBinary (file-backed sharing)
+    static std::unique_ptr<SharedSparseMatrix> attachFile(const std::string& path) {
+        return std::unique_ptr<SharedSparseMatrix>(new SharedSparseMatrix(path, false));
+    }
+    
+    const SparseMatrixView& view() const { return matrix; }
+};
+
+// Point-to-point messaging between the ranks of a distributed computation.
+// Messages between one pair of ranks arrive in the order they were sent.
+class Transport {
+public:
+    virtual ~Transport() {}
+    
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+    
+    // Send a message; may return before the receiver has read it
+    virtual void send(int destination, int tag, const std::vector<double>& data) = 0;
+    
+    // Wait for the next message from source, which must carry the given tag
+    virtual std::vector<double> receive(int source, int tag) = 0;
+    
+    // Wait until every rank has reached the barrier
+    virtual void barrier() = 0;
+};
+
+#ifndef _WIN32
+// Transport for ranks running as processes on one host, exchanging messages
+// through a shared memory region created before the ranks are forked. Each
+// ordered pair of ranks has a one-message mailbox.
+class SharedMemoryTransport : public Transport {
+private:
+    struct Control {
+        std::atomic<int> arrived;       // Ranks waiting at the barrier
+        std::atomic<int> generation;    // Incremented each time the barrier opens
+        std::atomic<int> aborted;       // Set when a rank failed; every wait then gives up
+    };
+    
+    struct Mailbox {
+        std::atomic<uint64_t> written;  // Messages written so far
+        std::atomic<uint64_t> read;     // Messages read so far
+        int32_t tag;                    // Tag of the pending message
+        uint64_t length;                // Number of values in the pending message
+    };
+    
+    char* region;           // Shared region: Control, then ranks * ranks mailboxes
+    size_t regionBytes;
+    size_t mailboxBytes;    // Mailbox header plus payload, cache-line aligned
+    size_t capacity;        // Maximum values per message
+    int ranks;
+    int myRank;
+    
+    Control* control() const { return reinterpret_cast<Control*>(region); }
+    
+    Mailbox* mailbox(int from, int to) const {
+        return reinterpret_cast<Mailbox*>(region + 64 + (static_cast<size_t>(from) * ranks + to) * mailboxBytes);
+    }
+    
+    double* payload(Mailbox* box) const {
+        return reinterpret_cast<double*>(reinterpret_cast<char*>(box) + 64);
+    }
+    
+    // Called in every wait, so that no rank waits forever for a failed one
+    void checkAborted() const {
+        if (control()->aborted.load(std::memory_order_acquire) != 0) {
+            throw std::runtime_error("Another rank of the distributed computation failed");
+        }
+    }
+    
+public:
+    SharedMemoryTransport(int rankCount, size_t maxMessageValues)
+        : region(nullptr), regionBytes(0), mailboxBytes(0), capacity(maxMessageValues), ranks(rankCount), myRank(0) {
+        if (rankCount <= 0) {
+            throw std::invalid_argument("Number of ranks must be positive");
+        }
+        mailboxBytes = 64 + (capacity * sizeof(double) + 63) / 64 * 64;
+        regionBytes = 64 + static_cast<size_t>(ranks) * ranks * mailboxBytes;
+        void* mapped = mmap(nullptr, regionBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Cannot allocate shared memory for the transport");
+        }
+        region = static_cast<char*>(mapped);
+        
+        new (control()) Control();
+        control()->arrived = 0;
+        control()->generation = 0;
+        control()->aborted = 0;
+        for (int from = 0; from < ranks; from++) {
+            for (int to = 0; to < ranks; to++) {
+                Mailbox* box = new (mailbox(from, to)) Mailbox();
+                box->written = 0;
+                box->read = 0;
+            }
+        }
+    }
+    
+    ~SharedMemoryTransport() {
+        munmap(region, regionBytes);
+    }
+    
+    SharedMemoryTransport(const SharedMemoryTransport&) = delete;
+    SharedMemoryTransport& operator=(const SharedMemoryTransport&) = delete;
+    
+    // Select which rank this process is (called in each process after forking)
+    void setRank(int r) {
+        if (r < 0 || r >= ranks) {
+            throw std::out_of_range("Rank out of range");
+        }
+        myRank = r;
+    }
+    
+    int rank() const { return myRank; }
+    int size() const { return ranks; }
+    
+    // Make every rank's pending and future waits throw (from any process)
+    void abort() {
+        control()->aborted.store(1, std::memory_order_release);
+    }
+    
+    void send(int destination, int tag, const std::vector<double>& data) {
+        if (destination < 0 || destination >= ranks) {
+            throw std::out_of_range("Rank out of range");
+        }
+        if (data.size() > capacity) {
+            throw std::invalid_argument("Message is larger than the transport capacity");
+        }
+        Mailbox* box = mailbox(myRank, destination);
+        
+        // Wait until the previous message to this rank has been read
+        while (box->written.load(std::memory_order_acquire) != box->read.load(std::memory_order_acquire)) {
+            checkAborted();
+            std::this_thread::yield();
+        }
+        if (!data.empty()) {
+            std::memcpy(payload(box), data.data(), data.size() * sizeof(double));
+        }
+        box->tag = tag;
+        box->length = data.size();
+        box->written.fetch_add(1, std::memory_order_release);
+    }
+    
+    std::vector<double> receive(int source, int tag) {
+        if (source < 0 || source >= ranks) {
+            throw std::out_of_range("Rank out of range");
+        }
+        Mailbox* box = mailbox(source, myRank);
+        
+        while (box->written.load(std::memory_order_acquire) == box->read.load(std::memory_order_acquire)) {
+            checkAborted();
+            std::this_thread::yield();
+        }
+        if (box->tag != tag) {
+            throw std::runtime_error("Unexpected message tag from rank " + std::to_string(source));
+        }
+        std::vector<double> data(payload(box), payload(box) + box->length);
+        box->read.fetch_add(1, std::memory_order_release);
+        return data;
+    }
+    
+    void barrier() {
+        int generation = control()->generation.load(std::memory_order_acquire);
+        if (control()->arrived.fetch_add(1, std::memory_order_acq_rel) + 1 == ranks) {
+            control()->arrived.store(0, std::memory_order_relaxed);
+            control()->generation.fetch_add(1, std::memory_order_release);
+        } else {
+            while (control()->generation.load(std::memory_order_acquire) == generation) {
+                checkAborted();
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+// Run body in `ranks` forked processes connected by a SharedMemoryTransport.
+// Returns when every rank has finished; throws if any of them failed. When a
+// rank fails (or dies), the transport is aborted so the others stop waiting.
+void runLocalRanks(int ranks, size_t maxMessageValues, const std::function<void(Transport&)>& body) {
+    SharedMemoryTransport transport(ranks, maxMessageValues);
+    std::cout.flush(); // Otherwise buffered output would be repeated by every child
+    
+    std::vector<pid_t> children;
+    for (int r = 0; r < ranks; r++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            // Stop and reap the ranks already started
+            transport.abort();
+            for (size_t i = 0; i < children.size(); i++) {
+                kill(children[i], SIGKILL);
+                waitpid(children[i], nullptr, 0);
+            }
+            throw std::runtime_error("Cannot start rank " + std::to_string(r));
+        }
+        if (pid == 0) {
+            int status = 0;
+            try {
+                transport.setRank(r);
+                body(transport);
+            } catch (const std::exception& e) {
+                std::cerr << "Rank " << r << " failed: " << e.what() << std::endl;
+                transport.abort();
+                status = 1;
+            }
+            std::cout.flush();
+            _exit(status);
+        }
+        children.push_back(pid);
+    }
+    
+    // Reap the ranks in the order they finish, so a failure is noticed at once
+    // (polling only our own children leaves other child processes alone)
+    bool failed = false;
+    while (!children.empty()) {
+        bool reaped = false;
+        for (size_t i = 0; i < children.size(); i++) {
+            int status = 0;
+            pid_t pid = waitpid(children[i], &status, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR)) {
+                continue;
+            }
+            if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                failed = true;
+                transport.abort();
+            }
+            children.erase(children.begin() + i);
+            reaped = true;
+            break;
+        }
+        if (!reaped) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    if (failed) {
+        throw std::runtime_error("A rank of the distributed computation failed");
+    }
+}
+#endif
+
+// One rank's share of a matrix distributed by rows. The vector x of y = A * x
+// is distributed too: each rank holds the entries of the columns it owns, and
+// the entries it needs from other ranks (ghost columns) arrive by halo exchange.
+class DistributedSparseMatrix {
+private:
+    Transport& transport;
+    int globalRows;
+    int globalCols;
+    std::vector<int> ownedRows;     // Global indices of the rows held here, increasing
+    std::vector<int> ownedCols;     // Global indices of the x entries held here, increasing
+    std::vector<int> ghostCols;     // Global index of each ghost, grouped by owning rank
+    
+    // Local rows in CSR form. Column c < ownedCols.size() is local x entry c;
+    // larger columns are ghost c - ownedCols.size().
+    std::vector<int64_t> rowPtr;
+    std::vector<int32_t> colIdx;
+    std::vector<double> values;
+    std::vector<int> interiorRows;  // Local rows that use no ghosts
+    std::vector<int> boundaryRows;  // Local rows that need ghost values
+    
+    // Halo exchange pattern
+    std::vector<int> receiveRanks;                   // Ranks we get ghosts from
+    std::vector<std::vector<int> > receiveSlots;     // Ghost slots filled by each of them
+    std::vector<int> sendRanks;                      // Ranks that need our entries
+    std::vector<std::vector<int> > sendEntries;      // Local x entries each of them needs
+    
+    static const int TAG_PATTERN = 1;
+    static const int TAG_HALO = 2;
+    
+    // Rows keep the global column order, so each y entry is summed in the
+    // same order as SparseMatrix::multiplyVector for any partition
+    void multiplyRows(const std::vector<int>& localRows, const std::vector<double>& x, std::vector<double>& y,
+                      Summation summation) const {
+        for (size_t r = 0; r < localRows.size(); r++) {
+            int i = localRows[r];
+            if (summation == Summation::Fast) {
+                double sum = 0.0;
+                for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                    sum += values[k] * x[colIdx[k]];
+                }
+                y[i] = sum;
+            } else {
+                CompensatedSum sum;
+                for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                    sum.add(values[k] * x[colIdx[k]]);
+                }
+                y[i] = sum.value();
+            }
+        }
+    }
+    
+public:
+    // Split n indices into contiguous blocks, one per rank
+    static std::vector<int> blockPartition(int n, int parts) {
+        std::vector<int> owner(n);
+        for (int i = 0; i < n; i++) {
+            owner[i] = static_cast<int>(static_cast<int64_t>(i) * parts / n);
+        }
+        return owner;
+    }
+    
+    // Take this rank's rows of a global matrix (a SparseMatrix or a view, for
+    // example one attached from shared memory). rowOwner and colOwner give the
+    // rank of every row and of every x entry. Every rank must call this
+    // together, since the halo pattern is agreed by exchanging messages.
+    template <class Matrix>
+    DistributedSparseMatrix(const Matrix& global, Transport& t,
+                            const std::vector<int>& rowOwner, const std::vector<int>& colOwner)
+        : transport(t), globalRows(global.getRows()), globalCols(global.getCols()) {
+        if (static_cast<int>(rowOwner.size()) != globalRows || static_cast<int>(colOwner.size()) != globalCols) {
+            throw std::invalid_argument("Partition size does not match matrix dimensions");
+        }
+        int me = transport.rank();
+        
+        std::vector<int> rowLocal(globalRows, -1);
+        for (int i = 0; i < globalRows; i++) {
+            if (rowOwner[i] == me) {
+                rowLocal[i] = static_cast<int>(ownedRows.size());
+                ownedRows.push_back(i);
+            }
+        }
+        std::vector<int> colLocal(globalCols, -1);
+        for (int j = 0; j < globalCols; j++) {
+            if (colOwner[j] < 0 || colOwner[j] >= transport.size()) {
+                throw std::invalid_argument("Partition names a rank that does not exist");
+            }
+            if (colOwner[j] == me) {
+                colLocal[j] = static_cast<int>(ownedCols.size());
+                ownedCols.push_back(j);
+            }
+        }
+        
+        // Copy local rows, remembering global columns for now
+        std::vector<int> globalColumn;
+        rowPtr.assign(ownedRows.size() + 1, 0);
+        global.forEachElement([&](int r, int c, double v) {
+            if (rowLocal[r] >= 0) {
+                rowPtr[rowLocal[r] + 1]++;
+                globalColumn.push_back(c);
+                values.push_back(v);
+            }
+        });
+        for (size_t i = 0; i < ownedRows.size(); i++) {
+            rowPtr[i + 1] += rowPtr[i];
+        }
+        
+        // Ghosts are numbered grouped by owner so each neighbour fills one block
+        std::vector<std::pair<int, int> > ghosts; // (owner, global column)
+        for (size_t k = 0; k < globalColumn.size(); k++) {
+            if (colLocal[globalColumn[k]] < 0) {
+                ghosts.push_back(std::make_pair(colOwner[globalColumn[k]], globalColumn[k]));
+            }
+        }
+        std::sort(ghosts.begin(), ghosts.end());
+        ghosts.erase(std::unique(ghosts.begin(), ghosts.end()), ghosts.end());
+        std::map<int, int> ghostSlot;
+        for (size_t g = 0; g < ghosts.size(); g++) {
+            ghostCols.push_back(ghosts[g].second);
+            ghostSlot[ghosts[g].second] = static_cast<int>(g);
+            if (receiveRanks.empty() || receiveRanks.back() != ghosts[g].first) {
+                receiveRanks.push_back(ghosts[g].first);
+                receiveSlots.push_back(std::vector<int>());
+            }
+            receiveSlots.back().push_back(static_cast<int>(g));
+        }
+        
+        colIdx.resize(globalColumn.size());
+        int localCount = static_cast<int>(ownedCols.size());
+        for (size_t i = 0; i < ownedRows.size(); i++) {
+            bool usesGhost = false;
+            for (int64_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+                int c = globalColumn[k];
+                if (colLocal[c] >= 0) {
+                    colIdx[k] = colLocal[c];
+                } else {
+                    colIdx[k] = localCount + ghostSlot[c];
+                    usesGhost = true;
+                }
+            }
+            (usesGhost ? boundaryRows : interiorRows).push_back(static_cast<int>(i));
+        }
+        
+        // Tell every other rank which of its entries we need, and learn what to send
+        for (int q = 0; q < transport.size(); q++) {
+            if (q == me) {
+                continue;
+            }
+            std::vector<double> request;
+            for (size_t n = 0; n < receiveRanks.size(); n++) {
+                if (receiveRanks[n] == q) {
+                    for (size_t s = 0; s < receiveSlots[n].size(); s++) {
+                        request.push_back(ghostCols[receiveSlots[n][s]]);
+                    }
+                }
+            }
+            transport.send(q, TAG_PATTERN, request);
+        }
+        for (int q = 0; q < transport.size(); q++) {
+            if (q == me) {
+                continue;
+            }
+            std::vector<double> request = transport.receive(q, TAG_PATTERN);
+            if (!request.empty()) {
+                sendRanks.push_back(q);
+                sendEntries.push_back(std::vector<int>());
+                for (size_t k = 0; k < request.size(); k++) {
+                    sendEntries.back().push_back(colLocal[static_cast<int>(request[k])]);
+                }
+            }
+        }
+        transport.barrier();
+    }
+    
+    int getRows() const { return globalRows; }
+    int getCols() const { return globalCols; }
+    const std::vector<int>& getOwnedRows() const { return ownedRows; }
+    const std::vector<int>& getOwnedCols() const { return ownedCols; }
+    size_t ghostCount() const { return ghostCols.size(); }
+    
+    // Distributed y = A * x. xLocal holds the entries of getOwnedCols(); the
+    // result holds the entries of getOwnedRows(). The halo exchange overlaps
+    // with the rows that need no ghost values. All ranks must call this together.
+    // A reproducible product has the same bits for any number of ranks.
+    std::vector<double> multiplyVector(const std::vector<double>& xLocal, Summation summation = Summation::Fast) {
+        if (xLocal.size() != ownedCols.size()) {
+            throw std::invalid_argument("Vector size does not match the owned columns");
+        }
+        
+        for (size_t n = 0; n < sendRanks.size(); n++) {
+            std::vector<double> message(sendEntries[n].size());
+            for (size_t k = 0; k < message.size(); k++) {
+                message[k] = xLocal[sendEntries[n][k]];
+            }
+            transport.send(sendRanks[n], TAG_HALO, message);
+        }
+        
+        std::vector<double> x(xLocal);
+        x.resize(ownedCols.size() + ghostCols.size(), 0.0);
+        std::vector<double> y(ownedRows.size(), 0.0);
+        multiplyRows(interiorRows, x, y, summation);
+        
+        for (size_t n = 0; n < receiveRanks.size(); n++) {
+            std::vector<double> message = transport.receive(receiveRanks[n], TAG_HALO);
+            for (size_t k = 0; k < message.size(); k++) {
+                x[ownedCols.size() + receiveSlots[n][k]] = message[k];
+            }
+        }
+        multiplyRows(boundaryRows, x, y, summation);
+        return y;
+    }
+};
+
+// Multilevel graph partitioner for sharding a matrix by rows. The graph has
+// one vertex per row, weighted by the row's element count, and an edge
+// between rows i and j when a(i, j) or a(j, i) is stored. Partitioning
+// coarsens the graph by heavy-edge matching, bisects the coarsest graph by
+// greedy growing, then projects back refining each level with
+// Fiduccia-Mattheyses moves. k parts come from recursive bisection.
+class GraphPartitioner {
+public:
+    // Undirected graph in CSR form
+    struct Graph {
+        std::vector<int> xadj;      // Start of each vertex's neighbours (vertices + 1)
+        std::vector<int> adjncy;    // Neighbour of each edge
+        std::vector<int> adjwgt;    // Weight of each edge
+        std::vector<int> vwgt;      // Weight of each vertex
+        
+        int vertexCount() const { return static_cast<int>(xadj.size()) - 1; }
+        
+        long long totalWeight() const {
+            long long total = 0;
+            for (size_t v = 0; v < vwgt.size(); v++) {
+                total += vwgt[v];
+            }
+            return total;
+        }
+    };
+    
+    // A partition vector with its quality
+    struct Result {
+        std::vector<int> part;  // Part of each row
+        long long edgeCut;      // Total weight of edges between parts
+        double imbalance;       // Heaviest part relative to a perfectly even split
+    };
+    
+    // Build the row graph of a square matrix (SparseMatrix or SparseMatrixView)
+    template <class Matrix>
+    static Graph buildGraph(const Matrix& matrix) {
+        if (matrix.getRows() != matrix.getCols()) {
+            throw std::invalid_argument("Matrix must be square to partition its rows");
+        }
+        int n = matrix.getRows();
+        
+        Graph graph;
+        graph.vwgt.assign(n, 0);
+        std::vector<std::pair<int, int> > edges;
+        matrix.forEachElement([&](int r, int c, double) {
+            graph.vwgt[r]++;
+            if (r != c) {
+                edges.push_back(std::make_pair(r, c));
+                edges.push_back(std::make_pair(c, r));
+            }
+        });
+        std::sort(edges.begin(), edges.end());
+        
+        graph.xadj.assign(n + 1, 0);
+        for (size_t e = 0; e < edges.size(); e++) {
+            if (e > 0 && edges[e] == edges[e - 1]) {
+                graph.adjwgt.back()++;
+                continue;
+            }
+            graph.adjncy.push_back(edges[e].second);
+            graph.adjwgt.push_back(1);
+            graph.xadj[edges[e].first + 1]++;
+        }
+        for (int v = 0; v < n; v++) {
+            graph.xadj[v + 1] += graph.xadj[v];
+        }
+        return graph;
+    }
+    
+    // Split the rows of a square matrix into parts of balanced element count
+    // (heaviest part at most imbalanceTolerance times the average) with few
+    // entries between parts
+    template <class Matrix>
+    static Result partition(const Matrix& matrix, int parts, double imbalanceTolerance = 1.03, unsigned seed = 1) {
+        if (parts <= 0) {
+            throw std::invalid_argument("Number of parts must be positive");
+        }
+        Graph graph = buildGraph(matrix);
+        std::mt19937 random(seed);
+        
+        std::vector<int> vertices(graph.vertexCount());
+        for (int v = 0; v < graph.vertexCount(); v++) {
+            vertices[v] = v;
+        }
+        // Imbalance compounds down the bisection tree, so share the tolerance between levels
+        int levels = 0;
+        while ((1 << levels) < parts) {
+            levels++;
+        }
+        double levelTolerance = levels > 0 ? std::pow(imbalanceTolerance, 1.0 / levels) : imbalanceTolerance;
+        
+        Result result;
+        result.part.assign(graph.vertexCount(), 0);
+        partitionRecursive(graph, vertices, parts, 0, levelTolerance, random, result.part);
+        evaluate(graph, result.part, parts, result);
+        return result;
+    }
+    
+    // Edge cut and imbalance of any partition vector (for comparing layouts)
+    template <class Matrix>
+    static Result evaluate(const Matrix& matrix, const std::vector<int>& part, int parts) {
+        Result result;
+        result.part = part;
+        evaluate(buildGraph(matrix), part, parts, result);
+        return result;
+    }
+    
+    // Multilevel bisection: side[v] is 0 or 1, with side 0 holding about
+    // `fraction` of the total vertex weight
+    static std::vector<int> bisect(const Graph& graph, double fraction, double tolerance, std::mt19937& random) {
+        if (graph.vertexCount() <= 40) {
+            return initialBisection(graph, fraction, tolerance, random);
+        }
+        
+        std::vector<int> coarseOf;
+        Graph coarse = coarsen(graph, coarseOf, random);
+        std::vector<int> side;
+        if (coarse.vertexCount() > graph.vertexCount() * 95 / 100) {
+            side = initialBisection(graph, fraction, tolerance, random); // Matching stalled
+        } else {
+            std::vector<int> coarseSide = bisect(coarse, fraction, tolerance, random);
+            side.resize(graph.vertexCount());
+            for (int v = 0; v < graph.vertexCount(); v++) {
+                side[v] = coarseSide[coarseOf[v]];
+            }
+        }
+        refine(graph, side, fraction, tolerance);
+        return side;
+    }
+    
+    // Subgraph induced by the vertices on one side; vertices receives the
+    // original index of each subgraph vertex
+    static Graph inducedSubgraph(const Graph& graph, const std::vector<int>& side, int which,
+                                 std::vector<int>& vertices) {
+        std::vector<int> newIndex(graph.vertexCount(), -1);
+        vertices.clear();
+        for (int v = 0; v < graph.vertexCount(); v++) {
+            if (side[v] == which) {
+                newIndex[v] = static_cast<int>(vertices.size());
+                vertices.push_back(v);
+            }
+        }
+        
+        Graph sub;
+        sub.xadj.push_back(0);
+        for (size_t i = 0; i < vertices.size(); i++) {
+            int v = vertices[i];
+            sub.vwgt.push_back(graph.vwgt[v]);
+            for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                if (newIndex[graph.adjncy[e]] >= 0) {
+                    sub.adjncy.push_back(newIndex[graph.adjncy[e]]);
+                    sub.adjwgt.push_back(graph.adjwgt[e]);
+                }
+            }
+            sub.xadj.push_back(static_cast<int>(sub.adjncy.size()));
+        }
+        return sub;
+    }
+    
+private:
+    static void evaluate(const Graph& graph, const std::vector<int>& part, int parts, Result& result) {
+        std::vector<long long> weight(parts, 0);
+        result.edgeCut = 0;
+        for (int v = 0; v < graph.vertexCount(); v++) {
+            weight[part[v]] += graph.vwgt[v];
+            for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                if (part[graph.adjncy[e]] != part[v]) {
+                    result.edgeCut += graph.adjwgt[e];
+                }
+            }
+        }
+        result.edgeCut /= 2; // Every cut edge was seen from both ends
+        
+        long long heaviest = *std::max_element(weight.begin(), weight.end());
+        double average = static_cast<double>(graph.totalWeight()) / parts;
+        result.imbalance = average > 0 ? heaviest / average : 1.0;
+    }
+    
+    static void partitionRecursive(const Graph& graph, const std::vector<int>& vertices, int parts, int firstPart,
+                                   double tolerance, std::mt19937& random, std::vector<int>& part) {
+        if (parts == 1 || graph.vertexCount() == 0) {
+            for (size_t i = 0; i < vertices.size(); i++) {
+                part[vertices[i]] = firstPart;
+            }
+            return;
+        }
+        
+        int leftParts = parts / 2;
+        std::vector<int> side = bisect(graph, static_cast<double>(leftParts) / parts, tolerance, random);
+        for (int which = 0; which < 2; which++) {
+            std::vector<int> subVertices;
+            Graph sub = inducedSubgraph(graph, side, which, subVertices);
+            for (size_t i = 0; i < subVertices.size(); i++) {
+                subVertices[i] = vertices[subVertices[i]];
+            }
+            partitionRecursive(sub, subVertices, which == 0 ? leftParts : parts - leftParts,
+                               which == 0 ? firstPart : firstPart + leftParts, tolerance, random, part);
+        }
+    }
+    
+    // Contract a heavy-edge matching; coarseOf maps each vertex to its coarse vertex
+    static Graph coarsen(const Graph& graph, std::vector<int>& coarseOf, std::mt19937& random) {
+        int n = graph.vertexCount();
+        std::vector<int> order(n);
+        for (int v = 0; v < n; v++) {
+            order[v] = v;
+        }
+        std::shuffle(order.begin(), order.end(), random);
+        
+        // Keep coarse vertices small enough that balance stays achievable
+        long long maxWeight = std::max(1LL, graph.totalWeight() / 20);
+        std::vector<int> match(n, -1);
+        for (int i = 0; i < n; i++) {
+            int v = order[i];
+            if (match[v] >= 0) {
+                continue;
+            }
+            int best = v;
+            int bestWeight = -1;
+            for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                int u = graph.adjncy[e];
+                if (match[u] < 0 && u != v && graph.adjwgt[e] > bestWeight &&
+                    graph.vwgt[u] + graph.vwgt[v] <= maxWeight) {
+                    best = u;
+                    bestWeight = graph.adjwgt[e];
+                }
+            }
+            match[v] = best;
+            match[best] = v;
+        }
+        
+        coarseOf.assign(n, -1);
+        int coarseCount = 0;
+        for (int i = 0; i < n; i++) {
+            int v = order[i];
+            if (coarseOf[v] < 0) {
+                coarseOf[v] = coarseCount;
+                coarseOf[match[v]] = coarseCount;
+                coarseCount++;
+            }
+        }
+        
+        // Merge the adjacency of each matched pair, summing parallel edges
+        Graph coarse;
+        coarse.xadj.push_back(0);
+        coarse.vwgt.assign(coarseCount, 0);
+        std::vector<int> members(coarseCount * 2, -1);
+        for (int v = 0; v < n; v++) {
+            coarse.vwgt[coarseOf[v]] += graph.vwgt[v];
+            members[coarseOf[v] * 2 + (members[coarseOf[v] * 2] < 0 ? 0 : 1)] = v;
+        }
+        std::vector<int> slot(coarseCount, -1);
+        for (int c = 0; c < coarseCount; c++) {
+            int start = static_cast<int>(coarse.adjncy.size());
+            for (int m = 0; m < 2; m++) {
+                int v = members[c * 2 + m];
+                if (v < 0) {
+                    continue;
+                }
+                for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                    int u = coarseOf[graph.adjncy[e]];
+                    if (u == c) {
+                        continue;
+                    }
+                    if (slot[u] < start) {
+                        slot[u] = static_cast<int>(coarse.adjncy.size());
+                        coarse.adjncy.push_back(u);
+                        coarse.adjwgt.push_back(graph.adjwgt[e]);
+                    } else {
+                        coarse.adjwgt[slot[u]] += graph.adjwgt[e];
+                    }
+                }
+            }
+            coarse.xadj.push_back(static_cast<int>(coarse.adjncy.size()));
+        }
+        return coarse;
+    }
+    
+    // Greedy graph growing from a few random seeds, keeping the best refined cut
+    static std::vector<int> initialBisection(const Graph& graph, double fraction, double tolerance, std::mt19937& random) {
+        int n = graph.vertexCount();
+        long long target = static_cast<long long>(fraction * graph.totalWeight());
+        std::vector<int> best;
+        long long bestCut = -1;
+        
+        for (int attempt = 0; attempt < 8; attempt++) {
+            std::vector<int> side(n, 1);
+            long long grown = 0;
+            std::vector<int> queue;
+            size_t head = 0;
+            int nextSeed = static_cast<int>(random() % std::max(n, 1));
+            
+            while (grown < target) {
+                if (head == queue.size()) {
+                    // Start (or restart, for disconnected graphs) from an unused vertex
+                    int seedVertex = -1;
+                    for (int k = 0; k < n && seedVertex < 0; k++) {
+                        int v = (nextSeed + k) % n;
+                        if (side[v] == 1) {
+                            seedVertex = v;
+                        }
+                    }
+                    if (seedVertex < 0) {
+                        break;
+                    }
+                    side[seedVertex] = 0;
+                    grown += graph.vwgt[seedVertex];
+                    queue.push_back(seedVertex);
+                    continue;
+                }
+                int v = queue[head++];
+                for (int e = graph.xadj[v]; e < graph.xadj[v + 1] && grown < target; e++) {
+                    int u = graph.adjncy[e];
+                    if (side[u] == 1) {
+                        side[u] = 0;
+                        grown += graph.vwgt[u];
+                        queue.push_back(u);
+                    }
+                }
+            }
+            
+            refine(graph, side, fraction, tolerance);
+            long long cut = 0;
+            for (int v = 0; v < n; v++) {
+                for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                    if (side[graph.adjncy[e]] != side[v]) {
+                        cut += graph.adjwgt[e];
+                    }
+                }
+            }
+            if (bestCut < 0 || cut < bestCut) {
+                bestCut = cut;
+                best = side;
+            }
+        }
+        return best;
+    }
+    
+    // Fiduccia-Mattheyses refinement of a bisection under a balance constraint
+    static void refine(const Graph& graph, std::vector<int>& side, double fraction, double tolerance) {
+        int n = graph.vertexCount();
+        long long total = graph.totalWeight();
+        long long limit[2];
+        limit[0] = static_cast<long long>(fraction * total * tolerance) + 1;
+        limit[1] = static_cast<long long>((1.0 - fraction) * total * tolerance) + 1;
+        
+        for (int pass = 0; pass < 8; pass++) {
+            long long weight[2] = {0, 0};
+            std::vector<int> gain(n, 0);
+            for (int v = 0; v < n; v++) {
+                weight[side[v]] += graph.vwgt[v];
+                for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                    gain[v] += side[graph.adjncy[e]] != side[v] ? graph.adjwgt[e] : -graph.adjwgt[e];
+                }
+            }
+            
+            // Candidates ordered by gain, one set per side
+            std::set<std::pair<int, int> > candidates[2];
+            for (int v = 0; v < n; v++) {
+                candidates[side[v]].insert(std::make_pair(-gain[v], v));
+            }
+            
+            std::vector<bool> locked(n, false);
+            std::vector<int> moves;
+            long long cutChange = 0;
+            long long bestChange = 0;
+            size_t bestMoves = 0;
+            bool bestBalanced = weight[0] <= limit[0] && weight[1] <= limit[1];
+            
+            while (moves.size() < static_cast<size_t>(n) && moves.size() < bestMoves + 64) {
+                // Move from an overweight side if there is one, else take the best feasible gain
+                int from = -1;
+                for (int s = 0; s < 2; s++) {
+                    if (weight[s] > limit[s] && !candidates[s].empty()) {
+                        from = s;
+                    }
+                }
+                if (from < 0) {
+                    int bestGain = 0;
+                    for (int s = 0; s < 2; s++) {
+                        if (candidates[s].empty()) {
+                            continue;
+                        }
+                        int v = candidates[s].begin()->second;
+                        if (weight[1 - s] + graph.vwgt[v] <= limit[1 - s] && (from < 0 || gain[v] > bestGain)) {
+                            from = s;
+                            bestGain = gain[v];
+                        }
+                    }
+                }
+                if (from < 0) {
+                    break;
+                }
                 
-                if (lastRow == nullptr) {
-                    rowList = newRow;
+                int v = candidates[from].begin()->second;
+                candidates[from].erase(candidates[from].begin());
+                locked[v] = true;
+                side[v] = 1 - from;
+                weight[from] -= graph.vwgt[v];
+                weight[1 - from] += graph.vwgt[v];
+                cutChange -= gain[v];
+                moves.push_back(v);
+                
+                for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                    int u = graph.adjncy[e];
+                    if (locked[u]) {
+                        continue;
+                    }
+                    candidates[side[u]].erase(std::make_pair(-gain[u], u));
+                    gain[u] += side[u] == side[v] ? -2 * graph.adjwgt[e] : 2 * graph.adjwgt[e];
+                    candidates[side[u]].insert(std::make_pair(-gain[u], u));
+                }
+                
+                bool balanced = weight[0] <= limit[0] && weight[1] <= limit[1];
+                if ((balanced && !bestBalanced) || (balanced == bestBalanced && cutChange < bestChange)) {
+                    bestChange = cutChange;
+                    bestMoves = moves.size();
+                    bestBalanced = balanced;
+                }
+            }
+            
+            // Undo the moves made after the best point of the pass
+            for (size_t m = moves.size(); m > bestMoves; m--) {
+                side[moves[m - 1]] = 1 - side[moves[m - 1]];
+            }
+            if (bestMoves == 0) {
+                break;
+            }
+        }
+    }
+};
+
+// Elimination ordering for sparse factorization of a structurally symmetric
+// matrix, with the elimination tree it induces. Nested dissection splits the
+// graph with a small vertex separator, orders both halves recursively and the
+// separator last, so the two halves become independent subtrees of the
+// elimination tree that can be factored on different cores.
+class EliminationOrdering {
+private:
+    GraphPartitioner::Graph graph;
+    std::vector<int> order;     // order[k] = row eliminated at step k
+    std::vector<int> position;  // position[row] = step at which the row is eliminated
+    std::vector<int> parent;    // Elimination tree over steps, -1 for roots
+    
+    // Split a graph into side 0, side 1 and a separator (2) with no edges
+    // between the two sides. The separator is a minimum vertex cover of the
+    // edges cut by a bisection (Konig's theorem on the boundary vertices).
+    static std::vector<int> separate(const GraphPartitioner::Graph& g, std::mt19937& random) {
+        int n = g.vertexCount();
+        std::vector<int> part = GraphPartitioner::bisect(g, 0.5, 1.05, random);
+        
+        std::vector<int> left;  // Boundary vertices of side 0
+        std::vector<int> boundaryIndex(n, -1);
+        int rightCount = 0;
+        for (int v = 0; v < n; v++) {
+            for (int e = g.xadj[v]; e < g.xadj[v + 1]; e++) {
+                if (part[g.adjncy[e]] != part[v]) {
+                    boundaryIndex[v] = part[v] == 0 ? static_cast<int>(left.size()) : rightCount++;
+                    if (part[v] == 0) {
+                        left.push_back(v);
+                    }
+                    break;
+                }
+            }
+        }
+        
+        // Maximum matching on the cut edges: greedy start, then augmenting paths
+        std::vector<int> matchLeft(left.size(), -1);
+        std::vector<int> matchRight(rightCount, -1);
+        for (size_t l = 0; l < left.size(); l++) {
+            int v = left[l];
+            for (int e = g.xadj[v]; e < g.xadj[v + 1] && matchLeft[l] < 0; e++) {
+                int u = g.adjncy[e];
+                if (part[u] == 1 && matchRight[boundaryIndex[u]] < 0) {
+                    matchLeft[l] = boundaryIndex[u];
+                    matchRight[boundaryIndex[u]] = static_cast<int>(l);
+                }
+            }
+        }
+        std::vector<int> visited(rightCount, -1);
+        std::function<bool(int, int)> augment = [&](int l, int stamp) {
+            int v = left[l];
+            for (int e = g.xadj[v]; e < g.xadj[v + 1]; e++) {
+                int u = g.adjncy[e];
+                if (part[u] != 1 || visited[boundaryIndex[u]] == stamp) {
+                    continue;
+                }
+                int r = boundaryIndex[u];
+                visited[r] = stamp;
+                if (matchRight[r] < 0 || augment(matchRight[r], stamp)) {
+                    matchLeft[l] = r;
+                    matchRight[r] = l;
+                    return true;
+                }
+            }
+            return false;
+        };
+        for (size_t l = 0; l < left.size(); l++) {
+            if (matchLeft[l] < 0) {
+                augment(static_cast<int>(l), static_cast<int>(l));
+            }
+        }
+        
+        // Alternating search from unmatched left vertices; the cover is the
+        // unreached left vertices plus the reached right vertices
+        std::vector<bool> reachedLeft(left.size(), false);
+        std::vector<bool> reachedRight(rightCount, false);
+        std::vector<int> queue;
+        for (size_t l = 0; l < left.size(); l++) {
+            if (matchLeft[l] < 0) {
+                reachedLeft[l] = true;
+                queue.push_back(static_cast<int>(l));
+            }
+        }
+        for (size_t head = 0; head < queue.size(); head++) {
+            int v = left[queue[head]];
+            for (int e = g.xadj[v]; e < g.xadj[v + 1]; e++) {
+                int u = g.adjncy[e];
+                if (part[u] != 1 || reachedRight[boundaryIndex[u]]) {
+                    continue;
+                }
+                int r = boundaryIndex[u];
+                reachedRight[r] = true;
+                if (matchRight[r] >= 0 && !reachedLeft[matchRight[r]]) {
+                    reachedLeft[matchRight[r]] = true;
+                    queue.push_back(matchRight[r]);
+                }
+            }
+        }
+        for (int v = 0; v < n; v++) {
+            if (boundaryIndex[v] < 0) {
+                continue;
+            }
+            if (part[v] == 0 ? !reachedLeft[boundaryIndex[v]] : reachedRight[boundaryIndex[v]]) {
+                part[v] = 2;
+            }
+        }
+        return part;
+    }
+    
+    static void dissect(const GraphPartitioner::Graph& g, const std::vector<int>& vertices, int leafSize,
+                        std::mt19937& random, std::vector<int>& order) {
+        int n = g.vertexCount();
+        if (n <= leafSize) {
+            order.insert(order.end(), vertices.begin(), vertices.end());
+            return;
+        }
+        
+        std::vector<int> part = separate(g, random);
+        std::vector<int> subVertices[2];
+        GraphPartitioner::Graph sub[2];
+        for (int which = 0; which < 2; which++) {
+            sub[which] = GraphPartitioner::inducedSubgraph(g, part, which, subVertices[which]);
+            for (size_t i = 0; i < subVertices[which].size(); i++) {
+                subVertices[which][i] = vertices[subVertices[which][i]];
+            }
+        }
+        if (sub[0].vertexCount() == n || sub[1].vertexCount() == n) {
+            order.insert(order.end(), vertices.begin(), vertices.end()); // Nothing left to split
+            return;
+        }
+        
+        for (int which = 0; which < 2; which++) {
+            dissect(sub[which], subVertices[which], leafSize, random, order);
+        }
+        for (int v = 0; v < n; v++) {
+            if (part[v] == 2) {
+                order.push_back(vertices[v]);
+            }
+        }
+    }
+    
+public:
+    // Ordering of the rows of a graph; builds the elimination tree
+    EliminationOrdering(const GraphPartitioner::Graph& g, const std::vector<int>& rowOrder)
+        : graph(g), order(rowOrder) {
+        int n = graph.vertexCount();
+        if (static_cast<int>(order.size()) != n) {
+            throw std::invalid_argument("Ordering must list every row once");
+        }
+        position.assign(n, -1);
+        for (int k = 0; k < n; k++) {
+            if (order[k] < 0 || order[k] >= n || position[order[k]] >= 0) {
+                throw std::invalid_argument("Ordering must list every row once");
+            }
+            position[order[k]] = k;
+        }
+        
+        // Liu's algorithm with path compression through `ancestor`
+        parent.assign(n, -1);
+        std::vector<int> ancestor(n, -1);
+        for (int k = 0; k < n; k++) {
+            int v = order[k];
+            for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                int i = position[graph.adjncy[e]];
+                while (i >= 0 && i < k) {
+                    int next = ancestor[i];
+                    ancestor[i] = k;
+                    if (next < 0) {
+                        parent[i] = k;
+                    }
+                    i = next;
+                }
+            }
+        }
+    }
+    
+    // Rows in their current order
+    template <class Matrix>
+    static EliminationOrdering natural(const Matrix& matrix) {
+        GraphPartitioner::Graph g = GraphPartitioner::buildGraph(matrix);
+        std::vector<int> rowOrder(g.vertexCount());
+        for (int v = 0; v < g.vertexCount(); v++) {
+            rowOrder[v] = v;
+        }
+        return EliminationOrdering(g, rowOrder);
+    }
+    
+    // Nested dissection down to pieces of at most leafSize rows
+    template <class Matrix>
+    static EliminationOrdering nestedDissection(const Matrix& matrix, int leafSize = 32, unsigned seed = 1) {
+        GraphPartitioner::Graph g = GraphPartitioner::buildGraph(matrix);
+        g.vwgt.assign(g.vertexCount(), 1); // Balance the halves by row count
+        std::vector<int> vertices(g.vertexCount());
+        for (int v = 0; v < g.vertexCount(); v++) {
+            vertices[v] = v;
+        }
+        std::mt19937 random(seed);
+        std::vector<int> rowOrder;
+        dissect(g, vertices, std::max(leafSize, 1), random, rowOrder);
+        return EliminationOrdering(g, rowOrder);
+    }
+    
+    const std::vector<int>& getOrder() const { return order; }
+    const std::vector<int>& getPosition() const { return position; }
+    const std::vector<int>& getParent() const { return parent; }
+    
+    // Steps grouped into waves: every step in a wave depends only on earlier
+    // waves, so a parallel factorization can run each wave across cores.
+    // The number of waves is the critical path of the factorization.
+    std::vector<std::vector<int> > levels() const {
+        int n = static_cast<int>(order.size());
+        std::vector<int> height(n, 0);
+        std::vector<std::vector<int> > waves;
+        for (int k = 0; k < n; k++) {
+            if (static_cast<int>(waves.size()) <= height[k]) {
+                waves.resize(height[k] + 1);
+            }
+            waves[height[k]].push_back(k);
+            if (parent[k] >= 0) {
+                height[parent[k]] = std::max(height[parent[k]], height[k] + 1);
+            }
+        }
+        return waves;
+    }
+    
+    // Elements of the Cholesky factor L (diagonal included) in this order
+    long long factorNonZeros() const {
+        int n = static_cast<int>(order.size());
+        std::vector<int> mark(n, -1);
+        long long count = n;
+        for (int k = 0; k < n; k++) {
+            mark[k] = k;
+            int v = order[k];
+            for (int e = graph.xadj[v]; e < graph.xadj[v + 1]; e++) {
+                // Row k of L holds the path from each earlier neighbour up to k
+                for (int i = position[graph.adjncy[e]]; i < k && mark[i] != k; i = parent[i]) {
+                    mark[i] = k;
+                    count++;
+                }
+            }
+        }
+        return count;
+    }
+    
+    // The matrix with rows and columns in elimination order (P * A * P')
+    template <class Matrix>
+    SparseMatrix permute(const Matrix& matrix) const {
+        if (matrix.getRows() != static_cast<int>(order.size()) || matrix.getCols() != static_cast<int>(order.size())) {
+            throw std::invalid_argument("Matrix dimensions do not match the ordering");
+        }
+        SparseMatrix result(matrix.getRows(), matrix.getCols(), matrix.getResource());
+        matrix.forEachElement([&](int r, int c, double value) {
+            result.insert(position[r], position[c], value);
+        });
+        return result;
+    }
+};
+
+// Create a directory if it does not exist yet
+void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+    int status = _mkdir(path.c_str());
+#else
+    int status = mkdir(path.c_str(), 0755);
+#endif
+    if (status != 0 && errno != EEXIST) {
+        throw std::runtime_error("Cannot create directory " + path);
+    }
+}
+
+// Copy a file byte for byte
+void copyFile(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("Cannot open file " + from);
+    }
+    std::string tmpPath = to + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("Cannot create file " + tmpPath);
+        }
+        out << in.rdbuf();
+        if (!out) {
+            throw std::runtime_error("Failed writing file " + tmpPath);
+        }
+    }
+    if (std::rename(tmpPath.c_str(), to.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        throw std::runtime_error("Cannot replace file " + to);
+    }
+}
+
+// Force a file (or, on POSIX, a directory after a rename) to stable storage
+void syncFile(const std::string& path) {
+#ifdef _WIN32
+    std::FILE* file = std::fopen(path.c_str(), "rb+");
+    if (file != nullptr) {
+        _commit(_fileno(file));
+        std::fclose(file);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open " + path + " to sync it");
+    }
+    int status = fsync(fd);
+    close(fd);
+    if (status != 0 && errno != EINVAL) { // Some file systems cannot sync directories
+        throw std::runtime_error("Cannot sync " + path);
+    }
+#endif
+}
+
+// A matrix kept crash-safe in a directory. Every insert or removal is
+// appended to an update log (buffered in batches, optionally fsynced after
+// each batch) and now and then the whole matrix is written as a snapshot in
+// the binary format, starting a new, empty log. Opening the directory again
+// loads the latest snapshot and replays the log written after it.
+//
+// Directory contents: CURRENT names the live generation g; snapshot_g.spm and
+// updates_g.log belong to it. A new generation is fully written before
+// CURRENT moves to it, so a crash at any point leaves a consistent pair.
+class DurableSparseMatrix {
+public:
+    struct Options {
+        size_t batchRecords;        // Updates buffered before one write to the log
+        bool syncEachBatch;         // fsync the log after every write (else the OS decides)
+        long long snapshotRecords;  // Logged updates that trigger a snapshot, 0 = only on request
+        
+        Options() : batchRecords(256), syncEachBatch(true), snapshotRecords(1000000) {}
+    };
+    
+private:
+    struct LogHeader {
+        char magic[4];      // "SPML"
+        uint32_t version;   // Log format version
+        int32_t rows;       // Dimensions, checked against the snapshot
+        int32_t cols;
+    };
+    
+    // One update; value 0 removes the element. check detects a torn last write.
+    struct LogRecord {
+        int32_t row;
+        int32_t col;
+        double value;
+        uint64_t check;
+    };
+    
+    std::string dir;
+    Options options;
+    SparseMatrix current;
+    uint64_t generation;
+    std::FILE* log;
+    std::vector<LogRecord> pending;     // Applied to current, not yet written
+    long long loggedSinceSnapshot;
+    long long recoveredRecords;
+    
+    static uint64_t recordCheck(const LogRecord& record) {
+        uint64_t bits;
+        std::memcpy(&bits, &record.value, sizeof(bits));
+        uint64_t position = (static_cast<uint64_t>(static_cast<uint32_t>(record.row)) << 32) |
+                            static_cast<uint32_t>(record.col);
+        return mixHash(mixHash(position) ^ bits);
+    }
+    
+    std::string snapshotPath(uint64_t g) const { return dir + "/snapshot_" + std::to_string(g) + ".spm"; }
+    std::string logPath(uint64_t g) const { return dir + "/updates_" + std::to_string(g) + ".log"; }
+    
+    // Stop appending to the log after a failed write or sync. Its tail may be
+    // torn, and recovery stops at a torn record, so anything appended after it
+    // would be lost. The next flush starts a new generation instead, from the
+    // matrix in memory, which already holds every update.
+    void abandonLog() {
+        std::fclose(log);
+        log = nullptr;
+    }
+    
+    // Force the log to stable storage
+    void syncLog() {
+#ifdef _WIN32
+        int status = _commit(_fileno(log));
+#else
+        int status = fsync(fileno(log));
+#endif
+        if (status != 0) {
+            abandonLog();
+            throw std::runtime_error("Cannot sync update log " + logPath(generation));
+        }
+    }
+    
+    // Write a file through a temporary, sync it, then move it into place
+    template <class Writer>
+    static void writeDurably(const std::string& path, Writer write) {
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot create file " + tmpPath);
+            }
+            write(out);
+            out.close();    // The last buffered bytes can fail too
+            if (!out) {
+                std::remove(tmpPath.c_str());
+                throw std::runtime_error("Failed writing file " + tmpPath);
+            }
+        }
+        syncFile(tmpPath);
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Cannot replace file " + path);
+        }
+    }
+    
+    // Write snapshot and empty log of a new generation, then switch CURRENT to it
+    void startGeneration(uint64_t g) {
+        writeDurably(snapshotPath(g), [&](std::ostream& out) { current.writeBinary(out); });
+        writeDurably(logPath(g), [&](std::ostream& out) {
+            LogHeader header;
+            std::memcpy(header.magic, "SPML", 4);
+            header.version = 1;
+            header.rows = current.getRows();
+            header.cols = current.getCols();
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        });
+        writeDurably(dir + "/CURRENT", [&](std::ostream& out) { out << g << "\n"; });
+        syncFile(dir);
+        
+        if (log != nullptr) {
+            std::fclose(log);
+            log = nullptr;
+        }
+        if (g > 0) {
+            std::remove(snapshotPath(g - 1).c_str());
+            std::remove(logPath(g - 1).c_str());
+        }
+        generation = g;
+        log = std::fopen(logPath(g).c_str(), "ab");
+        if (log == nullptr) {
+            throw std::runtime_error("Cannot open update log " + logPath(g));
+        }
+        pending.clear();
+        loggedSinceSnapshot = 0;
+    }
+    
+    // View a snapshot with its arrays validated, so that a torn or corrupt
+    // file is reported instead of read out of bounds
+    SparseMatrixView readSnapshot(const MappedFile& file) const {
+        try {
+            return SparseMatrixView::fromBinary(file.bytes(), file.size());
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error("Corrupt snapshot " + snapshotPath(generation) + ": " + e.what());
+        }
+    }
+    
+    // Load the snapshot and replay the log tail: the updates are sorted (the
+    // last one to each position wins) and merged with the snapshot's rows in a
+    // single pass, then the matrix is built once from the merged arrays.
+    void recover() {
+        std::ifstream in(dir + "/CURRENT");
+        if (!(in >> generation)) {
+            throw std::runtime_error("Not a durable matrix directory: " + dir);
+        }
+        
+        bool tornTail = false;
+        {
+            MappedFile snapshotFile(snapshotPath(generation));
+            SparseMatrixView snapshot = readSnapshot(snapshotFile);
+            int rows = snapshot.getRows();
+            int cols = snapshot.getCols();
+            
+            MappedFile logFile(logPath(generation));
+            LogHeader header;
+            if (logFile.size() < sizeof(header)) {
+                throw std::runtime_error("Update log is truncated");
+            }
+            std::memcpy(&header, logFile.bytes(), sizeof(header));
+            if (std::memcmp(header.magic, "SPML", 4) != 0 || header.version != 1 ||
+                header.rows != rows || header.cols != cols) {
+                throw std::runtime_error("Update log does not match its snapshot");
+            }
+            
+            struct Update {
+                int row;
+                int col;
+                double value;
+                bool operator<(const Update& other) const {
+                    return row != other.row ? row < other.row : col < other.col;
+                }
+            };
+            std::vector<Update> updates;
+            size_t offset = sizeof(header);
+            while (offset + sizeof(LogRecord) <= logFile.size()) {
+                LogRecord record;
+                std::memcpy(&record, logFile.bytes() + offset, sizeof(record));
+                if (record.check != recordCheck(record) || record.row < 0 || record.row >= rows ||
+                    record.col < 0 || record.col >= cols) {
+                    break;
+                }
+                Update update = {record.row, record.col, record.value};
+                updates.push_back(update);
+                offset += sizeof(record);
+            }
+            tornTail = offset != logFile.size();
+            recoveredRecords = static_cast<long long>(updates.size());
+            
+            std::stable_sort(updates.begin(), updates.end());
+            size_t kept = 0;
+            for (size_t u = 0; u < updates.size(); u++) {
+                if (kept > 0 && !(updates[kept - 1] < updates[u])) {
+                    updates[kept - 1] = updates[u]; // A later update to the same position
                 } else {
-                    lastRow->next = newRow;
+                    updates[kept++] = updates[u];
+                }
+            }
+            updates.resize(kept);
+            
+            std::vector<int64_t> rowPtr(rows + 1, 0);
+            std::vector<int32_t> colIdx;
+            std::vector<double> values;
+            colIdx.reserve(snapshot.countNonZero() + kept);
+            values.reserve(snapshot.countNonZero() + kept);
+            auto emit = [&](int r, int c, double v) {
+                if (std::abs(v) >= 1e-10) {
+                    colIdx.push_back(c);
+                    values.push_back(v);
+                    rowPtr[r + 1]++;
+                }
+            };
+            size_t u = 0;
+            auto emitUpdatesBefore = [&](int r, int c) {
+                while (u < updates.size() && (updates[u].row < r || (updates[u].row == r && updates[u].col < c))) {
+                    emit(updates[u].row, updates[u].col, updates[u].value);
+                    u++;
+                }
+            };
+            snapshot.forEachElement([&](int r, int c, double v) {
+                emitUpdatesBefore(r, c);
+                if (u < updates.size() && updates[u].row == r && updates[u].col == c) {
+                    emit(r, c, updates[u].value);
+                    u++;
+                } else {
+                    emit(r, c, v);
+                }
+            });
+            emitUpdatesBefore(rows, 0);
+            for (int r = 0; r < rows; r++) {
+                rowPtr[r + 1] += rowPtr[r];
+            }
+            current = SparseMatrix::fromCSR(rows, cols, rowPtr.data(), colIdx.data(), values.data());
+        }
+        
+        if (tornTail) {
+            startGeneration(generation + 1); // Drop the partial record for good
+            return;
+        }
+        log = std::fopen(logPath(generation).c_str(), "ab");
+        if (log == nullptr) {
+            throw std::runtime_error("Cannot open update log " + logPath(generation));
+        }
+        loggedSinceSnapshot = recoveredRecords;
+    }
+    
+public:
+    // Create a new durable matrix in an empty or missing directory
+    DurableSparseMatrix(const std::string& directory, int r, int c, const Options& opts = Options())
+        : dir(directory), options(opts), current(r, c), generation(0), log(nullptr),
+          loggedSinceSnapshot(0), recoveredRecords(0) {
+        if (exists(dir)) {
+            throw std::runtime_error("A durable matrix already exists in " + dir);
+        }
+        makeDirectory(dir);
+        startGeneration(0);
+    }
+    
+    // Reopen a durable matrix, recovering every update that reached the log
+    explicit DurableSparseMatrix(const std::string& directory, const Options& opts = Options())
+        : dir(directory), options(opts), current(1, 1), generation(0), log(nullptr),
+          loggedSinceSnapshot(0), recoveredRecords(0) {
+        recover();
+    }
+    
+    DurableSparseMatrix(const DurableSparseMatrix&) = delete;
+    DurableSparseMatrix& operator=(const DurableSparseMatrix&) = delete;
+    
+    ~DurableSparseMatrix() {
+        try {
+            flush();
+        } catch (...) {
+            // Updates still buffered are lost, as in a crash
+        }
+        if (log != nullptr) {
+            std::fclose(log);
+        }
+    }
+    
+    static bool exists(const std::string& directory) {
+        std::ifstream in(directory + "/CURRENT");
+        return static_cast<bool>(in);
+    }
+    
+    // Delete a durable matrix directory
+    static void destroy(const std::string& directory) {
+        uint64_t g;
+        std::ifstream in(directory + "/CURRENT");
+        if (in >> g) {
+            std::remove((directory + "/snapshot_" + std::to_string(g) + ".spm").c_str());
+            std::remove((directory + "/updates_" + std::to_string(g) + ".log").c_str());
+        }
+        in.close();
+        std::remove((directory + "/CURRENT").c_str());
+#ifdef _WIN32
+        _rmdir(directory.c_str());
+#else
+        rmdir(directory.c_str());
+#endif
+    }
+    
+    const SparseMatrix& matrix() const { return current; }
+    uint64_t getGeneration() const { return generation; }
+    long long getRecoveredRecords() const { return recoveredRecords; }
+    
+    void insert(int r, int c, double v) {
+        if (r < 0 || r >= current.getRows() || c < 0 || c >= current.getCols()) {
+            throw std::out_of_range("Index out of range");
+        }
+        current.insert(r, c, v);
+        
+        LogRecord record;
+        record.row = r;
+        record.col = c;
+        record.value = std::abs(v) < 1e-10 ? 0.0 : v;
+        record.check = recordCheck(record);
+        pending.push_back(record);
+        if (pending.size() >= options.batchRecords) {
+            flush();
+        }
+    }
+    
+    void remove(int r, int c) {
+        insert(r, c, 0.0);
+    }
+    
+    // Write buffered updates to the log (synced if syncEachBatch is set). After
+    // a failed write, a snapshot takes the place of the abandoned log.
+    void flush() {
+        if (log == nullptr) {
+            startGeneration(generation + 1);
+            return;
+        }
+        if (pending.empty()) {
+            return;
+        }
+        if (std::fwrite(pending.data(), sizeof(LogRecord), pending.size(), log) != pending.size() ||
+            std::fflush(log) != 0) {
+            abandonLog();
+            throw std::runtime_error("Failed writing update log " + logPath(generation));
+        }
+        if (options.syncEachBatch) {
+            syncLog();
+        }
+        loggedSinceSnapshot += static_cast<long long>(pending.size());
+        pending.clear();
+        
+        if (options.snapshotRecords > 0 && loggedSinceSnapshot >= options.snapshotRecords) {
+            snapshot();
+        }
+    }
+    
+    // Make every update so far durable, whatever syncEachBatch says
+    void sync() {
+        flush();
+        syncLog();
+    }
+    
+    // Write the whole matrix as a new snapshot and start an empty log
+    void snapshot() {
+        startGeneration(generation + 1);
+    }
+};
+
+// Loader for Matrix Market coordinate files that overlaps reading with
+// parsing. The entries are read in large chunks by several tasks at once,
+// each task parsing its own chunk as soon as the read completes, while
+// further chunks are already being read. Lines that straddle two chunks are
+// stitched together in file order. Assembly sorts each row range and builds
+// its row lists in parallel.
+class MatrixMarketLoader {
+public:
+    struct Options {
+        size_t chunkBytes;      // Size of each read
+        int chunksAhead;        // Chunks being read or parsed at once
+        int threads;            // Workers for assembly
+        Summation summation;    // How streamed products add up duplicate targets
+        
+        Options() : chunkBytes(8 << 20), chunksAhead(8), threads(std::max(1u, std::thread::hardware_concurrency())),
+                    summation(Summation::Fast) {}
+    };
+    
+private:
+    struct Format {
+        bool pattern;       // Entries have no value (all ones)
+        int symmetry;       // 0 general, 1 symmetric, -1 skew-symmetric
+        int rows;
+        int cols;
+    };
+    
+    // Entries of one chunk, plus the partial lines at its two ends
+    struct Chunk {
+        std::vector<int32_t> rowIdx;
+        std::vector<int32_t> colIdx;
+        std::vector<double> values;
+        std::string head;       // Bytes before the first line break
+        std::string tail;       // Bytes after the last line break
+        bool hasLineBreak;
+    };
+    
+    static void addEntry(const Format& format, Chunk& chunk, long row, long col, double value) {
+        if (row < 1 || row > format.rows || col < 1 || col > format.cols) {
+            throw std::runtime_error("Matrix Market entry out of range");
+        }
+        chunk.rowIdx.push_back(static_cast<int32_t>(row - 1));
+        chunk.colIdx.push_back(static_cast<int32_t>(col - 1));
+        chunk.values.push_back(value);
+        if (format.symmetry != 0 && row != col) {
+            chunk.rowIdx.push_back(static_cast<int32_t>(col - 1));
+            chunk.colIdx.push_back(static_cast<int32_t>(row - 1));
+            chunk.values.push_back(format.symmetry * value);
+        }
+    }
+    
+    // Parse one NUL-terminated line
+    static void parseLine(const Format& format, const char* line, Chunk& chunk) {
+        while (*line == ' ' || *line == '\t' || *line == '\r') {
+            line++;
+        }
+        if (*line == '\0' || *line == '%') {
+            return;
+        }
+        char* end;
+        long row = std::strtol(line, &end, 10);
+        bool ok = end != line;
+        line = end;
+        long col = std::strtol(line, &end, 10);
+        ok = ok && end != line;
+        line = end;
+        double value = 1.0;
+        if (!format.pattern) {
+            value = std::strtod(line, &end);
+            ok = ok && end != line;
+        }
+        if (!ok) {
+            throw std::runtime_error("Bad entry in Matrix Market file");
+        }
+        addEntry(format, chunk, row, col, value);
+    }
+    
+    static Chunk readChunk(const FileReader& file, const Format& format, uint64_t offset, size_t length, bool first) {
+        std::vector<char> buffer(length + 1);
+        file.readAt(offset, length, buffer.data());
+        return parseChunk(format, buffer, first);
+    }
+    
+    // Parse the entries of a chunk of text followed by a NUL
+    static Chunk parseChunk(const Format& format, std::vector<char>& buffer, bool first) {
+        size_t length = buffer.size() - 1;
+        buffer[length] = '\0';
+        
+        Chunk chunk;
+        char* begin = buffer.data();
+        char* end = begin + length;
+        char* firstBreak = static_cast<char*>(std::memchr(begin, '\n', length));
+        chunk.hasLineBreak = firstBreak != nullptr;
+        if (!chunk.hasLineBreak) {
+            chunk.head.assign(begin, end);
+            return chunk;
+        }
+        
+        // The first chunk starts on a line boundary; others start mid-line
+        char* line = first ? begin : firstBreak + 1;
+        if (!first) {
+            chunk.head.assign(begin, firstBreak);
+        }
+        while (line < end) {
+            char* lineEnd = static_cast<char*>(std::memchr(line, '\n', end - line));
+            if (lineEnd == nullptr) {
+                chunk.tail.assign(line, end);
+                break;
+            }
+            *lineEnd = '\0';
+            parseLine(format, line, chunk);
+            line = lineEnd + 1;
+        }
+        return chunk;
+    }
+    
+    static Format readBanner(std::istream& in, uint64_t& dataStart) {
+        std::string banner;
+        std::getline(in, banner);
+        std::string lower;
+        for (size_t i = 0; i < banner.size(); i++) {
+            lower += static_cast<char>(std::tolower(static_cast<unsigned char>(banner[i])));
+        }
+        if (lower.compare(0, 14, "%%matrixmarket") != 0 || lower.find("matrix") == std::string::npos ||
+            lower.find("coordinate") == std::string::npos) {
+            throw std::runtime_error("Not a Matrix Market coordinate file");
+        }
+        if (lower.find("complex") != std::string::npos || lower.find("hermitian") != std::string::npos) {
+            throw std::runtime_error("Complex Matrix Market files are not supported");
+        }
+        
+        Format format;
+        format.pattern = lower.find("pattern") != std::string::npos;
+        format.symmetry = lower.find("skew-symmetric") != std::string::npos ? -1
+                          : lower.find("symmetric") != std::string::npos ? 1 : 0;
+        
+        std::string line;
+        while (std::getline(in, line) && (line.empty() || line[0] == '%')) {
+        }
+        long long nnz;
+        std::istringstream size(line);
+        if (!(size >> format.rows >> format.cols >> nnz) || format.rows <= 0 || format.cols <= 0) {
+            throw std::runtime_error("Bad size line in Matrix Market file");
+        }
+        if (format.symmetry != 0 && format.rows != format.cols) {
+            throw std::runtime_error("Symmetric Matrix Market matrix must be square");
+        }
+        std::streamoff position = in.tellg();
+        dataStart = position < 0 ? 0 : static_cast<uint64_t>(position);
+        return format;
+    }
+    
+public:
+    static SparseMatrix load(const std::string& path, const Options& options = Options()) {
+        uint64_t dataStart;
+        Format format;
+        {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw std::runtime_error("Cannot open file " + path);
+            }
+            format = readBanner(in, dataStart);
+        }
+        FileReader file(path);
+        if (dataStart == 0) {
+            dataStart = file.size(); // Size line was the last line of the file
+        }
+        
+        // Keep up to chunksAhead chunks in flight, consuming them in file order
+        // and counting the entries of each row as they arrive
+        size_t chunkBytes = std::max<size_t>(options.chunkBytes, 1);
+        uint64_t chunkCount = (file.size() - dataStart + chunkBytes - 1) / chunkBytes;
+        std::vector<Chunk> chunks;
+        std::vector<int64_t> rowStart(format.rows + 1, 0);
+        std::deque<std::future<Chunk> > inFlight;
+        uint64_t launched = 0;
+        std::string pending;    // A line spread over consecutive chunks
+        while (chunks.size() < chunkCount) {
+            while (launched < chunkCount && inFlight.size() < static_cast<size_t>(std::max(options.chunksAhead, 1))) {
+                uint64_t offset = dataStart + launched * chunkBytes;
+                size_t length = static_cast<size_t>(std::min<uint64_t>(chunkBytes, file.size() - offset));
+                bool first = launched == 0;
+                inFlight.push_back(std::async(std::launch::async, [&file, format, offset, length, first]() {
+                    return readChunk(file, format, offset, length, first);
+                }));
+                launched++;
+            }
+            Chunk chunk = inFlight.front().get();
+            inFlight.pop_front();
+            
+            pending += chunk.head;
+            if (chunk.hasLineBreak) {
+                if (!chunks.empty()) {
+                    size_t counted = chunks.back().rowIdx.size();
+                    parseLine(format, pending.c_str(), chunks.back()); // Belongs between the two chunks
+                    countRows(chunks.back(), counted, rowStart);
                 }
-                lastRow = newRow;
-                
-                MatrixNode* otherElement = otherRow->elements;
-                MatrixNode* lastElement = nullptr;
-                
-                while (otherElement != nullptr) {
-                    MatrixNode* newElement = new MatrixNode(otherElement->col, otherElement->value);
-                    
-                    if (lastElement == nullptr) {
-                        newRow->elements = newElement;
+                pending = chunk.tail;
+            }
+            countRows(chunk, 0, rowStart);
+            chunks.push_back(std::move(chunk));
+        }
+        if (!chunks.empty()) {
+            size_t counted = chunks.back().rowIdx.size();
+            parseLine(format, pending.c_str(), chunks.back());
+            countRows(chunks.back(), counted, rowStart);
+        }
+        return assemble(format.rows, format.cols, chunks, rowStart, options.threads);
+    }
+    
+    // Product of the file's matrix with x (of its transpose when transposed
+    // is set), computed while the entries are parsed instead of building the
+    // matrix. Chunks are read and parsed by several tasks at once as in load,
+    // and memory stays within chunksAhead chunks plus the two vectors. Every
+    // entry contributes, so duplicates add up, as they do in load.
+    static std::vector<double> multiplyVector(const std::string& path, const std::vector<double>& x,
+                                              bool transposed = false, const Options& options = Options()) {
+        uint64_t dataStart;
+        Format format;
+        {
+            std::ifstream in(path, std::ios::binary);
+            if (!in) {
+                throw std::runtime_error("Cannot open file " + path);
+            }
+            format = readBanner(in, dataStart);
+        }
+        std::vector<double> y = productVector(format, x, transposed);
+        FileReader file(path);
+        if (dataStart == 0) {
+            dataStart = file.size();
+        }
+        
+        size_t chunkBytes = std::max<size_t>(options.chunkBytes, 1);
+        uint64_t chunkCount = (file.size() - dataStart + chunkBytes - 1) / chunkBytes;
+        uint64_t launched = 0;
+        foldChunks(format, options, [&](std::deque<std::future<Chunk> >& inFlight) {
+            if (launched == chunkCount) {
+                return false;
+            }
+            uint64_t offset = dataStart + launched * chunkBytes;
+            size_t length = static_cast<size_t>(std::min<uint64_t>(chunkBytes, file.size() - offset));
+            bool first = launched == 0;
+            inFlight.push_back(std::async(std::launch::async, [&file, &format, &x, transposed, offset, length, first]() {
+                Chunk chunk = readChunk(file, format, offset, length, first);
+                weigh(chunk, x, transposed);
+                return chunk;
+            }));
+            return ++launched < chunkCount;
+        }, x, transposed, y);
+        return y;
+    }
+    
+    // The same for a stream such as std::cin. Reading stays on the calling
+    // thread; parsing runs on chunksAhead tasks.
+    static std::vector<double> multiplyVector(std::istream& in, const std::vector<double>& x,
+                                              bool transposed = false, const Options& options = Options()) {
+        uint64_t dataStart;
+        Format format = readBanner(in, dataStart);
+        std::vector<double> y = productVector(format, x, transposed);
+        
+        size_t chunkBytes = std::max<size_t>(options.chunkBytes, 1);
+        bool first = true;
+        foldChunks(format, options, [&](std::deque<std::future<Chunk> >& inFlight) {
+            std::vector<char> buffer(chunkBytes + 1);
+            in.read(buffer.data(), static_cast<std::streamsize>(chunkBytes));
+            size_t length = static_cast<size_t>(in.gcount());
+            if (length == 0) {
+                return false;
+            }
+            buffer.resize(length + 1);
+            bool firstChunk = first;
+            first = false;
+            inFlight.push_back(std::async(std::launch::async,
+                [text = std::move(buffer), &format, &x, transposed, firstChunk]() mutable {
+                    Chunk chunk = parseChunk(format, text, firstChunk);
+                    weigh(chunk, x, transposed);
+                    return chunk;
+                }));
+            return static_cast<bool>(in);
+        }, x, transposed, y);
+        return y;
+    }
+    
+    // Write a matrix as a general real Matrix Market coordinate file
+    static void save(const SparseMatrix& matrix, const std::string& path) {
+        std::string tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot create file " + tmpPath);
+            }
+            out << "%%MatrixMarket matrix coordinate real general\n";
+            out << matrix.getRows() << " " << matrix.getCols() << " " << matrix.countNonZero() << "\n";
+            out << std::setprecision(17);
+            matrix.forEachElement([&](int r, int c, double value) {
+                out << r + 1 << " " << c + 1 << " " << value << "\n";
+            });
+            if (!out) {
+                throw std::runtime_error("Failed writing file " + tmpPath);
+            }
+        }
+        if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Cannot replace file " + path);
+        }
+    }
+    
+private:
+    // Zero result of a streamed product, once x is checked against the format
+    static std::vector<double> productVector(const Format& format, const std::vector<double>& x, bool transposed) {
+        if (static_cast<int>(x.size()) != (transposed ? format.rows : format.cols)) {
+            throw std::invalid_argument(transposed ? "Vector size does not match matrix rows"
+                                                   : "Vector size does not match matrix columns");
+        }
+        return std::vector<double>(transposed ? format.cols : format.rows, 0.0);
+    }
+    
+    // Turn the values of a chunk into their terms of A * x (or A' * x)
+    static void weigh(Chunk& chunk, const std::vector<double>& x, bool transposed) {
+        const std::vector<int32_t>& source = transposed ? chunk.rowIdx : chunk.colIdx;
+        for (size_t e = 0; e < chunk.values.size(); e++) {
+            chunk.values[e] *= x[source[e]];
+        }
+    }
+    
+    // Add the terms of a chunk into y. A non-empty compensation holds the
+    // low-order bits each element of y has lost so far.
+    static void fold(const Chunk& chunk, bool transposed, std::vector<double>& y, std::vector<double>& compensation) {
+        const std::vector<int32_t>& target = transposed ? chunk.colIdx : chunk.rowIdx;
+        for (size_t e = 0; e < chunk.values.size(); e++) {
+            if (compensation.empty()) {
+                y[target[e]] += chunk.values[e];
+            } else {
+                CompensatedSum sum{y[target[e]], compensation[target[e]]};
+                sum.add(chunk.values[e]);
+                y[target[e]] = sum.sum;
+                compensation[target[e]] = sum.compensation;
+            }
+        }
+    }
+    
+    // Add the terms of the chunks started by launch() into y in file order,
+    // keeping at most chunksAhead chunks in flight. launch() starts the next
+    // chunk and returns whether more remain. The order, and so the result,
+    // does not depend on the chunk size or the number of tasks.
+    static void foldChunks(const Format& format, const Options& options,
+                           const std::function<bool(std::deque<std::future<Chunk> >&)>& launch,
+                           const std::vector<double>& x, bool transposed, std::vector<double>& y) {
+        std::deque<std::future<Chunk> > inFlight;
+        std::vector<double> compensation(options.summation == Summation::Reproducible ? y.size() : 0, 0.0);
+        bool more = true;
+        bool folded = false;    // Whether a chunk came before the pending line
+        std::string pending;    // A line spread over consecutive chunks
+        while (true) {
+            while (more && inFlight.size() < static_cast<size_t>(std::max(options.chunksAhead, 1))) {
+                more = launch(inFlight);
+            }
+            if (inFlight.empty()) {
+                break;
+            }
+            Chunk chunk = inFlight.front().get();
+            inFlight.pop_front();
+            
+            pending += chunk.head;
+            if (chunk.hasLineBreak) {
+                if (folded) {
+                    Chunk stitched;
+                    parseLine(format, pending.c_str(), stitched);
+                    weigh(stitched, x, transposed);
+                    fold(stitched, transposed, y, compensation);
+                }
+                pending = chunk.tail;
+            }
+            fold(chunk, transposed, y, compensation);
+            folded = true;
+        }
+        if (folded) {
+            Chunk stitched;
+            parseLine(format, pending.c_str(), stitched);
+            weigh(stitched, x, transposed);
+            fold(stitched, transposed, y, compensation);
+        }
+        for (size_t i = 0; i < compensation.size(); i++) {
+            y[i] += compensation[i];
+        }
+    }
+    
+    // Add the rows of a chunk's entries from index `from` on to rowStart[row + 1]
+    static void countRows(const Chunk& chunk, size_t from, std::vector<int64_t>& rowStart) {
+        for (size_t e = from; e < chunk.rowIdx.size(); e++) {
+            rowStart[chunk.rowIdx[e] + 1]++;
+        }
+    }
+    
+    // Scatter the entries by row straight into CSR arrays, chunk by chunk in
+    // file order, freeing each chunk once it is placed. Each thread places
+    // the entries of its own rows. Then sort each row by column (duplicates
+    // are summed in file order) and build the matrix. rowStart holds the
+    // entry count of each row, shifted by one.
+    static SparseMatrix assemble(int rows, int cols, std::vector<Chunk>& chunks, std::vector<int64_t>& rowStart,
+                                 int threads) {
+        for (int r = 0; r < rows; r++) {
+            rowStart[r + 1] += rowStart[r];
+        }
+        
+        // Split the rows into ranges of about equal entry counts
+        int parts = std::max(1, std::min(threads, rows));
+        std::vector<int> bound(parts + 1, rows);
+        for (int p = 0; p < parts; p++) {
+            int64_t target = rowStart[rows] * p / parts;
+            bound[p] = static_cast<int>(std::lower_bound(rowStart.begin(), rowStart.end() - 1, target) - rowStart.begin());
+        }
+        
+        std::vector<int32_t> colIdx(rowStart[rows]);
+        std::vector<double> values(rowStart[rows]);
+        std::vector<int64_t> cursor(rowStart.begin(), rowStart.end() - 1);
+        for (size_t k = 0; k < chunks.size(); k++) {
+            const Chunk& chunk = chunks[k];
+            parallelRanges(parts, parts, [&](long long begin, long long end) {
+                for (long long p = begin; p < end; p++) {
+                    for (size_t e = 0; e < chunk.rowIdx.size(); e++) {
+                        int32_t r = chunk.rowIdx[e];
+                        if (r >= bound[p] && r < bound[p + 1]) {
+                            int64_t slot = cursor[r]++;
+                            colIdx[slot] = chunk.colIdx[e];
+                            values[slot] = chunk.values[e];
+                        }
+                    }
+                }
+            });
+            chunks[k] = Chunk();
+        }
+        
+        std::vector<int64_t> rowLength(rows, 0);
+        parallelRanges(rows, threads, [&](long long begin, long long end) {
+            std::vector<std::pair<int32_t, double> > row;
+            for (long long r = begin; r < end; r++) {
+                int64_t first = rowStart[r];
+                int64_t last = rowStart[r + 1];
+                int64_t k = first + 1;
+                while (k < last && colIdx[k - 1] < colIdx[k]) {
+                    k++;
+                }
+                if (k >= last) {
+                    rowLength[r] = last - first;    // Already sorted without duplicates
+                    continue;
+                }
+                row.clear();
+                for (k = first; k < last; k++) {
+                    row.push_back(std::make_pair(colIdx[k], values[k]));
+                }
+                std::stable_sort(row.begin(), row.end(), [](const std::pair<int32_t, double>& a, const std::pair<int32_t, double>& b) {
+                    return a.first < b.first;
+                });
+                int64_t kept = 0;
+                for (size_t e = 0; e < row.size(); e++) {
+                    if (kept > 0 && colIdx[first + kept - 1] == row[e].first) {
+                        values[first + kept - 1] += row[e].second;
                     } else {
-                        lastElement->next = newElement;
+                        colIdx[first + kept] = row[e].first;
+                        values[first + kept] = row[e].second;
+                        kept++;
                     }
-                    lastElement = newElement;
-                    
-                    otherElement = otherElement->next;
                 }
-                
-                otherRow = otherRow->next;
+                rowLength[r] = kept;
+            }
+        });
+        
+        // Close the gaps left by summed duplicates, moving rows down in order
+        std::vector<int64_t> rowPtr(rows + 1, 0);
+        for (int r = 0; r < rows; r++) {
+            rowPtr[r + 1] = rowPtr[r] + rowLength[r];
+            if (rowPtr[r] != rowStart[r]) {
+                std::copy(colIdx.begin() + rowStart[r], colIdx.begin() + rowStart[r] + rowLength[r], colIdx.begin() + rowPtr[r]);
+                std::copy(values.begin() + rowStart[r], values.begin() + rowStart[r] + rowLength[r], values.begin() + rowPtr[r]);
             }
         }
-        return *this;
+        std::vector<int64_t>().swap(rowStart);
+        return SparseMatrix::fromCSR(rows, cols, rowPtr.data(), colIdx.data(), values.data(), threads);
     }
+};
+
+// The calculator's stored matrices. A session can be saved to a directory of
+// binary matrix files and restored later; restored matrices stay on disk until
+// they are first used. With a memory budget set, the least recently used
+// matrices are spilled to disk and reloaded transparently when referenced.
+class MatrixSession {
+private:
+    struct Entry {
+        std::shared_ptr<const SparseMatrix> matrix; // Loaded matrix, null while on disk
+        std::string path;                           // Backing file, empty if never saved
+        size_t bytes;                               // Memory used while loaded
+        uint64_t lastUsed;                          // Access tick for LRU eviction
+        
+        Entry() : bytes(0), lastUsed(0) {}
+    };
     
-    // Get dimensions
-    int getRows() const { return rows; }
-    int getCols() const { return cols; }
+    std::vector<Entry> entries;
+    size_t memoryBudget;     // Bytes allowed for loaded matrices, 0 = unlimited
+    size_t loadedBytes;      // Bytes used by loaded matrices
+    uint64_t clock;          // Incremented on every access
+    std::string spillDir;    // Where evicted matrices are written
+    std::vector<std::string> spillFiles; // Spill files to remove on exit
+    std::map<std::string, size_t> names; // Names given to matrices in expressions
     
-    // Insert an element (r, c) with value v
-    void insert(int r, int c, double v) {
-        // If value is 0, we might need to remove an existing element
-        if (std::abs(v) < 1e-10) {
-            RowNode* rowNode = getRowNode(r);
-            if (rowNode != nullptr) {
-                removeFromRow(rowNode, c);
-                if (rowNode->elements == nullptr) {
-                    cleanupEmptyRows();
+    static std::string manifestPath(const std::string& dir) {
+        return dir + "/session.txt";
+    }
+    
+    static std::string matrixPath(const std::string& dir, size_t index) {
+        return dir + "/matrix_" + std::to_string(index) + ".spm";
+    }
+    
+    // Mark an entry as the most recently used
+    void touch(Entry& entry) {
+        entry.lastUsed = ++clock;
+    }
+    
+    // Evict least recently used matrices until the budget is met. The matrix
+    // at index keep (the one just requested) is never evicted.
+    void enforceBudget(size_t keep) {
+        while (memoryBudget > 0 && loadedBytes > memoryBudget) {
+            size_t victim = entries.size();
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (i != keep && entries[i].matrix != nullptr &&
+                    (victim == entries.size() || entries[i].lastUsed < entries[victim].lastUsed)) {
+                    victim = i;
+                }
+            }
+            if (victim == entries.size()) {
+                return; // Only the kept matrix is loaded; it may exceed the budget on its own
+            }
+            spill(victim);
+        }
+    }
+    
+    // Drop a loaded matrix from memory, writing it to the spill directory first
+    // if it has no backing file yet
+    void spill(size_t index) {
+        Entry& entry = entries[index];
+        if (entry.path.empty()) {
+            makeDirectory(spillDir);
+            entry.path = spillDir + "/spill_" + std::to_string(spillFiles.size()) + ".spm";
+            entry.matrix->saveBinary(entry.path);
+            spillFiles.push_back(entry.path);
+        }
+        entry.matrix.reset();
+        loadedBytes -= entry.bytes;
+        entry.bytes = 0;
+    }
+    
+    void removeSpillFiles() {
+        for (size_t i = 0; i < spillFiles.size(); i++) {
+            std::remove(spillFiles[i].c_str());
+        }
+        spillFiles.clear();
+    }
+    
+public:
+    MatrixSession() : memoryBudget(0), loadedBytes(0), clock(0) {
+        const char* tmp = std::getenv("TMPDIR");
+#ifdef _WIN32
+        if (tmp == nullptr) tmp = std::getenv("TEMP");
+        spillDir = std::string(tmp != nullptr ? tmp : ".") + "/matrix_spill_" + std::to_string(_getpid());
+#else
+        spillDir = std::string(tmp != nullptr ? tmp : "/tmp") + "/matrix_spill_" + std::to_string(getpid());
+#endif
+    }
+    
+    ~MatrixSession() {
+        removeSpillFiles();
+#ifdef _WIN32
+        _rmdir(spillDir.c_str());
+#else
+        rmdir(spillDir.c_str());
+#endif
+    }
+    
+    MatrixSession(const MatrixSession&) = delete;
+    MatrixSession& operator=(const MatrixSession&) = delete;
+    
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    
+    // Memory budget for loaded matrices in bytes (0 means unlimited)
+    void setMemoryBudget(size_t bytes) {
+        memoryBudget = bytes;
+        enforceBudget(entries.size());
+    }
+    size_t getMemoryBudget() const { return memoryBudget; }
+    size_t getLoadedBytes() const { return loadedBytes; }
+    
+    void setSpillDirectory(const std::string& dir) { spillDir = dir; }
+    
+    // Store a new matrix and return its index
+    size_t push_back(SparseMatrix matrix) {
+        Entry entry;
+        entry.bytes = matrix.memoryUsage();
+        entry.matrix = std::make_shared<const SparseMatrix>(std::move(matrix));
+        touch(entry);
+        entries.push_back(entry);
+        loadedBytes += entry.bytes;
+        enforceBudget(entries.size() - 1);
+        return entries.size() - 1;
+    }
+    
+    // Store an already shared matrix without copying it and return its index
+    size_t push_back(const std::shared_ptr<const SparseMatrix>& matrix) {
+        Entry entry;
+        entry.bytes = matrix->memoryUsage();
+        entry.matrix = matrix;
+        touch(entry);
+        entries.push_back(entry);
+        loadedBytes += entry.bytes;
+        enforceBudget(entries.size() - 1);
+        return entries.size() - 1;
+    }
+    
+    // Get a stored matrix, mapping it in from disk if it is not loaded. The
+    // returned pointer keeps the matrix alive even if it is evicted meanwhile.
+    std::shared_ptr<const SparseMatrix> get(size_t index) {
+        if (index >= entries.size()) {
+            throw std::out_of_range("Matrix index out of range");
+        }
+        Entry& entry = entries[index];
+        if (entry.matrix == nullptr) {
+            entry.matrix = std::make_shared<const SparseMatrix>(SparseMatrix::loadBinary(entry.path));
+            entry.bytes = entry.matrix->memoryUsage();
+            loadedBytes += entry.bytes;
+        }
+        touch(entry);
+        std::shared_ptr<const SparseMatrix> result = entry.matrix;
+        enforceBudget(index);
+        return result;
+    }
+    
+    // Give a stored matrix a name usable in expressions
+    void setName(const std::string& name, size_t index) {
+        if (index >= entries.size()) {
+            throw std::out_of_range("Matrix index out of range");
+        }
+        names[name] = index;
+    }
+    
+    // Look up a matrix by name; returns false if the name is unknown
+    bool findName(const std::string& name, size_t& index) const {
+        std::map<std::string, size_t>::const_iterator it = names.find(name);
+        if (it == names.end()) {
+            return false;
+        }
+        index = it->second;
+        return true;
+    }
+    
+    bool isLoaded(size_t index) const {
+        return index < entries.size() && entries[index].matrix != nullptr;
+    }
+    
+    // Save every matrix to a session directory. Matrices that were never loaded
+    // are copied file to file (or left alone when already in that directory).
+    void save(const std::string& dir) {
+        makeDirectory(dir);
+        
+        for (size_t i = 0; i < entries.size(); i++) {
+            std::string target = matrixPath(dir, i);
+            if (entries[i].matrix != nullptr) {
+                if (entries[i].path != target) {
+                    entries[i].matrix->saveBinary(target);
+                }
+            } else if (entries[i].path != target) {
+                copyFile(entries[i].path, target);
+            }
+            entries[i].path = target;
+        }
+        
+        std::string manifest = manifestPath(dir);
+        std::string tmpPath = manifest + ".tmp";
+        {
+            std::ofstream out(tmpPath, std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot create file " + tmpPath);
+            }
+            out << "SPMX-SESSION 2" << std::endl;
+            out << entries.size() << std::endl;
+            for (size_t i = 0; i < entries.size(); i++) {
+                out << "matrix_" << i << ".spm" << std::endl;
+            }
+            out << names.size() << std::endl;
+            for (std::map<std::string, size_t>::const_iterator it = names.begin(); it != names.end(); ++it) {
+                out << it->first << " " << it->second << std::endl;
+            }
+            if (!out) {
+                throw std::runtime_error("Failed writing file " + tmpPath);
+            }
+        }
+        if (std::rename(tmpPath.c_str(), manifest.c_str()) != 0) {
+            std::remove(tmpPath.c_str());
+            throw std::runtime_error("Cannot replace file " + manifest);
+        }
+    }
+    
+    // Check whether a directory holds a saved session
+    static bool exists(const std::string& dir) {
+        std::ifstream in(manifestPath(dir));
+        return static_cast<bool>(in);
+    }
+    
+    // Replace the current matrices with a saved session. Only the manifest is
+    // read here; each matrix file is mapped when the matrix is first used.
+    void load(const std::string& dir) {
+        std::ifstream in(manifestPath(dir));
+        if (!in) {
+            throw std::runtime_error("No saved session in " + dir);
+        }
+        
+        std::string magic;
+        int version = 0;
+        size_t count = 0;
+        in >> magic >> version >> count;
+        if (!in || magic != "SPMX-SESSION" || (version != 1 && version != 2)) {
+            throw std::runtime_error("Unsupported session manifest in " + dir);
+        }
+        
+        std::vector<Entry> loaded(count);
+        for (size_t i = 0; i < count; i++) {
+            std::string name;
+            if (!(in >> name)) {
+                throw std::runtime_error("Session manifest is truncated");
+            }
+            loaded[i].path = dir + "/" + name;
+        }
+        
+        std::map<std::string, size_t> loadedNames;
+        size_t nameCount = 0;
+        if (version >= 2 && !(in >> nameCount)) {
+            throw std::runtime_error("Session manifest is truncated");
+        }
+        for (size_t i = 0; i < nameCount; i++) {
+            std::string name;
+            size_t index;
+            if (!(in >> name >> index) || index >= count) {
+                throw std::runtime_error("Session manifest is truncated");
+            }
+            loadedNames[name] = index;
+        }
+        
+        entries.swap(loaded);
+        names.swap(loadedNames);
+        loadedBytes = 0;
+        removeSpillFiles();
+    }
+};
+
+// Size-bounded cache of operation results, keyed by the operation, the
+// operands' fingerprints and any scalar argument. Least recently used results
+// are evicted first. Safe to use from several threads.
+class OperationCache {
+public:
+    enum Operation { Add, Subtract, ScalarMultiply, Multiply, ScalarDivide, Transpose, Inverse, Combine };
+    
+private:
+    struct Key {
+        int operation;
+        uint64_t first;     // Fingerprint of the first operand
+        uint64_t second;    // Fingerprint of the second operand, 0 if none
+        uint64_t scalar;    // Bits of the scalar argument, 0 if none
+        
+        bool operator<(const Key& other) const {
+            if (operation != other.operation) return operation < other.operation;
+            if (first != other.first) return first < other.first;
+            if (second != other.second) return second < other.second;
+            return scalar < other.scalar;
+        }
+    };
+    
+    struct CacheItem {
+        Key key;
+        std::shared_ptr<const SparseMatrix> result;
+        size_t bytes;       // Memory used by the result
+    };
+    
+    std::list<CacheItem> items;  // Most recently used first
+    std::map<Key, std::list<CacheItem>::iterator> index;
+    size_t capacityBytes;        // Maximum memory held by cached results
+    size_t usedBytes;            // Memory held by cached results
+    size_t hits;
+    size_t misses;
+    mutable std::mutex lock;
+    
+    void evictUntil(size_t limit) {
+        while (usedBytes > limit && !items.empty()) {
+            usedBytes -= items.back().bytes;
+            index.erase(items.back().key);
+            items.pop_back();
+        }
+    }
+    
+    static Key makeKey(Operation operation, uint64_t first, uint64_t second, double scalar) {
+        Key key;
+        key.operation = operation;
+        key.first = first;
+        key.second = second;
+        std::memcpy(&key.scalar, &scalar, sizeof(key.scalar));
+        return key;
+    }
+    
+    std::shared_ptr<const SparseMatrix> find(const Key& key) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::map<Key, std::list<CacheItem>::iterator>::iterator it = index.find(key);
+        if (it == index.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        items.splice(items.begin(), items, it->second);
+        return it->second->result;
+    }
+    
+    void store(const Key& key, const std::shared_ptr<const SparseMatrix>& result) {
+        size_t bytes = result->memoryUsage();
+        std::lock_guard<std::mutex> guard(lock);
+        if (bytes > capacityBytes || index.count(key) > 0) {
+            return;
+        }
+        
+        evictUntil(capacityBytes - bytes);
+        CacheItem item = {key, result, bytes};
+        items.push_front(item);
+        index[key] = items.begin();
+        usedBytes += bytes;
+    }
+    
+    std::shared_ptr<const SparseMatrix> lookupOrRun(const Key& key, const std::function<SparseMatrix()>& compute) {
+        std::shared_ptr<const SparseMatrix> result = find(key);
+        if (result == nullptr) {
+            result = std::make_shared<const SparseMatrix>(compute());
+            store(key, result);
+        }
+        return result;
+    }
+    
+public:
+    explicit OperationCache(size_t capacity = 64 * 1024 * 1024)
+        : capacityBytes(capacity), usedBytes(0), hits(0), misses(0) {}
+    
+    // Return the cached result of an operation on one or two matrices, or
+    // compute and cache it
+    std::shared_ptr<const SparseMatrix> getOrCompute(Operation operation, const SparseMatrix& first,
+                                                     const SparseMatrix* second, double scalar,
+                                                     const std::function<SparseMatrix()>& compute) {
+        Key key = makeKey(operation, first.fingerprint(), second != nullptr ? second->fingerprint() : 0, scalar);
+        return lookupOrRun(key, compute);
+    }
+    
+    // Same for a weighted sum of any number of r x c matrices. The shape is
+    // part of the key, since terms that cancel out leave no operands at all.
+    std::shared_ptr<const SparseMatrix> getOrCompute(const std::vector<double>& weights,
+                                                     const std::vector<const SparseMatrix*>& terms, int r, int c,
+                                                     const std::function<SparseMatrix()>& compute) {
+        uint64_t combined = 0;
+        for (size_t k = 0; k < terms.size(); k++) {
+            uint64_t bits;
+            std::memcpy(&bits, &weights[k], sizeof(bits));
+            combined = mixHash(combined ^ terms[k]->fingerprint()) ^ mixHash(bits + k);
+        }
+        uint64_t shape = (static_cast<uint64_t>(static_cast<uint32_t>(r)) << 32) | static_cast<uint32_t>(c);
+        Key key = makeKey(Combine, combined, mixHash(mixHash(shape) + terms.size()), 0.0);
+        return lookupOrRun(key, compute);
+    }
+    
+    void setCapacity(size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        capacityBytes = bytes;
+        evictUntil(capacityBytes);
+    }
+    
+    size_t getHits() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return hits;
+    }
+    
+    size_t getMisses() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return misses;
+    }
+};
+
+// Evaluates calculator expressions such as "C = (A + B) * A' - 2*D".
+// All statements of a script (separated by ';') are parsed into one operation
+// DAG: repeated subexpressions share a node, additions, subtractions and
+// scalings fuse into a single linear-combination pass, and independent
+// subtrees are evaluated in parallel. Only statement results are stored.
+class ExpressionEvaluator {
+public:
+    // Outcome of one statement of a script
+    struct StatementResult {
+        std::string name;   // Assigned name, empty if none
+        bool isScalar;      // True if the statement evaluated to a number
+        double scalar;      // The number, if isScalar
+        size_t index;       // Session index of the matrix, otherwise
+    };
+    
+private:
+    // Operation DAG node; children always have smaller ids than their parents
+    struct Node {
+        enum Kind { Leaf, Combine, Multiply, Transpose, Inverse };
+        Kind kind;
+        int rows;
+        int cols;
+        size_t matrixIndex;           // Leaf: session index
+        std::vector<int> children;    // Operand nodes
+        std::vector<double> weights;  // Combine: weight of each operand
+    };
+    
+    // Value of a parsed subexpression: a number or a matrix-valued node
+    struct Value {
+        bool isScalar;
+        double scalar;
+        int node;
+    };
+    
+    MatrixSession& session;
+    OperationCache* cache;               // Optional result cache
+    OperationControl* control;           // Optional cancellation and limits
+    std::vector<Node> nodes;
+    std::map<std::string, int> nodeIds;  // Canonical node key -> node id
+    std::map<std::string, int> locals;   // Names assigned earlier in the script
+    std::string text;                    // Statement being parsed
+    size_t pos;                          // Parse position in text
+    
+    static Value scalarValue(double v) {
+        Value value = {true, v, -1};
+        return value;
+    }
+    
+    static Value matrixValue(int node) {
+        Value value = {false, 0.0, node};
+        return value;
+    }
+    
+    static std::string weightKey(double w) {
+        uint64_t bits;
+        std::memcpy(&bits, &w, sizeof(bits));
+        return std::to_string(bits);
+    }
+    
+    // Add a node unless an identical one exists (common subexpression elimination)
+    int intern(const Node& node, const std::string& key) {
+        std::map<std::string, int>::const_iterator it = nodeIds.find(key);
+        if (it != nodeIds.end()) {
+            return it->second;
+        }
+        nodes.push_back(node);
+        nodeIds[key] = static_cast<int>(nodes.size()) - 1;
+        return static_cast<int>(nodes.size()) - 1;
+    }
+    
+    int leaf(size_t index) {
+        std::shared_ptr<const SparseMatrix> matrix = session.get(index);
+        Node node;
+        node.kind = Node::Leaf;
+        node.rows = matrix->getRows();
+        node.cols = matrix->getCols();
+        node.matrixIndex = index;
+        return intern(node, "L" + std::to_string(index));
+    }
+    
+    // Weighted sum of nodes. Nested sums are flattened into one node so the
+    // whole element-wise chain is evaluated in a single pass.
+    int combine(const std::vector<std::pair<double, int> >& terms, int r, int c) {
+        std::map<int, double> merged;
+        for (size_t t = 0; t < terms.size(); t++) {
+            const Node& operand = nodes[terms[t].second];
+            if (operand.kind == Node::Combine) {
+                for (size_t k = 0; k < operand.children.size(); k++) {
+                    merged[operand.children[k]] += terms[t].first * operand.weights[k];
                 }
+            } else {
+                merged[terms[t].second] += terms[t].first;
             }
-            return;
         }
         
-        // Get or create the row node
-        RowNode* rowNode = getRowNode(r, true);
-        insertIntoRow(rowNode, c, v);
+        Node node;
+        node.kind = Node::Combine;
+        node.rows = r;
+        node.cols = c;
+        std::string key = "C" + std::to_string(r) + "x" + std::to_string(c);
+        for (std::map<int, double>::const_iterator it = merged.begin(); it != merged.end(); ++it) {
+            if (it->second != 0.0) {
+                node.children.push_back(it->first);
+                node.weights.push_back(it->second);
+                key += " " + std::to_string(it->first) + ":" + weightKey(it->second);
+            }
+        }
+        
+        if (node.children.size() == 1 && node.weights[0] == 1.0) {
+            return node.children[0];
+        }
+        return intern(node, key);
     }
     
-    // Get value at position (r, c)
-    double get(int r, int c) const {
-        if (r < 0 || r >= rows || c < 0 || c >= cols) {
-            throw std::out_of_range("Index out of range");
+    int scale(int id, double w) {
+        std::vector<std::pair<double, int> > terms(1, std::make_pair(w, id));
+        return combine(terms, nodes[id].rows, nodes[id].cols);
+    }
+    
+    // True if the node is a single scaled operand; sets its operand and weight
+    bool isScaled(int id, int& operand, double& w) const {
+        const Node& node = nodes[id];
+        if (node.kind != Node::Combine || node.children.size() != 1) {
+            return false;
         }
-        
-        // Find the row
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr && rowNode->row < r) {
-            rowNode = rowNode->next;
+        operand = node.children[0];
+        w = node.weights[0];
+        return true;
+    }
+    
+    int multiply(int a, int b) {
+        if (nodes[a].cols != nodes[b].rows) {
+            throw std::invalid_argument("Matrix dimensions do not match for multiplication");
         }
         
-        // Row not found, return 0
-        if (rowNode == nullptr || rowNode->row != r) {
-            return 0.0;
+        // Pull scalings out of products: (s*A) * B = s * (A * B)
+        int operand;
+        double w;
+        if (isScaled(a, operand, w)) {
+            return scale(multiply(operand, b), w);
         }
-        
-        // Find the column in this row
-        MatrixNode* colNode = rowNode->elements;
-        while (colNode != nullptr && colNode->col < c) {
-            colNode = colNode->next;
+        if (isScaled(b, operand, w)) {
+            return scale(multiply(a, operand), w);
         }
         
-        // Column not found, return 0
-        if (colNode == nullptr || colNode->col != c) {
-            return 0.0;
+        Node node;
+        node.kind = Node::Multiply;
+        node.rows = nodes[a].rows;
+        node.cols = nodes[b].cols;
+        node.children.push_back(a);
+        node.children.push_back(b);
+        return intern(node, "M" + std::to_string(a) + "," + std::to_string(b));
+    }
+    
+    int transpose(int a) {
+        if (nodes[a].kind == Node::Transpose) {
+            return nodes[a].children[0]; // (A')' = A
+        }
+        int operand;
+        double w;
+        if (isScaled(a, operand, w)) {
+            return scale(transpose(operand), w);
         }
         
-        return colNode->value;
+        Node node;
+        node.kind = Node::Transpose;
+        node.rows = nodes[a].cols;
+        node.cols = nodes[a].rows;
+        node.children.push_back(a);
+        return intern(node, "T" + std::to_string(a));
     }
     
-    // Display the matrix
-    void display() const {
-        std::cout << "Matrix " << rows << "x" << cols << ":" << std::endl;
-        
-        // Check if matrix is entirely zero
-        if (rowList == nullptr) {
-            std::cout << "Empty matrix (all zeros)" << std::endl;
-            return;
+    int inverse(int a) {
+        if (nodes[a].rows != nodes[a].cols) {
+            throw std::invalid_argument("Matrix must be square to calculate inverse");
+        }
+        int operand;
+        double w;
+        if (isScaled(a, operand, w)) {
+            return scale(inverse(operand), 1.0 / w);
         }
         
-        // Display full matrix
-        for (int i = 0; i < rows; i++) {
-            for (int j = 0; j < cols; j++) {
-                std::cout << std::setw(8) << std::fixed << std::setprecision(2) << get(i, j) << " ";
-            }
-            std::cout << std::endl;
+        Node node;
+        node.kind = Node::Inverse;
+        node.rows = nodes[a].rows;
+        node.cols = nodes[a].cols;
+        node.children.push_back(a);
+        return intern(node, "I" + std::to_string(a));
+    }
+    
+    // Parsing helpers
+    void skipSpaces() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+            pos++;
         }
     }
     
-    // Display sparse representation
-    void displaySparse() const {
-        std::cout << "Sparse representation of " << rows << "x" << cols << " matrix:" << std::endl;
-        std::cout << "Row\tColumn\tValue" << std::endl;
-        
-        int nonZeroCount = 0;
-        RowNode* rowNode = rowList;
-        
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                std::cout << rowNode->row << "\t" << colNode->col << "\t" 
-                          << std::fixed << std::setprecision(2) << colNode->value << std::endl;
-                nonZeroCount++;
-                colNode = colNode->next;
+    bool accept(char ch) {
+        skipSpaces();
+        if (pos < text.size() && text[pos] == ch) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+    
+    void expect(char ch) {
+        if (!accept(ch)) {
+            throw std::invalid_argument(std::string("Syntax error: expected '") + ch + "' at position " + std::to_string(pos));
+        }
+    }
+    
+    std::string parseIdentifier() {
+        skipSpaces();
+        size_t start = pos;
+        if (pos < text.size() && (std::isalpha(static_cast<unsigned char>(text[pos])) || text[pos] == '_')) {
+            pos++;
+            while (pos < text.size() && (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_')) {
+                pos++;
             }
-            rowNode = rowNode->next;
         }
-        
-        std::cout << "Total non-zero elements: " << nonZeroCount << std::endl;
+        return text.substr(start, pos - start);
     }
     
-    // Addition with another matrix
-    SparseMatrix add(const SparseMatrix& other) const {
-        if (rows != other.rows || cols != other.cols) {
-            throw std::invalid_argument("Matrix dimensions do not match for addition");
+    // Names of the form m<index> refer to matrices by their session index
+    static bool isIndexName(const std::string& name, size_t& index) {
+        if (name.size() < 2 || name[0] != 'm') {
+            return false;
         }
-        
-        SparseMatrix result(rows, cols);
-        
-        // Add all elements from this matrix
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                result.insert(rowNode->row, colNode->col, colNode->value);
-                colNode = colNode->next;
+        for (size_t i = 1; i < name.size(); i++) {
+            if (!std::isdigit(static_cast<unsigned char>(name[i]))) {
+                return false;
             }
-            rowNode = rowNode->next;
         }
-        
-        // Add all elements from other matrix
-        rowNode = other.rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                double currentValue = result.get(rowNode->row, colNode->col);
-                result.insert(rowNode->row, colNode->col, currentValue + colNode->value);
-                colNode = colNode->next;
+        index = std::stoul(name.substr(1));
+        return true;
+    }
+    
+    Value lookup(const std::string& name) {
+        std::map<std::string, int>::const_iterator local = locals.find(name);
+        if (local != locals.end()) {
+            return matrixValue(local->second);
+        }
+        size_t index;
+        if (session.findName(name, index) || isIndexName(name, index)) {
+            if (index >= session.size()) {
+                throw std::invalid_argument("No matrix with index " + std::to_string(index));
             }
-            rowNode = rowNode->next;
+            return matrixValue(leaf(index));
         }
-        
-        return result;
+        throw std::invalid_argument("Unknown matrix name '" + name + "'");
     }
     
-    // Subtraction with another matrix
-    SparseMatrix subtract(const SparseMatrix& other) const {
-        if (rows != other.rows || cols != other.cols) {
-            throw std::invalid_argument("Matrix dimensions do not match for subtraction");
+    Value addValues(const Value& a, const Value& b, double sign) {
+        if (a.isScalar && b.isScalar) {
+            return scalarValue(a.scalar + sign * b.scalar);
         }
-        
-        SparseMatrix result(rows, cols);
-        
-        // Add all elements from this matrix
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                result.insert(rowNode->row, colNode->col, colNode->value);
-                colNode = colNode->next;
+        if (a.isScalar || b.isScalar) {
+            throw std::invalid_argument("Cannot add a number to a matrix");
+        }
+        if (nodes[a.node].rows != nodes[b.node].rows || nodes[a.node].cols != nodes[b.node].cols) {
+            throw std::invalid_argument(sign > 0 ? "Matrix dimensions do not match for addition"
+                                                 : "Matrix dimensions do not match for subtraction");
+        }
+        std::vector<std::pair<double, int> > terms;
+        terms.push_back(std::make_pair(1.0, a.node));
+        terms.push_back(std::make_pair(sign, b.node));
+        return matrixValue(combine(terms, nodes[a.node].rows, nodes[a.node].cols));
+    }
+    
+    Value multiplyValues(const Value& a, const Value& b) {
+        if (a.isScalar && b.isScalar) {
+            return scalarValue(a.scalar * b.scalar);
+        }
+        if (a.isScalar) {
+            return matrixValue(scale(b.node, a.scalar));
+        }
+        if (b.isScalar) {
+            return matrixValue(scale(a.node, b.scalar));
+        }
+        return matrixValue(multiply(a.node, b.node));
+    }
+    
+    Value divideValues(const Value& a, const Value& b) {
+        if (!b.isScalar) {
+            throw std::invalid_argument("Can only divide by a number");
+        }
+        if (std::abs(b.scalar) < 1e-10) {
+            throw std::invalid_argument("Division by zero");
+        }
+        if (a.isScalar) {
+            return scalarValue(a.scalar / b.scalar);
+        }
+        return matrixValue(scale(a.node, 1.0 / b.scalar));
+    }
+    
+    // expression := term (('+' | '-') term)*
+    Value parseExpression() {
+        Value value = parseTerm();
+        while (true) {
+            if (accept('+')) {
+                value = addValues(value, parseTerm(), 1.0);
+            } else if (accept('-')) {
+                value = addValues(value, parseTerm(), -1.0);
+            } else {
+                return value;
             }
-            rowNode = rowNode->next;
         }
-        
-        // Subtract all elements from other matrix
-       // Subtract all elements from other matrix
-        rowNode = other.rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                double currentValue = result.get(rowNode->row, colNode->col);
-                result.insert(rowNode->row, colNode->col, currentValue - colNode->value);
-                colNode = colNode->next;
+    }
+    
+    // term := unary (('*' | '/') unary)*
+    Value parseTerm() {
+        Value value = parseUnary();
+        while (true) {
+            if (accept('*')) {
+                value = multiplyValues(value, parseUnary());
+            } else if (accept('/')) {
+                value = divideValues(value, parseUnary());
+            } else {
+                return value;
             }
-            rowNode = rowNode->next;
         }
-        
-        return result;
     }
     
-    // Scalar multiplication
-    SparseMatrix scalarMultiply(double scalar) const {
-        SparseMatrix result(rows, cols);
-        
-        if (std::abs(scalar) < 1e-10) {
-            return result; // Return empty matrix if scalar is zero
+    // unary := ('-' | '+') unary | primary "'"*
+    Value parseUnary() {
+        if (accept('-')) {
+            return multiplyValues(scalarValue(-1.0), parseUnary());
+        }
+        if (accept('+')) {
+            return parseUnary();
         }
         
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                double newValue = colNode->value * scalar;
-                if (std::abs(newValue) >= 1e-10) {
-                    result.insert(rowNode->row, colNode->col, newValue);
-                }
-                colNode = colNode->next;
+        Value value = parsePrimary();
+        while (accept('\'')) {
+            if (!value.isScalar) {
+                value = matrixValue(transpose(value.node));
             }
-            rowNode = rowNode->next;
         }
-        
-        return result;
+        return value;
     }
     
-    // Matrix multiplication
-    SparseMatrix multiply(const SparseMatrix& other) const {
-        if (cols != other.rows) {
-            throw std::invalid_argument("Matrix dimensions do not match for multiplication");
+    // primary := number | name | function '(' expression ')' | '(' expression ')'
+    Value parsePrimary() {
+        skipSpaces();
+        if (accept('(')) {
+            Value value = parseExpression();
+            expect(')');
+            return value;
         }
         
-        SparseMatrix result(rows, other.cols);
+        if (pos < text.size() && (std::isdigit(static_cast<unsigned char>(text[pos])) || text[pos] == '.')) {
+            size_t used = 0;
+            double number = std::stod(text.substr(pos), &used);
+            pos += used;
+            return scalarValue(number);
+        }
         
-        // For each row in this matrix
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            int i = rowNode->row;
-            
-            // For each column in the result matrix
-            for (int j = 0; j < other.cols; j++) {
-                double sum = 0.0;
-                
-                // For each element in this row
-                MatrixNode* colNode = rowNode->elements;
-                while (colNode != nullptr) {
-                    int k = colNode->col;
-                    double val1 = colNode->value;
-                    double val2 = other.get(k, j);
-                    
-                    if (std::abs(val2) >= 1e-10) {
-                        sum += val1 * val2;
-                    }
-                    
-                    colNode = colNode->next;
-                }
-                
-                if (std::abs(sum) >= 1e-10) {
-                    result.insert(i, j, sum);
-                }
+        std::string name = parseIdentifier();
+        if (name.empty()) {
+            throw std::invalid_argument("Syntax error at position " + std::to_string(pos));
+        }
+        if (accept('(')) {
+            Value argument = parseExpression();
+            expect(')');
+            if (argument.isScalar) {
+                throw std::invalid_argument("Function " + name + " needs a matrix argument");
             }
-            
-            rowNode = rowNode->next;
+            if (name == "inv") {
+                return matrixValue(inverse(argument.node));
+            }
+            if (name == "transpose") {
+                return matrixValue(transpose(argument.node));
+            }
+            throw std::invalid_argument("Unknown function '" + name + "'");
         }
-        
-        return result;
+        return lookup(name);
     }
     
-    // Scalar division
-    SparseMatrix scalarDivide(double scalar) const {
-        if (std::abs(scalar) < 1e-10) {
-            throw std::invalid_argument("Division by zero");
+    // Compute a non-leaf node from the values of its operands
+    std::shared_ptr<const SparseMatrix> computeNode(const Node& node,
+                                                    const std::vector<std::shared_ptr<const SparseMatrix> >& args) const {
+        OperationCache::Operation operation = OperationCache::Combine;
+        std::function<SparseMatrix()> compute;
+        std::vector<const SparseMatrix*> terms;
+        switch (node.kind) {
+            case Node::Combine:
+                for (size_t k = 0; k < args.size(); k++) {
+                    terms.push_back(args[k].get());
+                }
+                compute = [&]() { return SparseMatrix::linearCombination(node.weights, terms, node.rows, node.cols, control); };
+                break;
+            case Node::Multiply:
+                operation = OperationCache::Multiply;
+                compute = [&]() { return args[0]->multiply(*args[1], control); };
+                break;
+            case Node::Transpose:
+                operation = OperationCache::Transpose;
+                compute = [&]() { return args[0]->transpose(control); };
+                break;
+            case Node::Inverse:
+                operation = OperationCache::Inverse;
+                compute = [&]() { return args[0]->inverse(); };
+                break;
+            default:
+                throw std::logic_error("Unexpected expression node");
         }
         
-        return scalarMultiply(1.0 / scalar);
+        if (cache == nullptr) {
+            return std::make_shared<const SparseMatrix>(compute());
+        }
+        if (node.kind == Node::Combine) {
+            return cache->getOrCompute(node.weights, terms, node.rows, node.cols, compute);
+        }
+        return cache->getOrCompute(operation, *args[0], args.size() > 1 ? args[1].get() : nullptr, 0.0, compute);
     }
     
-    // Transpose of matrix
-    SparseMatrix transpose() const {
-        SparseMatrix result(cols, rows);
+    // Evaluate every node reachable from the roots on a fixed pool of up to
+    // hardware_concurrency() threads, this one included. Ready nodes are
+    // taken in id order, which is topological since children have smaller
+    // ids, and a node becomes ready once all its operands are computed, so
+    // independent subtrees run in parallel without a thread per node.
+    // Results and workspaces come from the operands' memory resources, which
+    // are not assumed to be thread safe: nodes only run concurrently when
+    // every operand uses new/delete, and one at a time otherwise.
+    std::vector<std::shared_ptr<const SparseMatrix> > evaluate(const std::vector<int>& roots) {
+        typedef std::shared_ptr<const SparseMatrix> MatrixPtr;
         
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                result.insert(colNode->col, rowNode->row, colNode->value);
-                colNode = colNode->next;
+        std::vector<bool> needed(nodes.size(), false);
+        for (size_t i = 0; i < roots.size(); i++) {
+            needed[roots[i]] = true;
+        }
+        for (int id = static_cast<int>(nodes.size()) - 1; id >= 0; id--) {
+            if (needed[id]) {
+                for (size_t k = 0; k < nodes[id].children.size(); k++) {
+                    needed[nodes[id].children[k]] = true;
+                }
             }
-            rowNode = rowNode->next;
         }
         
-        return result;
-    }
-    
-    // Calculate determinant (only for 2x2 and 3x3 matrices)
-    double determinant() const {
-        if (rows != cols) {
-            throw std::invalid_argument("Matrix must be square to calculate determinant");
+        std::vector<MatrixPtr> results(nodes.size());
+        std::vector<int> waitingOn(nodes.size(), 0);         // Operands of each node not computed yet
+        std::vector<std::vector<int> > users(nodes.size());  // Needed nodes that use each node
+        std::set<int> ready;
+        int pending = 0;                                     // Needed nodes not computed yet
+        bool concurrent = true;                              // All operands allocate with new/delete
+        for (size_t id = 0; id < nodes.size(); id++) {
+            if (!needed[id]) {
+                continue;
+            }
+            const Node& node = nodes[id];
+            if (node.kind == Node::Leaf) {
+                // Session access is not thread safe, so operands are fetched here
+                results[id] = session.get(node.matrixIndex);
+                concurrent = concurrent && results[id]->getResource() == std::pmr::new_delete_resource();
+                continue;
+            }
+            pending++;
+            for (size_t k = 0; k < node.children.size(); k++) {
+                if (!results[node.children[k]]) {
+                    waitingOn[id]++;
+                    users[node.children[k]].push_back(static_cast<int>(id));
+                }
+            }
+            if (waitingOn[id] == 0) {
+                ready.insert(static_cast<int>(id));
+            }
         }
         
-        if (rows == 1) {
-            return get(0, 0);
-        } else if (rows == 2) {
-            return get(0, 0) * get(1, 1) - get(0, 1) * get(1, 0);
-        } else if (rows == 3) {
-            double a = get(0, 0);
-            double b = get(0, 1);
-            double c = get(0, 2);
-            double d = get(1, 0);
-            double e = get(1, 1);
-            double f = get(1, 2);
-            double g = get(2, 0);
-            double h = get(2, 1);
-            double i = get(2, 2);
-            
-            return a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
-        } else {
-            throw std::invalid_argument("Determinant calculation for matrices larger than 3x3 not implemented");
+        std::mutex lock;
+        std::condition_variable changed;
+        std::exception_ptr error;   // First failure; the other workers stop taking nodes
+        auto work = [&]() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                changed.wait(guard, [&]() { return pending == 0 || error || !ready.empty(); });
+                if (pending == 0 || error) {
+                    return;
+                }
+                int id = *ready.begin();
+                ready.erase(ready.begin());
+                guard.unlock();
+                
+                MatrixPtr value;
+                try {
+                    std::vector<MatrixPtr> args;
+                    for (size_t k = 0; k < nodes[id].children.size(); k++) {
+                        args.push_back(results[nodes[id].children[k]]);
+                    }
+                    value = computeNode(nodes[id], args);
+                } catch (...) {
+                    guard.lock();
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    changed.notify_all();
+                    return;
+                }
+                
+                guard.lock();
+                results[id] = value;
+                pending--;
+                for (size_t u = 0; u < users[id].size(); u++) {
+                    if (--waitingOn[users[id][u]] == 0) {
+                        ready.insert(users[id][u]);
+                    }
+                }
+                changed.notify_all();
+            }
+        };
+        
+        int threads = concurrent ? std::min(pending, static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))) : 1;
+        std::vector<std::thread> workers;
+        try {
+            for (int t = 1; t < threads; t++) {
+                workers.push_back(std::thread(work));
+            }
+        } catch (const std::system_error&) {
+            // Could not start every thread; the ones running share the work
         }
-    }
-    
-    // Calculate inverse (only for 2x2 and 3x3 matrices)
-    SparseMatrix inverse() const {
-        if (rows != cols) {
-            throw std::invalid_argument("Matrix must be square to calculate inverse");
+        work();
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
         }
         
-        double det = determinant();
-        if (std::abs(det) < 1e-10) {
-            throw std::invalid_argument("Matrix is singular, inverse does not exist");
+        std::vector<MatrixPtr> values;
+        for (size_t i = 0; i < roots.size(); i++) {
+            values.push_back(results[roots[i]]);
         }
+        return values;
+    }
+    
+public:
+    explicit ExpressionEvaluator(MatrixSession& s, OperationCache* c = nullptr, OperationControl* ctl = nullptr)
+        : session(s), cache(c), control(ctl), pos(0) {}
+    
+    // Parse and evaluate a script of ';'-separated statements of the form
+    // "name = expression" or "expression". Matrix results are stored in the
+    // session (and named, for assignments) once the whole script succeeds.
+    std::vector<StatementResult> run(const std::string& script) {
+        nodes.clear();
+        nodeIds.clear();
+        locals.clear();
         
-        SparseMatrix result(rows, cols);
+        std::vector<StatementResult> results;
+        std::vector<Value> values;
+        std::vector<int> roots;
         
-        if (rows == 1) {
-            result.insert(0, 0, 1.0 / get(0, 0));
-        } else if (rows == 2) {
-            result.insert(0, 0, get(1, 1) / det);
-            result.insert(0, 1, -get(0, 1) / det);
-            result.insert(1, 0, -get(1, 0) / det);
-            result.insert(1, 1, get(0, 0) / det);
-        } else if (rows == 3) {
-            double a = get(0, 0);
-            double b = get(0, 1);
-            double c = get(0, 2);
-            double d = get(1, 0);
-            double e = get(1, 1);
-            double f = get(1, 2);
-            double g = get(2, 0);
-            double h = get(2, 1);
-            double i = get(2, 2);
+        size_t start = 0;
+        while (start <= script.size()) {
+            size_t end = script.find(';', start);
+            if (end == std::string::npos) {
+                end = script.size();
+            }
+            text = script.substr(start, end - start);
+            pos = 0;
+            start = end + 1;
             
-            // Calculate cofactor matrix
-            double A = e * i - f * h;
-            double B = -(d * i - f * g);
-            double C = d * h - e * g;
-            double D = -(b * i - c * h);
-            double E = a * i - c * g;
-            double F = -(a * h - b * g);
-            double G = b * f - c * e;
-            double H = -(a * f - c * d);
-            double I = a * e - b * d;
+            skipSpaces();
+            if (pos == text.size()) {
+                continue; // Empty statement
+            }
             
-            // Adjugate (transpose of cofactor matrix)
-            result.insert(0, 0, A / det);
-            result.insert(0, 1, D / det);
-            result.insert(0, 2, G / det);
-            result.insert(1, 0, B / det);
-            result.insert(1, 1, E / det);
-            result.insert(1, 2, H / det);
-            result.insert(2, 0, C / det);
-            result.insert(2, 1, F / det);
-            result.insert(2, 2, I / det);
-        } else {
-            throw std::invalid_argument("Inverse calculation for matrices larger than 3x3 not implemented");
-        }
-        
-        return result;
-    }
-    
-    // Count non-zero elements
-    int countNonZero() const {
-        int count = 0;
-        RowNode* rowNode = rowList;
-        while (rowNode != nullptr) {
-            MatrixNode* colNode = rowNode->elements;
-            while (colNode != nullptr) {
-                count++;
-                colNode = colNode->next;
+            // Optional "name =" prefix
+            StatementResult result = {"", false, 0.0, 0};
+            std::string name = parseIdentifier();
+            size_t indexName;
+            if (!name.empty() && accept('=')) {
+                if (isIndexName(name, indexName)) {
+                    throw std::invalid_argument("Names like '" + name + "' are reserved for matrix indices");
+                }
+                result.name = name;
+            } else {
+                pos = 0;
+            }
+            
+            Value value = parseExpression();
+            skipSpaces();
+            if (pos != text.size()) {
+                throw std::invalid_argument("Syntax error at position " + std::to_string(pos));
             }
-            rowNode = rowNode->next;
+            
+            if (!value.isScalar) {
+                if (!result.name.empty()) {
+                    locals[result.name] = value.node;
+                }
+                roots.push_back(value.node);
+            }
+            result.isScalar = value.isScalar;
+            result.scalar = value.scalar;
+            results.push_back(result);
+            values.push_back(value);
         }
-        return count;
+        
+        std::vector<std::shared_ptr<const SparseMatrix> > matrices = evaluate(roots);
+        
+        // Store results; a statement that is just an existing matrix only names it
+        size_t next = 0;
+        std::map<int, size_t> storedNodes;
+        for (size_t i = 0; i < results.size(); i++) {
+            if (values[i].isScalar) {
+                continue;
+            }
+            int node = values[i].node;
+            if (nodes[node].kind == Node::Leaf) {
+                results[i].index = nodes[node].matrixIndex;
+            } else if (storedNodes.count(node) > 0) {
+                results[i].index = storedNodes[node];
+            } else {
+                results[i].index = session.push_back(matrices[next]);
+                storedNodes[node] = results[i].index;
+            }
+            next++;
+            if (!results[i].name.empty()) {
+                session.setName(results[i].name, results[i].index);
+            }
+        }
+        
+        return results;
     }
 };
 
@@ -778,6 +7758,10 @@ void runTests() {
         std::cout << "Verification M1 * M1^-1:" << std::endl;
         SparseMatrix mVerify = m1.multiply(mInv);
         mVerify.display();
+        SparseMatrix identity(2, 2);
+        identity.insert(0, 0, 1);
+        identity.insert(1, 1, 1);
+        std::cout << "Equals identity (tolerance 1e-9): " << (mVerify.approxEquals(identity, 1e-9) ? "yes" : "no") << std::endl;
         std::cout << std::endl;
     } catch (const std::exception& e) {
         std::cout << "Error: " << e.what() << std::endl << std::endl;
@@ -795,6 +7779,570 @@ void runTests() {
     std::cout << "Sparse representation:" << std::endl;
     m3.displaySparse();
     std::cout << std::endl;
+    
+    // Test 9: Binary save/load
+    std::cout << "Test 9: Binary save/load" << std::endl;
+    m3.saveBinary("test_matrix.spm");
+    SparseMatrix mLoaded = SparseMatrix::loadBinary("test_matrix.spm");
+    std::remove("test_matrix.spm");
+    std::cout << "Matrix loaded back from disk:" << std::endl;
+    mLoaded.display();
+    std::cout << "Identical to the saved matrix: " << (mLoaded == m3 ? "yes" : "no") << std::endl;
+    std::cout << std::endl;
+    
+    // Test 10: Expressions
+    std::cout << "Test 10: Expressions" << std::endl;
+    MatrixSession session;
+    session.push_back(m1);
+    session.push_back(m2);
+    ExpressionEvaluator evaluator(session);
+    std::vector<ExpressionEvaluator::StatementResult> results = evaluator.run("C = (m0 + m1) * m0' - 2*m1");
+    std::cout << "Result of C = (M1 + M2) * M1' - 2*M2:" << std::endl;
+    session.get(results[0].index)->display();
+    std::cout << std::endl;
+    
+    // Test 11: Result cache
+    std::cout << "Test 11: Result cache" << std::endl;
+    OperationCache cache;
+    for (int i = 0; i < 3; i++) {
+        cache.getOrCompute(OperationCache::Multiply, m1, &m2, 0.0, [&]() { return m1.multiply(m2); });
+    }
+    std::cout << "M1 * M2 computed 3 times: " << cache.getMisses() << " computed, "
+              << cache.getHits() << " from cache" << std::endl;
+    
+    // Sums that cancel out have no operands left, so only the shape tells them apart
+    MatrixSession shapes;
+    SparseMatrix small(2, 2);
+    small.insert(0, 1, 4.0);
+    SparseMatrix large(3, 3);
+    large.insert(2, 0, 5.0);
+    shapes.push_back(small);
+    shapes.push_back(large);
+    ExpressionEvaluator cachedEvaluator(shapes, &cache);
+    std::shared_ptr<const SparseMatrix> smallZero = shapes.get(cachedEvaluator.run("m0 - m0")[0].index);
+    std::shared_ptr<const SparseMatrix> largeZero = shapes.get(cachedEvaluator.run("m1 - m1")[0].index);
+    std::cout << "m0 - m0 and m1 - m1 keep their shapes: " << smallZero->getRows() << "x" << smallZero->getCols()
+              << " and " << largeZero->getRows() << "x" << largeZero->getCols() << std::endl << std::endl;
+    
+    // Test 12: Cancellation
+    std::cout << "Test 12: Cancellation" << std::endl;
+    OperationControl control;
+    control.cancel();
+    try {
+        m1.multiply(m2, &control);
+        std::cout << "Multiplication was not cancelled" << std::endl;
+    } catch (const OperationAborted& e) {
+        std::cout << "Multiplication stopped: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 13: Shared memory
+    std::cout << "Test 13: Shared memory" << std::endl;
+    try {
+        std::string name = "sparse_matrix_test_" + std::to_string(getpid());
+        SharedSparseMatrix::publish(m3, name);
+        std::unique_ptr<SharedSparseMatrix> shared = SharedSparseMatrix::attach(name);
+        SharedSparseMatrix::unpublish(name);
+        std::cout << "Attached matrix (read in place):" << std::endl;
+        shared->view().display();
+        std::cout << "Its transpose equals M3': " << (shared->view().transpose() == m3.transpose() ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+#ifndef _WIN32
+    // Test 14: Distributed matrix-vector product
+    std::cout << "Test 14: Distributed matrix-vector product on 3 processes" << std::endl;
+    SparseMatrix m4(6, 6);
+    for (int i = 0; i < 6; i++) {
+        m4.insert(i, i, 4);
+        m4.insert(i, (i + 1) % 6, -1);
+        m4.insert(i, (i + 5) % 6, -1);
+    }
+    std::vector<double> x(6);
+    for (int i = 0; i < 6; i++) {
+        x[i] = i + 1;
+    }
+    std::vector<double> expected = m4.multiplyVector(x);
+    try {
+        runLocalRanks(3, 64, [&](Transport& transport) {
+            std::vector<int> owner = DistributedSparseMatrix::blockPartition(6, transport.size());
+            DistributedSparseMatrix local(m4, transport, owner, owner);
+            std::vector<double> xLocal;
+            for (size_t k = 0; k < local.getOwnedCols().size(); k++) {
+                xLocal.push_back(x[local.getOwnedCols()[k]]);
+            }
+            std::vector<double> yLocal = local.multiplyVector(xLocal);
+            
+            // Rank 0 gathers the pieces and checks them against the serial product
+            if (transport.rank() != 0) {
+                transport.send(0, 3, yLocal);
+                return;
+            }
+            std::vector<double> y(6);
+            for (int r = 0; r < transport.size(); r++) {
+                std::vector<double> piece = r == 0 ? yLocal : transport.receive(r, 3);
+                for (int i = 0, k = 0; i < 6; i++) {
+                    if (owner[i] == r) {
+                        y[i] = piece[k++];
+                    }
+                }
+            }
+            std::cout << "Distributed result matches serial: " << (y == expected ? "yes" : "no") << std::endl;
+        });
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+#endif
+    
+    // Test 15: Graph partitioning
+    std::cout << "Test 15: Partitioning a 12x12 grid with shuffled numbering into 4 parts" << std::endl;
+    std::vector<int> label(144);
+    for (int i = 0; i < 144; i++) {
+        label[i] = i;
+    }
+    std::shuffle(label.begin(), label.end(), std::mt19937(7));
+    SparseMatrix grid(144, 144);
+    for (int i = 0; i < 12; i++) {
+        for (int j = 0; j < 12; j++) {
+            int v = label[i * 12 + j];
+            grid.insert(v, v, 4);
+            if (i > 0) grid.insert(v, label[(i - 1) * 12 + j], -1);
+            if (i < 11) grid.insert(v, label[(i + 1) * 12 + j], -1);
+            if (j > 0) grid.insert(v, label[i * 12 + j - 1], -1);
+            if (j < 11) grid.insert(v, label[i * 12 + j + 1], -1);
+        }
+    }
+    GraphPartitioner::Result blocks = GraphPartitioner::evaluate(grid, DistributedSparseMatrix::blockPartition(144, 4), 4);
+    GraphPartitioner::Result parts = GraphPartitioner::partition(grid, 4);
+    std::cout << "Contiguous blocks: " << blocks.edgeCut << " cut entries, imbalance " << blocks.imbalance << std::endl;
+    std::cout << "Multilevel:        " << parts.edgeCut << " cut entries, imbalance " << parts.imbalance << std::endl;
+    std::cout << std::endl;
+    
+    // Test 16: Nested dissection
+    std::cout << "Test 16: Nested-dissection ordering of the same grid" << std::endl;
+    EliminationOrdering given = EliminationOrdering::natural(grid);
+    EliminationOrdering dissected = EliminationOrdering::nestedDissection(grid, 8);
+    std::cout << "Given order:       " << given.factorNonZeros() << " factor entries, "
+              << given.levels().size() << " parallel steps" << std::endl;
+    std::cout << "Nested dissection: " << dissected.factorNonZeros() << " factor entries, "
+              << dissected.levels().size() << " parallel steps" << std::endl;
+    std::cout << std::endl;
+    
+    // Test 17: Recovery from the update log
+    std::cout << "Test 17: Recovering a logged matrix" << std::endl;
+    try {
+        const char* tmp = std::getenv("TMPDIR");
+        std::string dir = std::string(tmp != nullptr ? tmp : "/tmp") + "/durable_test_" + std::to_string(getpid());
+        DurableSparseMatrix::destroy(dir);
+        {
+            DurableSparseMatrix durable(dir, 3, 3);
+            durable.insert(0, 0, 1);
+            durable.insert(1, 2, 5);
+            durable.snapshot();
+            durable.insert(2, 1, 7);
+            durable.remove(1, 2);
+            durable.sync();
+        }   // Closed here without a final snapshot, as after a crash
+        DurableSparseMatrix recovered(dir);
+        std::cout << "Updates replayed from the log: " << recovered.getRecoveredRecords() << std::endl;
+        recovered.matrix().display();
+        DurableSparseMatrix::destroy(dir);
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 18: Matrix Market loading in small chunks
+    std::cout << "Test 18: Matrix Market file read in 5-byte chunks" << std::endl;
+    try {
+        const char* tmp = std::getenv("TMPDIR");
+        std::string path = std::string(tmp != nullptr ? tmp : "/tmp") + "/loader_test_" + std::to_string(getpid()) + ".mtx";
+        MatrixMarketLoader::save(grid, path);
+        MatrixMarketLoader::Options options;
+        options.chunkBytes = 5; // Nearly every line straddles two chunks
+        SparseMatrix loaded = MatrixMarketLoader::load(path, options);
+        std::remove(path.c_str());
+        std::cout << "Loaded grid equals the saved one: " << (loaded == grid ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 19: Compressed binary format
+    std::cout << "Test 19: Compressed binary format" << std::endl;
+    try {
+        std::ostringstream plain;
+        std::ostringstream compressed;
+        grid.writeBinary(plain);
+        grid.writeCompressed(compressed, 32);
+        std::string image = compressed.str();
+        std::cout << "Plain: " << plain.str().size() << " bytes, compressed: " << image.size() << " bytes" << std::endl;
+        SparseMatrix restored = SparseMatrix::fromBinary(image.data(), image.size());
+        std::cout << "Decompressed grid equals the original: " << (restored == grid ? "yes" : "no") << std::endl;
+        SparseMatrix middle = SparseMatrix::fromCompressed(image.data(), image.size(), 40, 50, 2);
+        std::cout << "Rows 40-49 alone: " << middle.getRows() << "x" << middle.getCols() << " with "
+                  << middle.countNonZero() << " elements" << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 20: Views over external arrays
+    std::cout << "Test 20: Views over external CSR and COO arrays" << std::endl;
+    int64_t externalRowPtr[] = {0, 2, 3};
+    int32_t externalRows[] = {0, 0, 1};
+    int32_t externalCols[] = {0, 1, 1};
+    double externalValues[] = {1, 2, 3};
+    try {
+        SparseMatrixView csrView(2, 2, externalRowPtr, externalCols, externalValues, true);
+        SparseMatrixView cooView = SparseMatrixView::fromCOO(2, 2, 3, externalRows, externalCols, externalValues, true);
+        csrView.display();
+        std::cout << "CSR and COO views agree: " << (csrView == cooView ? "yes" : "no") << std::endl;
+        SparseMatrix upper(2, 2);
+        upper.insert(0, 0, 1);
+        upper.insert(0, 1, 2);
+        upper.insert(1, 1, 3);
+        std::cout << "Same fingerprint as the matrix built by insert: "
+                  << (csrView.fingerprint() == upper.fingerprint() ? "yes" : "no") << std::endl;
+        CSRArrays exported = m3.toCSR();
+        std::cout << "View of M3's exported arrays equals M3: " << (SparseMatrixView(exported) == m3 ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 21: Matrices in a caller-supplied memory resource
+    std::cout << "Test 21: Matrices in a per-request arena" << std::endl;
+    try {
+        std::pmr::monotonic_buffer_resource arena;
+        SparseMatrix local(m1, &arena);
+        SparseMatrix product = local.multiply(m2);
+        SparseMatrix sum = local.add(m1);
+        std::cout << "Results stay in the arena: "
+                  << (product.getResource() == &arena && sum.getResource() == &arena ? "yes" : "no") << std::endl;
+        std::cout << "Same product as the heap matrices: " << (product == m1.multiply(m2) ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 22: The same kernels over other storage layouts
+    std::cout << "Test 22: Kernels over CSR, CSC, blocked and hypersparse storage" << std::endl;
+    try {
+        SparseMatrix expected = grid.multiply(grid.transpose()).add(grid);
+        BasicSparseMatrix<CSRStorage> csr = BasicSparseMatrix<CSRStorage>::from(grid);
+        BasicSparseMatrix<CSCStorage> csc = BasicSparseMatrix<CSCStorage>::from(grid);
+        BasicSparseMatrix<BSRStorage<2> > bsr = BasicSparseMatrix<BSRStorage<2> >::from(grid);
+        BasicSparseMatrix<HypersparseStorage> hyper = BasicSparseMatrix<HypersparseStorage>::from(grid);
+        std::cout << "CSR: " << (csr.multiply(csr.transpose()).add(csr) == expected ? "matches" : "differs")
+                  << ", " << csr.memoryUsage() << " bytes" << std::endl;
+        std::cout << "CSC: " << (csc.multiply(csc.transpose()).add(csc) == expected ? "matches" : "differs")
+                  << ", " << csc.memoryUsage() << " bytes" << std::endl;
+        std::cout << "BSR 2x2: " << (bsr.multiply(bsr.transpose()).add(bsr) == expected ? "matches" : "differs")
+                  << ", " << bsr.memoryUsage() << " bytes" << std::endl;
+        std::cout << "Hypersparse: " << (hyper.multiply(hyper.transpose()).add(hyper) == expected ? "matches" : "differs")
+                  << ", " << hyper.memoryUsage() << " bytes" << std::endl;
+        std::cout << "Linked rows: " << grid.memoryUsage() << " bytes" << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 23: Fixed-size matrices evaluated by the compiler
+    std::cout << "Test 23: Tridiagonal 3x3 stencil with a compile-time pattern" << std::endl;
+    try {
+        constexpr uint64_t tridiagonal = diagonalPattern(3) | patternBit(3, 0, 1) | patternBit(3, 1, 0) |
+                                         patternBit(3, 1, 2) | patternBit(3, 2, 1);
+        constexpr FixedSparseMatrix<3, 3, tridiagonal> stencil(2, -1, -1, 2, -1, -1, 2);
+        constexpr double stencilDeterminant = stencil.determinant();
+        std::cout << "Determinant (constant expression): " << stencilDeterminant << std::endl;
+        std::cout << "Stored values: " << stencil.storedCount << " of 9, square has "
+                  << stencil.multiply(stencil).storedCount << std::endl;
+        std::cout << "Inverse matches SparseMatrix: "
+                  << (stencil.inverse().toSparseMatrix() == stencil.toSparseMatrix().inverse() ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 24: Short rows kept in the row's own slots
+    std::cout << "Test 24: Rows growing past their inline slots and shrinking back" << std::endl;
+    try {
+        SparseMatrix rowsTest(2, 8);
+        for (int j = 0; j < 7; j++) {
+            rowsTest.insert(0, j, j + 1);
+        }
+        rowsTest.insert(1, 3, 9);
+        for (int j = 0; j < 7; j += 2) {
+            rowsTest.insert(0, j, 0);
+        }
+        rowsTest.insert(0, 6, 4);
+        rowsTest.displaySparse();
+        SparseMatrix packed(rowsTest);
+        std::cout << "Memory: " << rowsTest.memoryUsage() << " bytes, copy with exact slots: "
+                  << packed.memoryUsage() << " bytes" << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 25: Scaling without touching the values
+    std::cout << "Test 25: Lazy scale factor" << std::endl;
+    try {
+        SparseMatrix scaled = m1.scalarMultiply(4.0);
+        scaled.scaleBy(0.25);
+        std::cout << "M1 * 4 * 0.25 equals M1: " << (scaled == m1 ? "yes" : "no") << std::endl;
+        scaled.scaleBy(2.0);
+        scaled.insert(0, 0, 7);   // Folds the factor into the values
+        scaled.display();
+        SparseMatrix direct(m1.getRows(), m1.getCols());
+        m1.forEachElement([&](int r, int c, double v) {
+            direct.insert(r, c, 2.0 * v);
+        });
+        direct.insert(0, 0, 7);
+        std::cout << "Same fingerprint as the matrix built by insert: "
+                  << (scaled.fingerprint() == direct.fingerprint() ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 26: Cached transpose, diagonal and norms
+    std::cout << "Test 26: Derived data cached until the matrix changes" << std::endl;
+    try {
+        SparseMatrix cached(grid);
+        cached.setDerivedCaching(true);
+        std::shared_ptr<const SparseMatrix> first = cached.cachedTranspose();
+        std::cout << "Second transpose reused: " << (cached.cachedTranspose() == first ? "yes" : "no") << std::endl;
+        double before = cached.frobeniusNorm();
+        cached.insert(0, 0, cached.get(0, 0) + 1);
+        std::cout << "Recomputed after insert: " << (cached.cachedTranspose() != first ? "yes" : "no")
+                  << ", Frobenius norm " << before << " -> " << cached.frobeniusNorm()
+                  << ", diagonal[0] " << cached.diagonal()[0] << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 27: Maintained product and sum
+    std::cout << "Test 27: Product and sum updated row by row" << std::endl;
+    try {
+        SparseMatrix left(grid), other(grid);
+        MaintainedProduct product(left, grid);
+        MaintainedSum sum(left, other);
+        uint64_t checkpoint = left.getVersion();
+        left.insert(1, 2, 7);
+        left.insert(3, 0, 1);
+        std::vector<int> changed = left.rowsChangedSince(checkpoint);
+        std::cout << "Rows changed since checkpoint: " << changed.size() << std::endl;
+        std::cout << "Product rows recomputed: " << product.update()
+                  << ", matches multiply: " << (product.result() == left.multiply(grid) ? "yes" : "no") << std::endl;
+        std::cout << "Sum rows recomputed: " << sum.update()
+                  << ", matches add: " << (sum.result() == left.add(other) ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 28: Sliding time window
+    std::cout << "Test 28: Sliding time window" << std::endl;
+    try {
+        WindowedSparseMatrix window(3, 3, 10, 2);
+        window.add(0, 0, 1, 1);
+        window.add(5, 0, 1, 2);
+        window.add(12, 2, 2, 4);
+        std::cout << "Window (0, 1) = " << window.get(0, 1) << ", non-zeros: " << window.countNonZero() << std::endl;
+        size_t dropped = window.advanceTo(25);
+        std::cout << "Dropped " << dropped << " bucket(s); (0, 1) = " << window.get(0, 1)
+                  << ", (2, 2) = " << window.merged().get(2, 2) << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 29: Streaming product straight from a Matrix Market stream
+    std::cout << "Test 29: Streaming matrix-vector product" << std::endl;
+    try {
+        std::ostringstream text;
+        text << std::setprecision(17) << "%%MatrixMarket matrix coordinate real general\n" << grid.getRows() << " " << grid.getCols()
+             << " " << grid.countNonZero() << "\n";
+        grid.forEachElement([&](int r, int c, double value) {
+            text << r + 1 << " " << c + 1 << " " << value << "\n";
+        });
+        std::vector<double> x(grid.getCols());
+        for (size_t i = 0; i < x.size(); i++) {
+            x[i] = static_cast<double>(i % 7) - 3.0;
+        }
+        MatrixMarketLoader::Options options;
+        options.chunkBytes = 64;
+        std::istringstream in(text.str());
+        std::vector<double> streamed = MatrixMarketLoader::multiplyVector(in, x, false, options);
+        std::vector<double> expected = grid.multiplyVector(x);
+        double difference = 0.0;
+        for (size_t i = 0; i < expected.size(); i++) {
+            difference = std::max(difference, std::abs(streamed[i] - expected[i]));
+        }
+        std::cout << "Streamed A * x matches multiplyVector: " << (difference < 1e-9 ? "yes" : "no") << std::endl;
+        
+        // A repeated entry counts the same when streamed as when loaded
+        const char* tmp = std::getenv("TMPDIR");
+        std::string path = std::string(tmp != nullptr ? tmp : "/tmp") + "/duplicates_test_" + std::to_string(getpid()) + ".mtx";
+        {
+            std::ofstream out(path);
+            out << "%%MatrixMarket matrix coordinate real general\n2 2 3\n1 1 2.0\n2 1 1.0\n1 1 3.0\n";
+        }
+        std::vector<double> ones(2, 1.0);
+        std::vector<double> fromFile = MatrixMarketLoader::multiplyVector(path, ones);
+        std::vector<double> fromLoad = MatrixMarketLoader::load(path).multiplyVector(ones);
+        std::remove(path.c_str());
+        std::cout << "Duplicates summed by both (5, 1): " << fromFile[0] << ", " << fromFile[1]
+                  << (fromFile == fromLoad ? " (same)" : " (differ)") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 30: Concurrent inserts
+    std::cout << "Test 30: Inserting from several threads" << std::endl;
+    try {
+        ConcurrentInserter staging(grid.getRows(), grid.getCols());
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; t++) {
+            writers.push_back(std::thread([&grid, &staging, t]() {
+                grid.forEachElement([&](int r, int c, double value) {
+                    if (r % 4 == t) {
+                        staging.insert(r, c, value);
+                    }
+                });
+            }));
+        }
+        for (size_t t = 0; t < writers.size(); t++) {
+            writers[t].join();
+        }
+        std::cout << "Staged " << staging.pending() << " elements" << std::endl;
+        SparseMatrix ingested = staging.compact();
+        std::cout << "Compacted matrix equals the original: " << (ingested == grid ? "yes" : "no") << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+    
+    // Test 31: Reproducible reductions
+    std::cout << "Test 31: Reductions with the same bits for any thread count" << std::endl;
+    try {
+        // 20000 row sums make five blocks of REDUCTION_BLOCK, the last one partial,
+        // so the fixed tree has an odd block to carry up a level
+        SparseMatrix spread(20000, 400);
+        for (int i = 0; i < 20000; i++) {
+            for (int k = 0; k < 4; k++) {
+                int j = (i * 37 + k * 101) % 400;
+                spread.insert(i, j, std::pow(10.0, (i + k) % 13 - 6) * ((i + j) % 2 == 0 ? 1 : -1));
+            }
+        }
+        std::vector<double> x(400);
+        for (int i = 0; i < 400; i++) {
+            x[i] = std::sin(i);
+        }
+        double norm = spread.frobeniusNorm(1, Summation::Reproducible);
+        std::vector<double> y = spread.multiplyVector(x, 1, Summation::Reproducible);
+        bool identical = true;
+        for (int threads = 2; threads <= 8; threads++) {
+            identical = identical && spread.frobeniusNorm(threads, Summation::Reproducible) == norm
+                        && spread.multiplyVector(x, threads, Summation::Reproducible) == y;
+        }
+        std::cout << "Identical for 1 to 8 threads: " << (identical ? "yes" : "no") << std::endl;
+        
+        // Streamed products add the entries in file order, whatever the chunks
+        const char* tmp = std::getenv("TMPDIR");
+        std::string path = std::string(tmp != nullptr ? tmp : "/tmp") + "/spread_" + std::to_string(getpid()) + ".mtx";
+        MatrixMarketLoader::save(spread, path);
+        MatrixMarketLoader::Options options;
+        options.summation = Summation::Reproducible;
+        options.chunkBytes = 1 << 20;
+        std::vector<double> streamed = MatrixMarketLoader::multiplyVector(path, x, false, options);
+        options.chunkBytes = 4099;
+        options.chunksAhead = 3;
+        bool sameStreamed = MatrixMarketLoader::multiplyVector(path, x, false, options) == streamed;
+        std::remove(path.c_str());
+        std::cout << "Streamed product identical for other chunk sizes: " << (sameStreamed ? "yes" : "no") << std::endl;
+        
+        auto seconds = [&](Summation summation) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int repeat = 0; repeat < 20; repeat++) {
+                spread.multiplyVector(x, 1, summation);
+                spread.frobeniusNorm(1, summation);
+            }
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        };
+        double fast = seconds(Summation::Fast);
+        double reproducible = seconds(Summation::Reproducible);
+        std::cout << "Reproducible cost: " << reproducible / std::max(fast, 1e-9) << "x the fast path" << std::endl;
+    } catch (const std::exception& e) {
+        std::cout << "Error: " << e.what() << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+// Set by the Ctrl+C handler while an operation runs in the background
+volatile std::sig_atomic_t interruptRequested = 0;
+
+void handleInterrupt(int) {
+    interruptRequested = 1;
+}
+
+// Run an operation on a worker thread and show its progress until it is done.
+// Ctrl+C cancels the operation instead of ending the program, so the stored
+// matrices survive a product that takes longer than expected.
+template <class Result>
+Result runInBackground(OperationControl& control, const std::function<Result()>& operation) {
+    interruptRequested = 0;
+    void (*previousHandler)(int) = std::signal(SIGINT, handleInterrupt);
+    std::future<Result> pending = std::async(std::launch::async, operation);
+    
+    bool shown = false;
+    while (pending.wait_for(std::chrono::milliseconds(250)) != std::future_status::ready) {
+        if (interruptRequested) {
+            interruptRequested = 0;
+            control.cancel();
+        }
+        long long total = control.rowsTotal();
+        if (total > 0) {
+            std::cout << "\rProgress: " << control.rowsDone() << "/" << total << " rows ("
+                      << 100 * control.rowsDone() / total << "%)   " << std::flush;
+            shown = true;
+        }
+    }
+    
+    std::signal(SIGINT, previousHandler);
+    if (shown) {
+        std::cout << std::endl;
+    }
+    return pending.get();
+}
+
+// Value of a numeric command-line option. The whole text must be a finite
+// number above zero, or zero itself where zero is allowed.
+double numberOption(const std::string& option, const char* text, bool allowZero) {
+    char* end;
+    errno = 0;
+    double value = std::strtod(text, &end);
+    if (end == text || *end != '\0' || errno == ERANGE || !std::isfinite(value) ||
+        value < 0 || (value == 0 && !allowZero)) {
+        throw std::invalid_argument("Invalid value for " + option + ": " + text);
+    }
+    return value;
+}
+
+// A command-line size in megabytes, in bytes
+size_t megabytesOption(const std::string& option, const char* text, bool allowZero) {
+    double bytes = numberOption(option, text, allowZero) * 1024 * 1024;
+    if (bytes >= static_cast<double>(std::numeric_limits<size_t>::max())) {
+        throw std::invalid_argument("Value for " + option + " is too large: " + text);
+    }
+    return static_cast<size_t>(bytes);
 }
 
 // Main menu function
@@ -812,14 +8360,97 @@ void displayMenu() {
     std::cout << "10. View matrix" << std::endl;
     std::cout << "11. View sparse representation" << std::endl;
     std::cout << "12. Run tests" << std::endl;
+    std::cout << "13. Save session" << std::endl;
+    std::cout << "14. Load session" << std::endl;
+    std::cout << "15. Set memory budget" << std::endl;
+    std::cout << "16. Evaluate expressions" << std::endl;
+    std::cout << "17. Set operation limits" << std::endl;
+    std::cout << "18. Publish matrix to shared memory" << std::endl;
+    std::cout << "19. Remove shared matrix" << std::endl;
+    std::cout << "20. Partition matrix rows" << std::endl;
+    std::cout << "21. Nested-dissection ordering" << std::endl;
+    std::cout << "22. Load Matrix Market file" << std::endl;
     std::cout << "0. Exit" << std::endl;
     std::cout << "Enter your choice: ";
 }
 
-int main() {
-    std::vector<SparseMatrix> matrices;
+int main(int argc, char* argv[]) {
+    MatrixSession matrices;
+    OperationCache cache;
+    double operationTimeout = 0;      // Seconds per operation, 0 = no limit
+    size_t operationMemoryLimit = 0;  // Bytes per result, 0 = no limit
     int choice = -1;
     
+    // Usage: matrix_calculator [--memory-budget MB] [--spill-dir DIR] [--cache-size MB]
+    //                          [--timeout SECONDS] [--operation-memory MB] [session-dir]
+    //        matrix_calculator --spmv MATRIX.mtx|- VECTOR [--transpose]
+    // The session directory is restored at startup and saved again on exit.
+    // --spmv prints A * x (or A' * x) for a Matrix Market file, or standard
+    // input with "-", and a file of whitespace-separated values, then exits.
+    // Sizes and times must be positive numbers; a cache size of 0 disables the cache.
+    std::string sessionDir;
+    std::string spmvMatrix, spmvVector;
+    bool spmvTransposed = false;
+    try {
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "--spmv" && i + 2 < argc) {
+                spmvMatrix = argv[++i];
+                spmvVector = argv[++i];
+            } else if (arg == "--transpose") {
+                spmvTransposed = true;
+            } else if (arg == "--memory-budget" && i + 1 < argc) {
+                matrices.setMemoryBudget(megabytesOption(arg, argv[++i], false));
+            } else if (arg == "--spill-dir" && i + 1 < argc) {
+                matrices.setSpillDirectory(argv[++i]);
+            } else if (arg == "--cache-size" && i + 1 < argc) {
+                cache.setCapacity(megabytesOption(arg, argv[++i], true));
+            } else if (arg == "--timeout" && i + 1 < argc) {
+                operationTimeout = numberOption(arg, argv[++i], false);
+            } else if (arg == "--operation-memory" && i + 1 < argc) {
+                operationMemoryLimit = megabytesOption(arg, argv[++i], false);
+            } else {
+                sessionDir = arg;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (!spmvMatrix.empty()) {
+        try {
+            std::ifstream vectorFile(spmvVector);
+            if (!vectorFile) {
+                throw std::runtime_error("Cannot open file " + spmvVector);
+            }
+            std::vector<double> x;
+            double value;
+            while (vectorFile >> value) {
+                x.push_back(value);
+            }
+            std::vector<double> y = spmvMatrix == "-"
+                ? MatrixMarketLoader::multiplyVector(std::cin, x, spmvTransposed)
+                : MatrixMarketLoader::multiplyVector(spmvMatrix, x, spmvTransposed);
+            std::cout << std::setprecision(17);
+            for (size_t i = 0; i < y.size(); i++) {
+                std::cout << y[i] << "\n";
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (!sessionDir.empty() && MatrixSession::exists(sessionDir)) {
+        try {
+            matrices.load(sessionDir);
+            std::cout << "Restored " << matrices.size() << " matrices from " << sessionDir << std::endl;
+        } catch (const std::exception& e) {
+            std::cout << "Error: " << e.what() << std::endl;
+        }
+    }
+    
     while (choice != 0) {
         displayMenu();
         std::cin >> choice;
@@ -848,10 +8479,15 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx1].add(matrices[idx2]);
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> first = matrices.get(idx1);
+                    std::shared_ptr<const SparseMatrix> second = matrices.get(idx2);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::Add, *first, second.get(), 0.0,
+                                                  [&]() { return first->add(*second, &control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 3: {  // Subtract two matrices
@@ -871,10 +8507,15 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx1].subtract(matrices[idx2]);
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> first = matrices.get(idx1);
+                    std::shared_ptr<const SparseMatrix> second = matrices.get(idx2);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::Subtract, *first, second.get(), 0.0,
+                                                  [&]() { return first->subtract(*second, &control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 4: {  // Multiply by scalar
@@ -895,10 +8536,14 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx].scalarMultiply(scalar);
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> matrix = matrices.get(idx);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::ScalarMultiply, *matrix, nullptr, scalar,
+                                                  [&]() { return matrix->scalarMultiply(scalar, &control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 5: {  // Multiply two matrices
@@ -918,10 +8563,15 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx1].multiply(matrices[idx2]);
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> first = matrices.get(idx1);
+                    std::shared_ptr<const SparseMatrix> second = matrices.get(idx2);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::Multiply, *first, second.get(), 0.0,
+                                                  [&]() { return first->multiply(*second, &control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 6: {  // Divide by scalar
@@ -942,10 +8592,14 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx].scalarDivide(scalar);
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> matrix = matrices.get(idx);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::ScalarDivide, *matrix, nullptr, scalar,
+                                                  [&]() { return matrix->scalarDivide(scalar, &control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 7: {  // Transpose a matrix
@@ -963,10 +8617,14 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx].transpose();
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> matrix = matrices.get(idx);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::Transpose, *matrix, nullptr, 0.0,
+                                                  [&]() { return matrix->transpose(&control); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 8: {  // Calculate determinant
@@ -984,7 +8642,7 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    double det = matrices[idx].determinant();
+                    double det = matrices.get(idx)->determinant();
                     std::cout << "Determinant: " << det << std::endl;
                     break;
                 }
@@ -1003,10 +8661,14 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    SparseMatrix result = matrices[idx].inverse();
-                    matrices.push_back(result);
-                    std::cout << "Result stored as matrix " << matrices.size() - 1 << std::endl;
-                    result.display();
+                    std::shared_ptr<const SparseMatrix> matrix = matrices.get(idx);
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    size_t stored = matrices.push_back(runInBackground<std::shared_ptr<const SparseMatrix> >(control, [&]() {
+                        return cache.getOrCompute(OperationCache::Inverse, *matrix, nullptr, 0.0,
+                                                  [&]() { return matrix->inverse(); });
+                    }));
+                    std::cout << "Result stored as matrix " << stored << std::endl;
+                    matrices.get(stored)->display();
                     break;
                 }
                 case 10: {  // View matrix
@@ -1024,7 +8686,7 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    matrices[idx].display();
+                    matrices.get(idx)->display();
                     break;
                 }
                 case 11: {  // View sparse representation
@@ -1042,14 +8704,198 @@ std::cout << "Invalid matrix indices." << std::endl;
                         break;
                     }
                     
-                    matrices[idx].displaySparse();
+                    matrices.get(idx)->displaySparse();
                     break;
                 }
                 case 12: {  // Run tests
                     runTests();
                     break;
                 }
+                case 13: {  // Save session
+                    std::string dir;
+                    std::cout << "Enter session directory: ";
+                    std::cin >> dir;
+                    
+                    matrices.save(dir);
+                    std::cout << "Saved " << matrices.size() << " matrices to " << dir << std::endl;
+                    break;
+                }
+                case 14: {  // Load session
+                    std::string dir;
+                    std::cout << "Enter session directory: ";
+                    std::cin >> dir;
+                    
+                    matrices.load(dir);
+                    std::cout << "Restored " << matrices.size() << " matrices from " << dir << std::endl;
+                    break;
+                }
+                case 15: {  // Set memory budget
+                    double megabytes = -1;
+                    std::cout << "Matrices in memory use " << std::fixed << std::setprecision(2)
+                              << matrices.getLoadedBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+                    std::cout << "Enter memory budget in MB (0 for unlimited): ";
+                    std::cin >> megabytes;
+                    
+                    if (!(megabytes >= 0 && megabytes * 1024 * 1024 < static_cast<double>(std::numeric_limits<size_t>::max()))) {
+                        std::cout << "Invalid memory budget." << std::endl;
+                        break;
+                    }
+                    
+                    matrices.setMemoryBudget(static_cast<size_t>(megabytes * 1024 * 1024));
+                    std::cout << "Matrices in memory now use " << matrices.getLoadedBytes() / (1024.0 * 1024.0)
+                              << " MB" << std::endl;
+                    break;
+                }
+                case 16: {  // Evaluate expressions
+                    std::string script;
+                    std::cout << "Matrices are named m0, m1, ... or by earlier assignments." << std::endl;
+                    std::cout << "Enter expressions separated by ';' (e.g. C = (m0 + m1) * m0' - 2*m2):" << std::endl;
+                    std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+                    std::getline(std::cin, script);
+                    
+                    OperationControl control(operationTimeout, operationMemoryLimit);
+                    ExpressionEvaluator evaluator(matrices, &cache, &control);
+                    std::vector<ExpressionEvaluator::StatementResult> results =
+                        runInBackground<std::vector<ExpressionEvaluator::StatementResult> >(control, [&]() {
+                            return evaluator.run(script);
+                        });
+                    for (size_t i = 0; i < results.size(); i++) {
+                        if (results[i].isScalar) {
+                            std::cout << "Result: " << results[i].scalar << std::endl;
+                            continue;
+                        }
+                        std::cout << "Result stored as matrix " << results[i].index;
+                        if (!results[i].name.empty()) {
+                            std::cout << " (" << results[i].name << ")";
+                        }
+                        std::cout << std::endl;
+                        matrices.get(results[i].index)->display();
+                    }
+                    break;
+                }
+                case 17: {  // Set operation limits
+                    double seconds = -1, megabytes = -1;
+                    std::cout << "Enter time limit per operation in seconds (0 for none): ";
+                    std::cin >> seconds;
+                    std::cout << "Enter memory limit per result in MB (0 for none): ";
+                    std::cin >> megabytes;
+                    
+                    if (!(seconds >= 0 && std::isfinite(seconds) && megabytes >= 0 &&
+                          megabytes * 1024 * 1024 < static_cast<double>(std::numeric_limits<size_t>::max()))) {
+                        std::cout << "Invalid limits." << std::endl;
+                        break;
+                    }
+                    
+                    operationTimeout = seconds;
+                    operationMemoryLimit = static_cast<size_t>(megabytes * 1024 * 1024);
+                    std::cout << "Limits updated. Press Ctrl+C to cancel a running operation." << std::endl;
+                    break;
+                }
+                case 18: {  // Publish matrix to shared memory
+                    if (matrices.empty()) {
+                        std::cout << "No matrices available. Create a matrix first." << std::endl;
+                        break;
+                    }
+                    
+                    int idx;
+                    std::string name;
+                    std::cout << "Enter index of matrix (0-" << matrices.size() - 1 << "): ";
+                    std::cin >> idx;
+                    std::cout << "Enter shared matrix name: ";
+                    std::cin >> name;
+                    
+                    if (idx < 0 || idx >= static_cast<int>(matrices.size())) {
+                        std::cout << "Invalid matrix index." << std::endl;
+                        break;
+                    }
+                    
+                    SharedSparseMatrix::publish(*matrices.get(idx), name);
+                    std::cout << "Matrix " << idx << " published as '" << name
+                              << "'. Other processes can now attach it read-only." << std::endl;
+                    break;
+                }
+                case 19: {  // Remove shared matrix
+                    std::string name;
+                    std::cout << "Enter shared matrix name: ";
+                    std::cin >> name;
+                    
+                    SharedSparseMatrix::unpublish(name);
+                    std::cout << "Shared matrix '" << name << "' removed." << std::endl;
+                    break;
+                }
+                case 20: {  // Partition matrix rows
+                    if (matrices.empty()) {
+                        std::cout << "No matrices available. Create a matrix first." << std::endl;
+                        break;
+                    }
+                    
+                    int idx, parts;
+                    std::cout << "Enter index of matrix (0-" << matrices.size() - 1 << "): ";
+                    std::cin >> idx;
+                    std::cout << "Enter number of parts: ";
+                    std::cin >> parts;
+                    
+                    if (idx < 0 || idx >= static_cast<int>(matrices.size())) {
+                        std::cout << "Invalid matrix index." << std::endl;
+                        break;
+                    }
+                    
+                    GraphPartitioner::Result result = GraphPartitioner::partition(*matrices.get(idx), parts);
+                    std::cout << "Part of each row:";
+                    for (size_t r = 0; r < result.part.size(); r++) {
+                        std::cout << " " << result.part[r];
+                    }
+                    std::cout << std::endl;
+                    std::cout << "Entries between parts: " << result.edgeCut
+                              << ", heaviest part / average: " << result.imbalance << std::endl;
+                    break;
+                }
+                case 21: {  // Nested-dissection ordering
+                    if (matrices.empty()) {
+                        std::cout << "No matrices available. Create a matrix first." << std::endl;
+                        break;
+                    }
+                    
+                    int idx;
+                    std::cout << "Enter index of matrix (0-" << matrices.size() - 1 << "): ";
+                    std::cin >> idx;
+                    
+                    if (idx < 0 || idx >= static_cast<int>(matrices.size())) {
+                        std::cout << "Invalid matrix index." << std::endl;
+                        break;
+                    }
+                    
+                    std::shared_ptr<const SparseMatrix> matrix = matrices.get(idx);
+                    EliminationOrdering given = EliminationOrdering::natural(*matrix);
+                    EliminationOrdering ordering = EliminationOrdering::nestedDissection(*matrix);
+                    std::cout << "Elimination order:";
+                    for (size_t k = 0; k < ordering.getOrder().size(); k++) {
+                        std::cout << " " << ordering.getOrder()[k];
+                    }
+                    std::cout << std::endl;
+                    std::cout << "Factor entries: " << ordering.factorNonZeros() << " (given order: "
+                              << given.factorNonZeros() << ")" << std::endl;
+                    std::cout << "Parallel steps: " << ordering.levels().size() << " (given order: "
+                              << given.levels().size() << ")" << std::endl;
+                    
+                    size_t stored = matrices.push_back(ordering.permute(*matrix));
+                    std::cout << "Reordered matrix stored as matrix " << stored << std::endl;
+                    break;
+                }
+                case 22: {  // Load Matrix Market file
+                    std::string path;
+                    std::cout << "Enter file path: ";
+                    std::cin >> path;
+                    
+                    size_t stored = matrices.push_back(MatrixMarketLoader::load(path));
+                    std::cout << "Matrix loaded and stored as matrix " << stored << std::endl;
+                    break;
+                }
                 case 0: {  // Exit
+                    if (!sessionDir.empty()) {
+                        matrices.save(sessionDir);
+                        std::cout << "Session saved to " << sessionDir << std::endl;
+                    }
                     std::cout << "Exiting program." << std::endl;
                     break;
                 }